@@ -3,16 +3,22 @@
 ##ml purge
 ##ml intel/2023a
 ##ml KAROLINA/FAKEintel
-module load intel
+module load intel 2> /dev/null
 
 PROGRAM="random_spd_system"
 ##FLAGS="-DMKL_ILP64 -qmkl-ilp64=parallel"
 ##LINKS="-qmkl-ilp64=parallel"
 
-LINKS="-L${MKLROOT}/lib/intel64 -lmkl_intel_lp64 -lmkl_sequential -lmkl_core -lpthread -lm -ldl"
-FLAGS="-I${MKLROOT}/include"
+# MKL if it is available, the built-in DGEMM of src/dense_blas.h otherwise
+if [ -n "${MKLROOT}" ] && command -v icpx > /dev/null
+then
+    LINKS="-L${MKLROOT}/lib/intel64 -lmkl_intel_lp64 -lmkl_intel_thread -lmkl_core -liomp5 -lpthread -lm -ldl"
+    FLAGS="-DUSE_MKL -I${MKLROOT}/include"
 
-icpx -O2 ${FLAGS} src/${PROGRAM}.cpp -o ${PROGRAM} $LINKS
+    icpx -O2 -qopenmp ${FLAGS} src/${PROGRAM}.cpp -o ${PROGRAM} $LINKS
+else
+    g++ -O2 -fopenmp src/${PROGRAM}.cpp -o ${PROGRAM}
+fi
 
 ./${PROGRAM} "$@"
 
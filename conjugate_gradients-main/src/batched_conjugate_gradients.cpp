@@ -0,0 +1,137 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "matrix_io.h"
+#include "batched_solver.h"
+
+
+
+
+
+int main(int argc, char ** argv)
+{
+    printf("Usage: ./batched_conjugate_gradients input_file_batch.bin output_file_sol.bin max_iters rel_error [options]\n");
+    printf("All parameters are optional and have default values\n");
+    printf("The solutions are written as a dense num_systems x size matrix, one row per system\n");
+    printf("Options:\n");
+    printf("  --threads N   number of OpenMP threads (default: OMP_NUM_THREADS or all cores)\n");
+    printf("\n");
+
+    const char * input_file_batch = "io/batch.bin";
+    const char * output_file_sol = "io/batch_sol.bin";
+    int max_iters = 1000;
+    double rel_error = 1e-9;
+    int num_threads = 1;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+
+    int num_positional = 0;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) { num_threads = atoi(argv[++i]); continue; }
+
+        num_positional++;
+        if(num_positional == 1) input_file_batch = argv[i];
+        if(num_positional == 2) output_file_sol = argv[i];
+        if(num_positional == 3) max_iters = atoi(argv[i]);
+        if(num_positional == 4) rel_error = atof(argv[i]);
+    }
+
+    if(num_threads < 1)
+    {
+        fprintf(stderr, "Wrong number of threads\n");
+        return 7;
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(num_threads);
+#else
+    if(num_threads > 1)
+    {
+        fprintf(stderr, "Compiled without OpenMP, running on a single thread\n");
+        num_threads = 1;
+    }
+#endif
+
+    printf("Command line arguments:\n");
+    printf("  input_file_batch:  %s\n", input_file_batch);
+    printf("  output_file_sol:   %s\n", output_file_sol);
+    printf("  max_iters:         %d\n", max_iters);
+    printf("  rel_error:         %e\n", rel_error);
+    printf("  num_threads:       %d\n", num_threads);
+    printf("  simd:              %s\n", simd_isa_name(active_simd_isa()));
+    printf("\n");
+
+
+
+    printf("Reading batch from file ...\n");
+    auto load_start = std::chrono::steady_clock::now();
+    batched_systems batch;
+    bool success_read_batch = read_batch_from_file(input_file_batch, &batch);
+    if(!success_read_batch)
+    {
+        fprintf(stderr, "Failed to read batch\n");
+        return 1;
+    }
+    double load_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - load_start).count();
+    printf("Load time: %.4f s\n", load_time);
+    printf("%zu systems of size %zu in %zu groups of %zu\n", batch.num_systems, batch.size, batch.num_groups, BATCH_WIDTH);
+    printf("Done\n");
+    printf("\n");
+
+    printf("Solving the systems ...\n");
+    double * x = new double[batch.num_groups * batch.size * BATCH_WIDTH];
+    batched_result result;
+    result.num_iters = new int[batch.num_systems];
+    result.rel_residual = new double[batch.num_systems];
+    auto solve_start = std::chrono::steady_clock::now();
+    batched_conjugate_gradients(batch, x, max_iters, rel_error, &result);
+    double solve_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - solve_start).count();
+
+    size_t num_converged = 0;
+    int most_iters = 0;
+    double total_iters = 0.0;
+    double largest_rel_residual = 0.0;
+    for(size_t s = 0; s < batch.num_systems; s++)
+    {
+        if(result.num_iters[s] <= max_iters) num_converged++;
+        most_iters = std::max(most_iters, result.num_iters[s]);
+        total_iters += result.num_iters[s];
+        largest_rel_residual = std::fmax(largest_rel_residual, result.rel_residual[s]);
+    }
+    printf("Converged %zu of %zu systems\n", num_converged, batch.num_systems);
+    printf("Iterations: %.1f on average, %d at most\n", total_iters / std::max<size_t>(batch.num_systems, 1), most_iters);
+    printf("Largest relative error: %e\n", largest_rel_residual);
+    printf("Solve time: %.4f s (%.0f systems/s)\n", solve_time, batch.num_systems / solve_time);
+    printf("Done\n");
+    printf("\n");
+
+    printf("Writing solutions to file ...\n");
+    double * sol = new double[batch.num_systems * batch.size];
+    deinterleave_batch_vectors(x, sol, batch.num_systems, batch.size);
+    bool success_write_sol = write_matrix_to_file(output_file_sol, sol, batch.num_systems, batch.size);
+    if(!success_write_sol)
+    {
+        fprintf(stderr, "Failed to save solutions\n");
+        return 6;
+    }
+    printf("Done\n");
+    printf("\n");
+
+    free_batched_systems(&batch);
+    delete[] result.num_iters;
+    delete[] result.rel_residual;
+    delete[] x;
+    delete[] sol;
+
+    printf("Finished successfully\n");
+
+    return 0;
+}
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+
+#include <sys/stat.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "simd_kernels.h"
+
+
+
+// Batched CG for many small independent systems
+//
+// file: size_t tag, size_t num_systems, size_t size, then for every system
+//       double A[size * size] (row-major), double b[size]
+//
+// All systems of a batch have the same size. In memory, groups of BATCH_WIDTH consecutive systems
+// are interleaved: entry k of the matrices of a group is stored as BATCH_WIDTH consecutive values,
+// one per system, and the same holds for the vectors. Every SIMD lane then runs the CG iterations
+// of its own system, and a group is solved with the same instructions as a single system of the
+// same size (in two halves with AVX2, one lane at a time with the scalar kernels). The last group
+// is padded with systems whose right-hand side is zero.
+//
+// A lane stops changing once its system has converged (its step length is set to zero), while
+// the group iterates until all of its lanes have converged. The groups are spread over the threads.
+
+const size_t MATRIX_TAG_BATCH = 0x3148435441424743; // "CGBATCH1"
+
+// systems per group, one AVX-512 vector of doubles (two AVX2 vectors)
+const size_t BATCH_WIDTH = 8;
+
+struct batched_systems
+{
+    size_t num_systems = 0;
+    size_t size = 0;
+    size_t num_groups = 0;
+    double * A = nullptr;               // group g starts at g * size * size * BATCH_WIDTH
+    double * b = nullptr;               // group g starts at g * size * BATCH_WIDTH
+};
+
+struct batched_result
+{
+    int * num_iters = nullptr;          // per system, max_iters + 1 if it did not converge
+    double * rel_residual = nullptr;    // per system, recurrence residual of CG
+};
+
+
+
+inline void free_batched_systems(batched_systems * batch)
+{
+    delete[] batch->A;
+    delete[] batch->b;
+    *batch = batched_systems();
+}
+
+
+
+inline bool read_batch_from_file(const char * filename, batched_systems * batch_out)
+{
+    // reads the systems one by one and interleaves them into their groups; the groups are
+    // first touched in parallel with the split of batched_conjugate_gradients
+
+    FILE * file = fopen(filename, "rb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open input file\n");
+        return false;
+    }
+
+    size_t header[3];
+    if(fread(header, sizeof(size_t), 3, file) != 3 || header[0] != MATRIX_TAG_BATCH)
+    {
+        fprintf(stderr, "%s is not a batch file\n", filename);
+        fclose(file);
+        return false;
+    }
+    batched_systems batch;
+    batch.num_systems = header[1];
+    batch.size = header[2];
+    batch.num_groups = (batch.num_systems + BATCH_WIDTH - 1) / BATCH_WIDTH;
+    size_t n = batch.size;
+
+    struct stat file_stat;
+    size_t expected_size = 3 * sizeof(size_t) + batch.num_systems * (n * n + n) * sizeof(double);
+    if(fstat(fileno(file), &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) != expected_size)
+    {
+        fprintf(stderr, "Batch file has %lld bytes, but its header describes %zu bytes\n", static_cast<long long>(file_stat.st_size), expected_size);
+        fclose(file);
+        return false;
+    }
+
+    size_t group_matrix = n * n * BATCH_WIDTH;
+    size_t group_vector = n * BATCH_WIDTH;
+    batch.A = new double[batch.num_groups * group_matrix];
+    batch.b = new double[batch.num_groups * group_vector];
+    #pragma omp parallel for schedule(static)
+    for(size_t g = 0; g < batch.num_groups; g++)
+    {
+        for(size_t k = 0; k < group_matrix; k++)
+        {
+            batch.A[g * group_matrix + k] = 0.0;
+        }
+        for(size_t k = 0; k < group_vector; k++)
+        {
+            batch.b[g * group_vector + k] = 0.0;
+        }
+    }
+
+    // the padding systems of the last group get the identity, so that their products stay finite
+    for(size_t s = batch.num_systems; s < batch.num_groups * BATCH_WIDTH; s++)
+    {
+        double * A_group = batch.A + (s / BATCH_WIDTH) * group_matrix;
+        for(size_t i = 0; i < n; i++)
+        {
+            A_group[(i * n + i) * BATCH_WIDTH + s % BATCH_WIDTH] = 1.0;
+        }
+    }
+
+    double * system = new double[n * n + n];
+    bool success = true;
+    for(size_t s = 0; s < batch.num_systems && success; s++)
+    {
+        success = (fread(system, sizeof(double), n * n + n, file) == n * n + n);
+        double * A_group = batch.A + (s / BATCH_WIDTH) * group_matrix + s % BATCH_WIDTH;
+        double * b_group = batch.b + (s / BATCH_WIDTH) * group_vector + s % BATCH_WIDTH;
+        for(size_t k = 0; k < n * n && success; k++)
+        {
+            A_group[k * BATCH_WIDTH] = system[k];
+        }
+        for(size_t i = 0; i < n && success; i++)
+        {
+            b_group[i * BATCH_WIDTH] = system[n * n + i];
+        }
+    }
+    delete[] system;
+    fclose(file);
+    if(!success)
+    {
+        fprintf(stderr, "Cannot read batch data\n");
+        free_batched_systems(&batch);
+        return false;
+    }
+
+    *batch_out = batch;
+
+    return true;
+}
+
+
+
+inline void deinterleave_batch_vectors(const double * interleaved, double * vectors, size_t num_systems, size_t size)
+{
+    // vectors[s * size + i] = entry i of system s
+
+    #pragma omp parallel for schedule(static)
+    for(size_t s = 0; s < num_systems; s++)
+    {
+        const double * group = interleaved + (s / BATCH_WIDTH) * size * BATCH_WIDTH + s % BATCH_WIDTH;
+        for(size_t i = 0; i < size; i++)
+        {
+            vectors[s * size + i] = group[i * BATCH_WIDTH];
+        }
+    }
+}
+
+
+
+template<size_t W>
+SIMD_INLINE void simd_batched_cg_lanes(const double * A, const double * b, double * x, double * r, double * p, double * Ap, size_t n, int max_iters, double rel_error, double * num_iters, double * rel_residual)
+{
+    // CG for W consecutive lanes of a group, the arrays point to the first of them and hold
+    // BATCH_WIDTH values per entry; num_iters and rel_residual hold one value per lane
+    // a lane that did not converge ends with max_iters + 1 iterations
+    // the product keeps four accumulators per row to hide the latency of the multiply-adds
+
+    typedef typename simd_vector<double, W>::type vector;
+    const size_t S = BATCH_WIDTH;
+    vector zero = {};
+    vector one = zero + 1.0;
+
+    vector rr = zero;
+    for(size_t i = 0; i < n; i++)
+    {
+        vector b_vec;
+        simd_load<W>(b_vec, b + i * S);
+        simd_store<W>(x + i * S, zero);
+        simd_store<W>(r + i * S, b_vec);
+        simd_store<W>(p + i * S, b_vec);
+        rr += b_vec * b_vec;
+    }
+    vector bb = rr;
+    vector tolerance = bb * (rel_error * rel_error);
+    vector iters = zero;
+
+    // a lane is active while its residual is above the tolerance, systems with b = 0 never are
+    auto active = rr > tolerance;
+    for(int k = 1; k <= max_iters; k++)
+    {
+        bool any_active = false;
+        for(size_t l = 0; l < W; l++)
+        {
+            any_active = any_active || active[l];
+        }
+        if(!any_active) break;
+
+        vector pAp = zero;
+        for(size_t i = 0; i < n; i++)
+        {
+            const double * A_row = A + i * n * S;
+            vector acc[4] = {};
+            size_t j = 0;
+            for(; j + 4 <= n; j += 4)
+            {
+                for(size_t u = 0; u < 4; u++)
+                {
+                    vector a_vec, p_vec;
+                    simd_load<W>(a_vec, A_row + (j + u) * S);
+                    simd_load<W>(p_vec, p + (j + u) * S);
+                    acc[u] += a_vec * p_vec;
+                }
+            }
+            for(; j < n; j++)
+            {
+                vector a_vec, p_vec;
+                simd_load<W>(a_vec, A_row + j * S);
+                simd_load<W>(p_vec, p + j * S);
+                acc[0] += a_vec * p_vec;
+            }
+            vector y = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+            vector p_i;
+            simd_load<W>(p_i, p + i * S);
+            simd_store<W>(Ap + i * S, y);
+            pAp += p_i * y;
+        }
+
+        // converged lanes take a step of zero and keep their x, r and rr
+        vector alpha = active ? rr / pAp : zero;
+        vector rr_new = zero;
+        for(size_t i = 0; i < n; i++)
+        {
+            vector x_vec, r_vec, p_vec, Ap_vec;
+            simd_load<W>(x_vec, x + i * S);
+            simd_load<W>(r_vec, r + i * S);
+            simd_load<W>(p_vec, p + i * S);
+            simd_load<W>(Ap_vec, Ap + i * S);
+            x_vec += alpha * p_vec;
+            r_vec -= alpha * Ap_vec;
+            simd_store<W>(x + i * S, x_vec);
+            simd_store<W>(r + i * S, r_vec);
+            rr_new += r_vec * r_vec;
+        }
+        iters += active ? one : zero;
+        vector beta = active ? rr_new / rr : zero;
+        rr = active ? rr_new : rr;
+        active = active & (rr > tolerance);
+
+        for(size_t i = 0; i < n; i++)
+        {
+            vector r_vec, p_vec;
+            simd_load<W>(r_vec, r + i * S);
+            simd_load<W>(p_vec, p + i * S);
+            simd_store<W>(p + i * S, r_vec + beta * p_vec);
+        }
+    }
+
+    iters += active ? one : zero;
+    simd_store<W>(num_iters, iters);
+    for(size_t l = 0; l < W; l++)
+    {
+        rel_residual[l] = (bb[l] > 0.0) ? std::sqrt(rr[l] / bb[l]) : 0.0;
+    }
+}
+
+
+
+template<size_t W>
+SIMD_INLINE void simd_batched_cg_group(const double * A, const double * b, double * x, double * r, double * p, double * Ap, size_t n, int max_iters, double rel_error, double * num_iters, double * rel_residual)
+{
+    // the lanes of a group in slices of the native vector width; the slices only share cache lines
+    // num_iters and rel_residual hold BATCH_WIDTH values
+
+    for(size_t h = 0; h < BATCH_WIDTH; h += W)
+    {
+        simd_batched_cg_lanes<W>(A + h, b + h, x + h, r + h, p + h, Ap + h, n, max_iters, rel_error, num_iters + h, rel_residual + h);
+    }
+}
+
+
+
+// instantiations of the group solver for every instruction set, as in simd_kernels.h
+
+typedef void (*batched_cg_group_kernel)(const double * A, const double * b, double * x, double * r, double * p, double * Ap, size_t n, int max_iters, double rel_error, double * num_iters, double * rel_residual);
+
+inline void batched_cg_group_scalar(const double * A, const double * b, double * x, double * r, double * p, double * Ap, size_t n, int max_iters, double rel_error, double * num_iters, double * rel_residual)
+{
+    simd_batched_cg_group<1>(A, b, x, r, p, Ap, n, max_iters, rel_error, num_iters, rel_residual);
+}
+
+#ifdef SIMD_X86
+
+SIMD_TARGET_AVX2 inline void batched_cg_group_avx2(const double * A, const double * b, double * x, double * r, double * p, double * Ap, size_t n, int max_iters, double rel_error, double * num_iters, double * rel_residual)
+{
+    simd_batched_cg_group<4>(A, b, x, r, p, Ap, n, max_iters, rel_error, num_iters, rel_residual);
+}
+
+SIMD_TARGET_AVX512 inline void batched_cg_group_avx512(const double * A, const double * b, double * x, double * r, double * p, double * Ap, size_t n, int max_iters, double rel_error, double * num_iters, double * rel_residual)
+{
+    simd_batched_cg_group<8>(A, b, x, r, p, Ap, n, max_iters, rel_error, num_iters, rel_residual);
+}
+
+#endif
+
+
+
+inline batched_cg_group_kernel batched_cg_group_kernel_for(simd_isa isa)
+{
+#ifdef SIMD_X86
+    if(isa == SIMD_AVX2) return &batched_cg_group_avx2;
+    if(isa == SIMD_AVX512) return &batched_cg_group_avx512;
+#endif
+    (void)isa;
+    return &batched_cg_group_scalar;
+}
+
+
+
+inline void batched_conjugate_gradients(const batched_systems & batch, double * x, int max_iters, double rel_error, batched_result * result)
+{
+    // solves all systems of the batch; x is interleaved like batch.b, result holds one entry per system
+    // every thread solves a contiguous range of groups (the ones it first touched) with its own vectors
+
+    batched_cg_group_kernel kernel = batched_cg_group_kernel_for(active_simd_isa());
+    size_t n = batch.size;
+    size_t group_matrix = n * n * BATCH_WIDTH;
+    size_t group_vector = n * BATCH_WIDTH;
+
+    #pragma omp parallel
+    {
+        double * work = new double[3 * group_vector + 2 * BATCH_WIDTH];
+        double * r = work;
+        double * p = work + group_vector;
+        double * Ap = work + 2 * group_vector;
+        double * num_iters = work + 3 * group_vector;
+        double * rel_residual = num_iters + BATCH_WIDTH;
+
+        #pragma omp for schedule(static)
+        for(size_t g = 0; g < batch.num_groups; g++)
+        {
+            kernel(batch.A + g * group_matrix, batch.b + g * group_vector, x + g * group_vector, r, p, Ap, n, max_iters, rel_error, num_iters, rel_residual);
+            for(size_t l = 0; l < BATCH_WIDTH && g * BATCH_WIDTH + l < batch.num_systems; l++)
+            {
+                result->num_iters[g * BATCH_WIDTH + l] = static_cast<int>(num_iters[l]);
+                result->rel_residual[g * BATCH_WIDTH + l] = rel_residual[l];
+            }
+        }
+
+        delete[] work;
+    }
+}
@@ -0,0 +1,771 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "cg_kernels.h"
+#include "dense_blas.h"
+
+
+
+// Micro-benchmark of the solver kernels
+//
+// Every kernel of cg_kernels.h is timed over a sweep of vector lengths and matrix sizes that
+// starts in the L1 cache and ends in main memory, once for every thread count 1, 2, 4, ... up to
+// the maximum. For each thread count the benchmark first measures the STREAM copy, scale, add and
+// triad bandwidth of main memory and the peak multiply-add rate of the cores; together they form
+// the roofline, and every kernel is reported as the fraction of the roofline it reaches at its
+// arithmetic intensity. The byte counts use the same model as the performance report of the
+// solver: every array is counted once per call. In-cache sizes can therefore exceed a fraction of 1.
+
+struct machine_peak
+{
+    double bandwidth;   // bytes per second of the STREAM triad in main memory
+    double flops;       // floating point operations per second of independent multiply-adds
+};
+
+struct benchmark_result
+{
+    const char * kernel;
+    simd_isa isa;
+    int num_threads;
+    size_t size;            // vector length or matrix dimension
+    double working_set;     // bytes touched by one call
+    double bytes;
+    double flops;
+    double seconds;         // time of one call
+    machine_peak peak;
+};
+
+volatile double benchmark_sink;
+
+
+
+double current_time()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+
+template<typename kernel>
+double time_kernel(kernel run, double min_time)
+{
+    // calls the kernel 1, 2, 4, ... times until the calls take at least min_time and returns the time of one call
+    // the first call warms up the caches and the thread pool and is not timed
+
+    run();
+    for(size_t num_calls = 1; ; num_calls *= 2)
+    {
+        double start = current_time();
+        for(size_t i = 0; i < num_calls; i++)
+        {
+            run();
+        }
+        double elapsed = current_time() - start;
+        if(elapsed >= min_time) return elapsed / num_calls;
+    }
+}
+
+
+
+double multiply_add_chains(size_t num_iters)
+{
+    // independent multiply-add chains that stay in registers, enough of them to hide the latency of the vector units
+
+    const int num_chains = 64;
+    double result = 0.0;
+    #pragma omp parallel reduction(+:result)
+    {
+        double acc[num_chains];
+        for(int j = 0; j < num_chains; j++)
+        {
+            acc[j] = j;
+        }
+        for(size_t it = 0; it < num_iters; it++)
+        {
+            #pragma omp simd
+            for(int j = 0; j < num_chains; j++)
+            {
+                acc[j] = acc[j] * 0.999999 + 1e-6;
+            }
+        }
+        for(int j = 0; j < num_chains; j++)
+        {
+            result += acc[j];
+        }
+    }
+    return result;
+}
+
+
+
+void gemv_rowwise(const double * A, const double * x, double * y, size_t num_rows, size_t num_cols)
+{
+    // the baseline of the blocked gemv: one row at a time with a single accumulator, x is read
+    // again for every row from wherever it fits in the caches
+
+    #pragma omp parallel for schedule(static)
+    for(size_t r = 0; r < num_rows; r++)
+    {
+        double y_val = 0.0;
+        for(size_t c = 0; c < num_cols; c++)
+        {
+            y_val += A[r * num_cols + c] * x[c];
+        }
+        y[r] = y_val;
+    }
+}
+
+
+
+void add_result(std::vector<benchmark_result> & results, const char * kernel, int num_threads, size_t size, double working_set, double bytes, double flops, double seconds, machine_peak peak)
+{
+    benchmark_result result = { kernel, active_simd_isa(), num_threads, size, working_set, bytes, flops, seconds, peak };
+    results.push_back(result);
+}
+
+
+
+double roofline_flops(const benchmark_result & result)
+{
+    // attainable GFLOP/s at the arithmetic intensity of the kernel
+
+    if(result.bytes == 0.0) return result.peak.flops * 1e-9;
+    return std::min(result.peak.flops, result.flops / result.bytes * result.peak.bandwidth) * 1e-9;
+}
+
+
+
+double roofline_fraction(const benchmark_result & result)
+{
+    // kernels without floating point operations are compared against the bandwidth alone
+
+    if(result.flops == 0.0) return result.bytes / result.seconds / result.peak.bandwidth;
+    return result.flops / result.seconds * 1e-9 / roofline_flops(result);
+}
+
+
+
+void print_result(const benchmark_result & result)
+{
+    printf("  %-34s %7d %10zu %10.1f %10.2f %9.2f %9.3f\n", result.kernel, result.num_threads, result.size, result.working_set / 1024.0,
+        result.bytes / result.seconds * 1e-9, result.flops / result.seconds * 1e-9, roofline_fraction(result));
+}
+
+
+
+void print_result_header()
+{
+    printf("  kernel                             threads       size   set [KiB]      GB/s   GFLOP/s  roofline\n");
+}
+
+
+
+machine_peak measure_peak(double * a, double * b, double * c, size_t size, int num_threads, double min_time, std::vector<benchmark_result> & results)
+{
+    // STREAM copy, scale, add and triad on arrays of the given size, and the peak multiply-add rate
+
+    const double scalar = 3.0;
+    const size_t num_fma_iters = 1 << 16;
+    double n = static_cast<double>(size);
+    machine_peak peak = { 0.0, 0.0 };
+
+    double t_copy = time_kernel([&]() {
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++) c[i] = a[i];
+    }, min_time);
+    double t_scale = time_kernel([&]() {
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++) b[i] = scalar * c[i];
+    }, min_time);
+    double t_add = time_kernel([&]() {
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++) c[i] = a[i] + b[i];
+    }, min_time);
+    double t_triad = time_kernel([&]() {
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++) a[i] = b[i] + scalar * c[i];
+    }, min_time);
+    double t_fma = time_kernel([&]() { benchmark_sink = multiply_add_chains(num_fma_iters); }, min_time);
+
+    peak.bandwidth = 24.0 * n / t_triad;
+    peak.flops = 2.0 * 64.0 * num_fma_iters * num_threads / t_fma;
+
+    add_result(results, "stream_copy", num_threads, size, 16.0 * n, 16.0 * n, 0.0, t_copy, peak);
+    add_result(results, "stream_scale", num_threads, size, 16.0 * n, 16.0 * n, n, t_scale, peak);
+    add_result(results, "stream_add", num_threads, size, 24.0 * n, 24.0 * n, n, t_add, peak);
+    add_result(results, "stream_triad", num_threads, size, 24.0 * n, 24.0 * n, 2.0 * n, t_triad, peak);
+    add_result(results, "peak_multiply_add", num_threads, 64, 0.0, 0.0, 2.0 * 64.0 * num_fma_iters * num_threads, t_fma, peak);
+    return peak;
+}
+
+
+
+void benchmark_vector_kernels(double * x, double * y, double * p, double * r, float * x_float, float * y_float, size_t size, int num_threads, double min_time, machine_peak peak, std::vector<benchmark_result> & results)
+{
+    double n = static_cast<double>(size);
+
+    double t_triad = time_kernel([&]() {
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++) x[i] = y[i] + 3.0 * p[i];
+    }, min_time);
+    add_result(results, "triad", num_threads, size, 24.0 * n, 24.0 * n, 2.0 * n, t_triad, peak);
+
+    double t_dot = time_kernel([&]() { benchmark_sink = dot(x, y, size); }, min_time);
+    add_result(results, "dot", num_threads, size, 16.0 * n, 16.0 * n, 2.0 * n, t_dot, peak);
+
+    double t_dot_float = time_kernel([&]() { benchmark_sink = dot(x_float, y_float, size); }, min_time);
+    add_result(results, "dot<float>", num_threads, size, 8.0 * n, 8.0 * n, 2.0 * n, t_dot_float, peak);
+
+    // y converges to x, so repeated calls keep the values in range
+    double t_axpby = time_kernel([&]() { axpby(0.5, x, 0.5, y, size); }, min_time);
+    add_result(results, "axpby", num_threads, size, 16.0 * n, 24.0 * n, 3.0 * n, t_axpby, peak);
+
+    double t_axpby_float = time_kernel([&]() { axpby(0.5, x_float, 0.5, y_float, size); }, min_time);
+    add_result(results, "axpby<float>", num_threads, size, 8.0 * n, 12.0 * n, 3.0 * n, t_axpby_float, peak);
+
+    // the fused update replaces two axpby and a dot of the textbook iteration
+    double t_update = time_kernel([&]() { benchmark_sink = update_solution_residual(1e-9, p, y, x, r, size); }, min_time);
+    add_result(results, "update_solution_residual", num_threads, size, 32.0 * n, 48.0 * n, 6.0 * n, t_update, peak);
+
+    // the overhead of the deterministic reductions against the plain ones above
+    active_reduction_mode() = REDUCTION_PAIRWISE;
+    double t_dot_pairwise = time_kernel([&]() { benchmark_sink = dot(x, y, size); }, min_time);
+    add_result(results, "dot_pairwise", num_threads, size, 16.0 * n, 16.0 * n, 2.0 * n, t_dot_pairwise, peak);
+    double t_update_pairwise = time_kernel([&]() { benchmark_sink = update_solution_residual(1e-9, p, y, x, r, size); }, min_time);
+    add_result(results, "update_solution_residual_pairwise", num_threads, size, 32.0 * n, 48.0 * n, 6.0 * n, t_update_pairwise, peak);
+
+    active_reduction_mode() = REDUCTION_COMPENSATED;
+    double t_dot_compensated = time_kernel([&]() { benchmark_sink = dot(x, y, size); }, min_time);
+    add_result(results, "dot_compensated", num_threads, size, 16.0 * n, 16.0 * n, 2.0 * n, t_dot_compensated, peak);
+    active_reduction_mode() = REDUCTION_PLAIN;
+}
+
+
+
+void benchmark_matrix_kernels(const double * A, const float * A_float, const double * A_packed, double * x, double * y, float * x_float, float * y_float, double * X, double * Y, double * buffer, size_t size, int num_threads, double min_time, machine_peak peak, std::vector<benchmark_result> & results)
+{
+    const size_t num_vecs = GEMM_TILE_COLS;
+    double n = static_cast<double>(size);
+    double matrix_bytes = n * n * sizeof(double);
+    double packed_bytes = n * (n + 1) / 2.0 * sizeof(double);
+    double vector_bytes = 2.0 * n * sizeof(double);
+
+    double t_rowwise = time_kernel([&]() { gemv_rowwise(A, x, y, size, size); }, min_time);
+    add_result(results, "gemv_rowwise", num_threads, size, matrix_bytes + vector_bytes, matrix_bytes + vector_bytes, 2.0 * n * n, t_rowwise, peak);
+
+    double t_gemv = time_kernel([&]() { gemv(1.0, A, x, 0.0, y, size, size); }, min_time);
+    add_result(results, "gemv", num_threads, size, matrix_bytes + vector_bytes, matrix_bytes + 3.0 * n * sizeof(double), 2.0 * n * n + 3.0 * n, t_gemv, peak);
+
+    double t_gemv_dot = time_kernel([&]() { benchmark_sink = gemv_dot(A, x, y, size, size); }, min_time);
+    add_result(results, "gemv_dot", num_threads, size, matrix_bytes + vector_bytes, matrix_bytes + vector_bytes, 2.0 * n * n + 2.0 * n, t_gemv_dot, peak);
+
+    double t_gemv_float = time_kernel([&]() { benchmark_sink = gemv_dot(A_float, x_float, y_float, size, size); }, min_time);
+    add_result(results, "gemv_dot<float>", num_threads, size, (matrix_bytes + vector_bytes) / 2.0, (matrix_bytes + vector_bytes) / 2.0, 2.0 * n * n + 2.0 * n, t_gemv_float, peak);
+
+    // every stored entry of the packed triangle is used for two rows
+    double t_symv = time_kernel([&]() { benchmark_sink = symv_dot(A_packed, x, y, size, buffer); }, min_time);
+    add_result(results, "symv_dot", num_threads, size, packed_bytes + vector_bytes, packed_bytes + vector_bytes, 2.0 * n * n + 2.0 * n, t_symv, peak);
+
+    // one pass over the matrix serves num_vecs vectors, the rates are those of the whole block
+    double dots[GEMM_TILE_COLS];
+    double t_gemm = time_kernel([&]() { gemm_dot(A, X, Y, size, size, num_vecs, num_vecs, dots); }, min_time);
+    add_result(results, "gemm_dot", num_threads, size, matrix_bytes + num_vecs * vector_bytes, matrix_bytes + num_vecs * vector_bytes, num_vecs * (2.0 * n * n + 2.0 * n), t_gemm, peak);
+}
+
+
+
+void initialize_vectors(double * x, double * y, double * p, double * r, float * x_float, float * y_float, size_t size)
+{
+    // the initialization runs with the current number of threads, so that every page is placed
+    // next to the thread that uses it in the benchmark
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < size; i++)
+    {
+        x[i] = 1.0 + (i % 7) * 0.125;
+        y[i] = 1.0 - (i % 5) * 0.125;
+        p[i] = 0.5;
+        r[i] = 1.0;
+        x_float[i] = static_cast<float>(x[i]);
+        y_float[i] = static_cast<float>(y[i]);
+    }
+}
+
+
+
+void initialize_matrices(double * A, float * A_float, double * A_packed, double * X, size_t size)
+{
+    // symmetric and diagonally dominant, although the values do not matter for the timing
+
+    #pragma omp parallel for schedule(static)
+    for(size_t r = 0; r < size; r++)
+    {
+        for(size_t c = 0; c < size; c++)
+        {
+            double value = (r == c) ? 2.0 * size : 1.0 / (1.0 + r + c);
+            A[r * size + c] = value;
+            A_float[r * size + c] = static_cast<float>(value);
+        }
+        const double * A_row = A + r * size;
+        double * packed_row = A_packed + packed_row_offset(r, size) - r;
+        for(size_t c = r; c < size; c++)
+        {
+            packed_row[c] = A_row[c];
+        }
+        for(size_t k = 0; k < GEMM_TILE_COLS; k++)
+        {
+            X[r * GEMM_TILE_COLS + k] = 1.0 + k * 0.25;
+        }
+    }
+}
+
+
+
+template<typename real>
+double max_relative_error(const real * x, const double * reference, size_t size)
+{
+    double error = 0.0;
+    for(size_t i = 0; i < size; i++)
+    {
+        error = std::max(error, std::fabs(x[i] - reference[i]) / std::max(std::fabs(reference[i]), 1.0));
+    }
+    return error;
+}
+
+
+
+template<typename real>
+double check_simd_kernels(simd_isa isa)
+{
+    // compares the kernels of one instruction set with plain loops in double precision for sizes
+    // that exercise the vector bodies, the unrolled parts and the remainder loops; returns the largest relative error
+
+    const simd_kernel_table<real> & kernels = simd_kernels<real>(isa);
+    const size_t sizes[] = { 0, 1, 3, 4, 7, 8, 15, 16, 17, 31, 33, 63, 64, 65, 100, 257, 1000, 2100 };
+    double error = 0.0;
+
+    for(size_t size : sizes)
+    {
+        real * A = new real[size * size];
+        real * x = new real[size];
+        real * y = new real[size];
+        double * reference = new double[size];
+        for(size_t i = 0; i < size * size; i++)
+        {
+            A[i] = static_cast<real>(std::sin(0.37 * i));
+        }
+        for(size_t i = 0; i < size; i++)
+        {
+            x[i] = static_cast<real>(std::cos(0.11 * i));
+            y[i] = static_cast<real>(1.0 + 0.5 * std::sin(0.23 * i));
+        }
+
+        double dot_reference = 0.0;
+        double abs_sum = 1.0;
+        for(size_t i = 0; i < size; i++)
+        {
+            dot_reference += static_cast<double>(x[i]) * y[i];
+            abs_sum += std::fabs(static_cast<double>(x[i]) * y[i]);
+        }
+        error = std::max(error, std::fabs(kernels.dot(x, y, size) - dot_reference) / abs_sum);
+        error = std::max(error, std::fabs(kernels.compensated_dot(x, y, size) - dot_reference) / abs_sum);
+
+        for(size_t i = 0; i < size; i++)
+        {
+            reference[i] = static_cast<real>(0.75 * x[i] - 1.25 * y[i]);
+        }
+        kernels.axpby(0.75, x, -1.25, y, size);
+        error = std::max(error, max_relative_error(y, reference, size));
+
+        double gemv_dot_reference = 0.0;
+        abs_sum = 1.0;
+        for(size_t r = 0; r < size; r++)
+        {
+            double y_val = 0.0;
+            for(size_t c = 0; c < size; c++)
+            {
+                y_val += static_cast<double>(A[r * size + c]) * x[c];
+            }
+            reference[r] = static_cast<real>(y_val);
+            gemv_dot_reference += x[r] * y_val;
+            abs_sum += std::fabs(x[r] * y_val);
+        }
+        double gemv_dot_result = kernels.gemv_dot(A, x, x, y, size, size);
+        error = std::max(error, max_relative_error(y, reference, size));
+        error = std::max(error, std::fabs(gemv_dot_result - gemv_dot_reference) / abs_sum);
+
+        for(size_t r = 0; r < size; r++)
+        {
+            reference[r] = static_cast<real>(0.5 * y[r] + 2.0 * reference[r]);
+        }
+        kernels.gemv(2.0, A, x, 0.5, y, size, size);
+        error = std::max(error, max_relative_error(y, reference, size));
+
+        delete[] A;
+        delete[] x;
+        delete[] y;
+        delete[] reference;
+    }
+    return error;
+}
+
+
+
+double check_builtin_dgemm(simd_isa isa)
+{
+    // compares the built-in DGEMM of dense_blas.h with plain loops for every combination of transposes;
+    // the shapes cover partial micro tiles, several KC blocks and numbers of columns just below, at and
+    // above DENSE_GEMM_NC, where the B panels are split; returns the largest relative error
+
+    simd_isa previous_isa = active_simd_isa();
+    active_simd_isa() = isa;
+    const size_t shapes[][3] = { { 1, 1, 1 }, { 17, 13, 5 }, { 100, 37, 300 }, { 5, 700, 3 }, { 37, 2043, 40 }, { 19, 2048, 260 }, { 37, 2100, 40 }, { 21, 4200, 30 } };
+    double error = 0.0;
+
+    for(const auto & shape : shapes)
+    {
+        size_t m = shape[0];
+        size_t n = shape[1];
+        size_t k = shape[2];
+        for(int trans = 0; trans < 4; trans++)
+        {
+            bool trans_A = (trans & 1) != 0;
+            bool trans_B = (trans & 2) != 0;
+            size_t lda = (trans_A ? k : m) + 3;
+            size_t ldb = (trans_B ? n : k) + 1;
+            size_t ldc = m + 2;
+            size_t size_A = lda * (trans_A ? m : k);
+            size_t size_B = ldb * (trans_B ? k : n);
+            double * A = new double[size_A];
+            double * B = new double[size_B];
+            double * C = new double[ldc * n];
+            double * reference = new double[ldc * n];
+            for(size_t i = 0; i < size_A; i++)
+            {
+                A[i] = std::sin(0.37 * i);
+            }
+            for(size_t i = 0; i < size_B; i++)
+            {
+                B[i] = std::cos(0.11 * i);
+            }
+            for(size_t i = 0; i < ldc * n; i++)
+            {
+                C[i] = 1.0 + 0.5 * std::sin(0.23 * i);
+                reference[i] = C[i];
+            }
+
+            // the padding rows of C must stay untouched
+            for(size_t j = 0; j < n; j++)
+            {
+                for(size_t i = 0; i < m; i++)
+                {
+                    double sum = 0.0;
+                    for(size_t p = 0; p < k; p++)
+                    {
+                        double a = trans_A ? A[i * lda + p] : A[p * lda + i];
+                        double b = trans_B ? B[p * ldb + j] : B[j * ldb + p];
+                        sum += a * b;
+                    }
+                    reference[j * ldc + i] = 1.5 * sum + 0.5 * reference[j * ldc + i];
+                }
+            }
+            builtin_dgemm(trans_A, trans_B, m, n, k, 1.5, A, lda, B, ldb, 0.5, C, ldc);
+            error = std::max(error, max_relative_error(C, reference, ldc * n) / k);
+
+            delete[] A;
+            delete[] B;
+            delete[] C;
+            delete[] reference;
+        }
+    }
+
+    active_simd_isa() = previous_isa;
+    return error;
+}
+
+
+
+bool check_all_simd_kernels()
+{
+    // the tolerance of single precision covers the rounding of the stored results to float
+
+    bool success = true;
+    const simd_isa isas[] = { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+    for(simd_isa isa : isas)
+    {
+        if(!simd_isa_supported(isa))
+        {
+            printf("  %-8s not supported by this CPU, skipped\n", simd_isa_name(isa));
+            continue;
+        }
+        double error_double = check_simd_kernels<double>(isa);
+        double error_float = check_simd_kernels<float>(isa);
+        double error_dgemm = check_builtin_dgemm(isa);
+        bool passed = (error_double < 1e-13 && error_float < 1e-6 && error_dgemm < 1e-14);
+        printf("  %-8s max relative error %.3e (double) %.3e (float) %.3e (dgemm): %s\n", simd_isa_name(isa), error_double, error_float, error_dgemm, passed ? "passed" : "FAILED");
+        success = success && passed;
+    }
+    return success;
+}
+
+
+
+bool write_results_csv(const char * filename, const std::vector<benchmark_result> & results)
+{
+    FILE * file = fopen(filename, "w");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open output file\n");
+        return false;
+    }
+
+    fprintf(file, "kernel,simd,threads,size,working_set_bytes,bytes,flops,time,GB/s,GFLOP/s,intensity,peak_GB/s,peak_GFLOP/s,roofline_GFLOP/s,roofline_fraction\n");
+    for(const benchmark_result & result : results)
+    {
+        double intensity = (result.bytes > 0.0) ? result.flops / result.bytes : 0.0;
+        fprintf(file, "%s,%s,%d,%zu,%.0f,%.0f,%.0f,%.6e,%.3f,%.3f,%.4f,%.3f,%.3f,%.3f,%.4f\n", result.kernel, simd_isa_name(result.isa), result.num_threads, result.size, result.working_set, result.bytes, result.flops, result.seconds,
+            result.bytes / result.seconds * 1e-9, result.flops / result.seconds * 1e-9, intensity, result.peak.bandwidth * 1e-9, result.peak.flops * 1e-9, roofline_flops(result), roofline_fraction(result));
+    }
+
+    bool success = (ferror(file) == 0);
+    fclose(file);
+
+    return success;
+}
+
+
+
+bool write_results_json(const char * filename, const std::vector<benchmark_result> & results)
+{
+    FILE * file = fopen(filename, "w");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open output file\n");
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"results\": [");
+    for(size_t i = 0; i < results.size(); i++)
+    {
+        const benchmark_result & result = results[i];
+        double intensity = (result.bytes > 0.0) ? result.flops / result.bytes : 0.0;
+        fprintf(file, "%s\n    {\"kernel\": \"%s\", \"simd\": \"%s\", \"threads\": %d, \"size\": %zu, \"working_set_bytes\": %.0f, \"bytes\": %.0f, \"flops\": %.0f, \"time\": %.6e, "
+            "\"GB/s\": %.3f, \"GFLOP/s\": %.3f, \"intensity\": %.4f, \"peak_GB/s\": %.3f, \"peak_GFLOP/s\": %.3f, \"roofline_GFLOP/s\": %.3f, \"roofline_fraction\": %.4f}",
+            (i == 0) ? "" : ",", result.kernel, simd_isa_name(result.isa), result.num_threads, result.size, result.working_set, result.bytes, result.flops, result.seconds,
+            result.bytes / result.seconds * 1e-9, result.flops / result.seconds * 1e-9, intensity, result.peak.bandwidth * 1e-9, result.peak.flops * 1e-9, roofline_flops(result), roofline_fraction(result));
+    }
+    fprintf(file, "\n  ]\n");
+    fprintf(file, "}\n");
+
+    bool success = (ferror(file) == 0);
+    fclose(file);
+
+    return success;
+}
+
+
+
+
+
+int main(int argc, char ** argv)
+{
+    printf("Usage: ./benchmark_kernels [options]\n");
+    printf("Options:\n");
+    printf("  --threads N   largest number of OpenMP threads, the sweep uses 1, 2, 4, ... up to N (default: OMP_NUM_THREADS or all cores)\n");
+    printf("  --min-size N  shortest vector length of the sweep (default: 1024)\n");
+    printf("  --max-size N  longest vector length of the sweep and length of the STREAM arrays, should exceed the last level cache (default: 16777216)\n");
+    printf("  --max-matrix-size N\n");
+    printf("                largest matrix dimension of the sweep (default: 4096)\n");
+    printf("  --min-time S  minimum time spent in every measurement in seconds (default: 0.05)\n");
+    printf("  --csv FILE    write the results to a CSV file\n");
+    printf("  --json FILE   write the results to a JSON file\n");
+    printf("  --simd scalar|avx2|avx512\n");
+    printf("                instruction set of the SIMD kernels (default: the widest one supported by the CPU)\n");
+    printf("  --check       compare the SIMD kernels and the built-in DGEMM of every supported instruction set with plain loops and exit\n");
+    printf("The deterministic reductions are measured as dot_pairwise, dot_compensated and update_solution_residual_pairwise\n");
+    printf("\n");
+
+    int max_threads = 1;
+    size_t min_size = 1024;
+    size_t max_size = 16777216;
+    size_t max_matrix_size = 4096;
+    double min_time = 0.05;
+    const char * output_file_csv = nullptr;
+    const char * output_file_json = nullptr;
+    bool check = false;
+#ifdef _OPENMP
+    max_threads = omp_get_max_threads();
+#endif
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) { max_threads = atoi(argv[++i]); continue; }
+        if(strcmp(argv[i], "--min-size") == 0 && i + 1 < argc) { min_size = static_cast<size_t>(atoll(argv[++i])); continue; }
+        if(strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) { max_size = static_cast<size_t>(atoll(argv[++i])); continue; }
+        if(strcmp(argv[i], "--max-matrix-size") == 0 && i + 1 < argc) { max_matrix_size = static_cast<size_t>(atoll(argv[++i])); continue; }
+        if(strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) { min_time = atof(argv[++i]); continue; }
+        if(strcmp(argv[i], "--csv") == 0 && i + 1 < argc) { output_file_csv = argv[++i]; continue; }
+        if(strcmp(argv[i], "--json") == 0 && i + 1 < argc) { output_file_json = argv[++i]; continue; }
+        if(strcmp(argv[i], "--check") == 0) { check = true; continue; }
+        if(strcmp(argv[i], "--simd") == 0 && i + 1 < argc)
+        {
+            simd_isa isa;
+            if(!parse_simd_isa(argv[++i], &isa) || !simd_isa_supported(isa))
+            {
+                fprintf(stderr, "Unknown or unsupported instruction set %s\n", argv[i]);
+                return 1;
+            }
+            active_simd_isa() = isa;
+            continue;
+        }
+        fprintf(stderr, "Unknown argument %s\n", argv[i]);
+        return 1;
+    }
+
+    if(max_threads < 1)
+    {
+        fprintf(stderr, "Wrong number of threads\n");
+        return 2;
+    }
+    if(min_size < 1 || max_size < min_size || max_matrix_size < 1)
+    {
+        fprintf(stderr, "Wrong sizes\n");
+        return 3;
+    }
+#ifndef _OPENMP
+    if(max_threads > 1)
+    {
+        fprintf(stderr, "Compiled without OpenMP, running on a single thread\n");
+        max_threads = 1;
+    }
+#endif
+
+    // the sweep measures the plain reductions, whatever CG_REDUCTION says
+    active_reduction_mode() = REDUCTION_PLAIN;
+
+    if(check)
+    {
+        printf("Checking SIMD kernels ...\n");
+        if(!check_all_simd_kernels())
+        {
+            fprintf(stderr, "SIMD kernels differ from the reference\n");
+            return 5;
+        }
+        printf("Done\n");
+        printf("\n");
+        printf("Finished successfully\n");
+        return 0;
+    }
+
+    printf("Command line arguments:\n");
+    printf("  simd:              %s\n", simd_isa_name(active_simd_isa()));
+    printf("  max_threads:       %d\n", max_threads);
+    printf("  min_size:          %zu\n", min_size);
+    printf("  max_size:          %zu\n", max_size);
+    printf("  max_matrix_size:   %zu\n", max_matrix_size);
+    printf("  min_time:          %f\n", min_time);
+    printf("  csv:               %s\n", (output_file_csv != nullptr) ? output_file_csv : "none");
+    printf("  json:              %s\n", (output_file_json != nullptr) ? output_file_json : "none");
+    printf("\n");
+
+
+
+    // the vectors are also the operands of the matrix kernels
+    size_t vector_size = std::max(max_size, max_matrix_size);
+    double * x = new double[vector_size];
+    double * y = new double[vector_size];
+    double * p = new double[vector_size];
+    double * r = new double[vector_size];
+    float * x_float = new float[vector_size];
+    float * y_float = new float[vector_size];
+    double * A = new double[max_matrix_size * max_matrix_size];
+    float * A_float = new float[max_matrix_size * max_matrix_size];
+    double * A_packed = new double[max_matrix_size * (max_matrix_size + 1) / 2];
+    double * X = new double[max_matrix_size * GEMM_TILE_COLS];
+    double * Y = new double[max_matrix_size * GEMM_TILE_COLS];
+    double * buffer = new double[max_matrix_size * max_threads];
+    std::vector<benchmark_result> results;
+
+    for(int t = 1; ; t *= 2)
+    {
+        if(t > max_threads) t = max_threads;
+#ifdef _OPENMP
+        omp_set_num_threads(t);
+#endif
+        initialize_vectors(x, y, p, r, x_float, y_float, vector_size);
+        print_result_header();
+
+        size_t first_result = results.size();
+        machine_peak peak = measure_peak(x, y, p, max_size, t, min_time, results);
+        initialize_vectors(x, y, p, r, x_float, y_float, vector_size);
+
+        for(size_t size = min_size; size <= max_size; size *= 4)
+        {
+            benchmark_vector_kernels(x, y, p, r, x_float, y_float, size, t, min_time, peak, results);
+        }
+
+        for(size_t size = 64; size <= max_matrix_size; size *= 2)
+        {
+            initialize_matrices(A, A_float, A_packed, X, size);
+            benchmark_matrix_kernels(A, A_float, A_packed, x, y, x_float, y_float, X, Y, buffer, size, t, min_time, peak, results);
+        }
+
+        for(size_t i = first_result; i < results.size(); i++)
+        {
+            print_result(results[i]);
+        }
+        printf("\n");
+
+        if(t == max_threads) break;
+    }
+
+    delete[] x;
+    delete[] y;
+    delete[] p;
+    delete[] r;
+    delete[] x_float;
+    delete[] y_float;
+    delete[] A;
+    delete[] A_float;
+    delete[] A_packed;
+    delete[] X;
+    delete[] Y;
+    delete[] buffer;
+
+    if(output_file_csv != nullptr)
+    {
+        printf("Writing results to %s ...\n", output_file_csv);
+        if(!write_results_csv(output_file_csv, results))
+        {
+            fprintf(stderr, "Failed to save results\n");
+            return 4;
+        }
+        printf("Done\n");
+        printf("\n");
+    }
+    if(output_file_json != nullptr)
+    {
+        printf("Writing results to %s ...\n", output_file_json);
+        if(!write_results_json(output_file_json, results))
+        {
+            fprintf(stderr, "Failed to save results\n");
+            return 4;
+        }
+        printf("Done\n");
+        printf("\n");
+    }
+
+    printf("Finished successfully\n");
+
+    return 0;
+}
@@ -0,0 +1,555 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "simd_kernels.h"
+#include "reductions.h"
+
+
+
+// The vector kernels are templates over the floating point type of the data, so that the same
+// code serves the double precision solver and the single precision inner solver of the mixed
+// precision mode. Dot products and row sums are always accumulated in double. dot, axpby, gemv
+// and gemv_dot distribute the threads and call the explicit SIMD kernels of simd_kernels.h. All
+// reductions go through reduce_ranges of reductions.h, which makes them deterministic on request.
+
+
+
+template<typename real>
+inline double dot(const real * x, const real * y, size_t size)
+{
+    const simd_kernel_table<real> & kernels = simd_kernels<real>();
+    bool compensated = (active_reduction_mode() == REDUCTION_COMPENSATED);
+    return reduce_range(size, REDUCTION_CHUNK_SIZE, [&](size_t begin, size_t end)
+    {
+        return compensated ? kernels.compensated_dot(x + begin, y + begin, end - begin) : kernels.dot(x + begin, y + begin, end - begin);
+    });
+}
+
+
+
+template<typename real>
+inline void axpby(double alpha, const real * x, double beta, real * y, size_t size)
+{
+    // y = alpha * x + beta * y
+
+    const simd_kernel_table<real> & kernels = simd_kernels<real>();
+    #pragma omp parallel
+    {
+        size_t begin, end;
+        static_thread_range(size, &begin, &end);
+        kernels.axpby(alpha, x + begin, beta, y + begin, end - begin);
+    }
+}
+
+
+
+inline void gemv(double alpha, const double * A, const double * x, double beta, double * y, size_t num_rows, size_t num_cols)
+{
+    // y = alpha * A * x + beta * y;
+
+    const simd_kernel_table<double> & kernels = simd_kernels<double>();
+    #pragma omp parallel
+    {
+        size_t begin, end;
+        static_thread_range(num_rows, &begin, &end);
+        kernels.gemv(alpha, A + begin * num_cols, x, beta, y + begin, end - begin, num_cols);
+    }
+}
+
+
+
+template<typename real>
+inline double gemv_dot(const real * A, const real * x, real * y, size_t num_rows, size_t num_cols, size_t row_offset = 0)
+{
+    // y = A * x; returns dot(x[row_offset : row_offset + num_rows], y)
+    // A can be a block of rows starting at row_offset of a larger matrix
+    // the dot product is accumulated while y[r] is still in a register, saving a pass over x and y
+
+    const simd_kernel_table<real> & kernels = simd_kernels<real>();
+    return reduce_range(num_rows, SIMD_GEMV_TILE_ROWS, [&](size_t begin, size_t end)
+    {
+        return kernels.gemv_dot(A + begin * num_cols, x, x + row_offset + begin, y + begin, end - begin, num_cols);
+    });
+}
+
+
+
+template<typename real>
+inline double update_solution_residual(double alpha, const real * p, const real * Ap, real * x, real * r, size_t size)
+{
+    // x = x + alpha * p; r = r - alpha * Ap; returns dot(r, r)
+
+    return reduce_range(size, REDUCTION_CHUNK_SIZE, [&](size_t begin, size_t end)
+    {
+        double result = 0.0;
+        for(size_t i = begin; i < end; i++)
+        {
+            x[i] += alpha * p[i];
+            real r_val = r[i] - alpha * Ap[i];
+            r[i] = r_val;
+            result += r_val * r_val;
+        }
+        return result;
+    });
+}
+
+
+
+template<typename real>
+inline void pipelined_update(double alpha, double beta, const real * m, const real * n, real * x, real * r, real * u, real * w, real * p, real * s, real * q, real * z, size_t size, double * dots)
+{
+    // all vector updates of an iteration of pipelined CG in a single pass:
+    // z = n + beta * z; q = m + beta * q; s = w + beta * s; p = u + beta * p;
+    // x = x + alpha * p; r = r - alpha * s; u = u - alpha * q; w = w - alpha * z
+    // dots receives dot(r, u), dot(w, u) and dot(r, r) of the updated vectors, which are all
+    // the reductions the next iteration needs
+    // without a preconditioner u, m and q are the same vectors as r, w and s
+
+    bool preconditioned = (u != r);
+    reduce_ranges(size, REDUCTION_CHUNK_SIZE, 3, [&](size_t begin, size_t end, double * partial)
+    {
+        double ru = 0.0;
+        double wu = 0.0;
+        double rr = 0.0;
+        for(size_t i = begin; i < end; i++)
+        {
+            real z_val = n[i] + beta * z[i];
+            real s_val = w[i] + beta * s[i];
+            real p_val = u[i] + beta * p[i];
+            z[i] = z_val;
+            s[i] = s_val;
+            p[i] = p_val;
+            x[i] += alpha * p_val;
+            real r_val = r[i] - alpha * s_val;
+            real w_val = w[i] - alpha * z_val;
+            real u_val = r_val;
+            r[i] = r_val;
+            w[i] = w_val;
+            if(preconditioned)
+            {
+                real q_val = m[i] + beta * q[i];
+                q[i] = q_val;
+                u_val = u[i] - alpha * q_val;
+                u[i] = u_val;
+            }
+            ru += r_val * u_val;
+            wu += w_val * u_val;
+            rr += r_val * r_val;
+        }
+        partial[0] += ru;
+        partial[1] += wu;
+        partial[2] += rr;
+    }, dots);
+}
+
+
+
+inline size_t packed_row_offset(size_t row, size_t size)
+{
+    // position of A[row][row] in the row-major packed upper triangle of a symmetric matrix
+    return row * (2 * size - row + 1) / 2;
+}
+
+
+
+inline size_t packed_partition_begin(size_t part, size_t num_parts, size_t size)
+{
+    // first row of the part-th of num_parts blocks of rows of a packed symmetric matrix,
+    // chosen so that all blocks hold about the same number of entries
+
+    if(part >= num_parts) return size;
+    size_t target = static_cast<size_t>(static_cast<double>(packed_row_offset(size, size)) * part / num_parts);
+    size_t lo = 0;
+    size_t hi = size;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if(packed_row_offset(mid, size) < target) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+
+
+template<typename real>
+inline double symv_dot(const real * A, const real * x, real * y, size_t size, real * buffer)
+{
+    // y = A * x for a symmetric A stored as its packed upper triangle; returns dot(x, y)
+    // every loaded entry A[i][j] contributes to both y[i] and y[j], so the matrix is streamed only once
+    // buffer has to hold size * (number of threads) values, each thread scatters its y[j] contributions into its own part
+
+    double result = 0.0;
+    #pragma omp parallel
+    {
+        int thread = 0;
+        int num_threads = 1;
+#ifdef _OPENMP
+        thread = omp_get_thread_num();
+        num_threads = omp_get_num_threads();
+#endif
+        size_t row_begin = packed_partition_begin(thread, num_threads, size);
+        size_t row_end = packed_partition_begin(thread + 1, num_threads, size);
+        real * y_part = buffer + thread * size;
+
+        for(size_t i = 0; i < size; i++)
+        {
+            y_part[i] = 0.0;
+        }
+
+        for(size_t i = row_begin; i < row_end; i++)
+        {
+            const real * A_row = A + packed_row_offset(i, size) - i;
+            double x_i = x[i];
+            double y_i = A_row[i] * x_i;
+            for(size_t j = i + 1; j < size; j++)
+            {
+                y_i += A_row[j] * x[j];
+                y_part[j] += A_row[j] * x_i;
+            }
+            y_part[i] += y_i;
+        }
+
+        #pragma omp barrier
+
+        #pragma omp for schedule(static) reduction(+:result)
+        for(size_t i = 0; i < size; i++)
+        {
+            double y_val = 0.0;
+            for(int t = 0; t < num_threads; t++)
+            {
+                y_val += buffer[t * size + i];
+            }
+            y[i] = y_val;
+            result += x[i] * y_val;
+        }
+    }
+    return result;
+}
+
+
+
+template<typename real>
+inline double csr_spmv_dot(const real * values, const size_t * row_ptr, const uint32_t * col_idx, const real * x, real * y, size_t num_rows)
+{
+    // y = A * x for A in the CSR format; returns dot(x, y)
+
+    return reduce_range(num_rows, REDUCTION_CHUNK_SIZE, [&](size_t begin, size_t end)
+    {
+        double result = 0.0;
+        for(size_t r = begin; r < end; r++)
+        {
+            double y_val = 0.0;
+            for(size_t k = row_ptr[r]; k < row_ptr[r + 1]; k++)
+            {
+                y_val += values[k] * x[col_idx[k]];
+            }
+            y[r] = y_val;
+            result += x[r] * y_val;
+        }
+        return result;
+    });
+}
+
+
+
+template<size_t C, typename real>
+inline double sell_spmv_dot(const real * values, const size_t * chunk_ptr, const uint32_t * col_idx, const uint32_t * row_perm, const real * x, real * y, size_t num_rows)
+{
+    // y = A * x for A in the SELL-C-sigma format with chunk size C; returns dot(x, y)
+    // the innermost loop runs over the C rows of a chunk, which are stored contiguously
+
+    size_t num_chunks = (num_rows + C - 1) / C;
+    return reduce_range(num_chunks, REDUCTION_CHUNK_SIZE / C, [&](size_t chunk_begin, size_t chunk_end)
+    {
+        double result = 0.0;
+        for(size_t c = chunk_begin; c < chunk_end; c++)
+        {
+            double y_chunk[C];
+            for(size_t k = 0; k < C; k++)
+            {
+                y_chunk[k] = 0.0;
+            }
+
+            size_t chunk_len = (chunk_ptr[c + 1] - chunk_ptr[c]) / C;
+            const real * values_chunk = values + chunk_ptr[c];
+            const uint32_t * col_idx_chunk = col_idx + chunk_ptr[c];
+            for(size_t j = 0; j < chunk_len; j++)
+            {
+                #pragma omp simd
+                for(size_t k = 0; k < C; k++)
+                {
+                    y_chunk[k] += values_chunk[j * C + k] * x[col_idx_chunk[j * C + k]];
+                }
+            }
+
+            for(size_t k = 0; k < C; k++)
+            {
+                size_t row = row_perm[c * C + k];
+                if(row < num_rows)
+                {
+                    y[row] = y_chunk[k];
+                    result += x[row] * y_chunk[k];
+                }
+            }
+        }
+        return result;
+    });
+}
+
+
+
+template<typename real>
+inline double laplacian_5point_dot(const real * x, real * y, size_t nx, size_t ny)
+{
+    // y = A * x for the 5-point Laplacian of an nx x ny grid with zero values outside of the grid,
+    // (A * x)[j][i] = 4 * x[j][i] - x[j-1][i] - x[j+1][i] - x[j][i-1] - x[j][i+1]; returns dot(x, y)
+    // this is the stencil of heat_iteration in the heat equation project; A is never stored, so
+    // only x and y are streamed from memory, the neighbouring grid rows are reused from the cache
+
+    // the chunks of the deterministic reductions are whole grid rows
+    return reduce_range(ny, std::max<size_t>(1, REDUCTION_CHUNK_SIZE / std::max<size_t>(nx, 1)), [&](size_t j_begin, size_t j_end)
+    {
+        double result = 0.0;
+        for(size_t j = j_begin; j < j_end; j++)
+        {
+            // a missing neighbouring row is replaced by the row itself with weight zero, which keeps
+            // the inner loop free of branches
+            const real * x_row = x + j * nx;
+            const real * x_south = (j > 0) ? x_row - nx : x_row;
+            const real * x_north = (j + 1 < ny) ? x_row + nx : x_row;
+            double w_south = (j > 0) ? 1.0 : 0.0;
+            double w_north = (j + 1 < ny) ? 1.0 : 0.0;
+            real * y_row = y + j * nx;
+
+            double east = (nx > 1) ? x_row[1] : 0.0;
+            double y_val = 4.0 * x_row[0] - east - w_south * x_south[0] - w_north * x_north[0];
+            y_row[0] = y_val;
+            double row_result = x_row[0] * y_val;
+            for(size_t i = 1; i + 1 < nx; i++)
+            {
+                y_val = 4.0 * x_row[i] - x_row[i - 1] - x_row[i + 1] - w_south * x_south[i] - w_north * x_north[i];
+                y_row[i] = y_val;
+                row_result += x_row[i] * y_val;
+            }
+            if(nx > 1)
+            {
+                size_t i = nx - 1;
+                y_val = 4.0 * x_row[i] - x_row[i - 1] - w_south * x_south[i] - w_north * x_north[i];
+                y_row[i] = y_val;
+                row_result += x_row[i] * y_val;
+            }
+            result += row_result;
+        }
+        return result;
+    });
+}
+
+
+
+// Kernels on blocks of vectors for solving with several right-hand sides at once. A block of
+// vectors is stored row-major with leading dimension ld, i.e. entry (i, j) is at X[i * ld + j],
+// and the kernels work on its first num_vecs columns. Streaming the matrix once for all vectors
+// turns the memory bound matrix-vector product into a matrix-matrix product.
+
+
+
+const size_t GEMM_TILE_ROWS = 4;
+const size_t GEMM_TILE_COLS = 8;
+
+
+
+template<size_t W, typename real>
+inline void gemm_tile(const real * A_tile, const real * X, size_t num_cols, size_t ld, size_t height, double * y_tile)
+{
+    // y_tile[i * W + j] = sum over c of A_tile[i * num_cols + c] * X[c * ld + j] for i < height and j < W
+    // with the full height of GEMM_TILE_ROWS rows and the width known at compile time, the accumulators stay in registers
+
+    double acc[GEMM_TILE_ROWS][W] = {};
+    if(height == GEMM_TILE_ROWS)
+    {
+        for(size_t c = 0; c < num_cols; c++)
+        {
+            const real * x_row = X + c * ld;
+            for(size_t i = 0; i < GEMM_TILE_ROWS; i++)
+            {
+                double a = A_tile[i * num_cols + c];
+                #pragma omp simd
+                for(size_t j = 0; j < W; j++)
+                {
+                    acc[i][j] += a * x_row[j];
+                }
+            }
+        }
+    }
+    else
+    {
+        for(size_t c = 0; c < num_cols; c++)
+        {
+            const real * x_row = X + c * ld;
+            for(size_t i = 0; i < height; i++)
+            {
+                double a = A_tile[i * num_cols + c];
+                for(size_t j = 0; j < W; j++)
+                {
+                    acc[i][j] += a * x_row[j];
+                }
+            }
+        }
+    }
+    for(size_t i = 0; i < height; i++)
+    {
+        for(size_t j = 0; j < W; j++)
+        {
+            y_tile[i * W + j] = acc[i][j];
+        }
+    }
+}
+
+
+
+template<typename real>
+inline void gemm_dot(const real * A, const real * X, real * Y, size_t num_rows, size_t num_cols, size_t ld, size_t num_vecs, double * result, size_t row_offset = 0)
+{
+    // Y = A * X; result[j] = dot(X[row_offset : row_offset + num_rows, j], Y[:, j])
+    // A can be a block of rows starting at row_offset of a larger matrix, as in gemv_dot
+    // Y is computed in tiles of GEMM_TILE_ROWS rows and up to GEMM_TILE_COLS columns, so that every
+    // loaded entry of X is used for several rows; the rows of A of a tile are read from memory once
+    // and from the cache for the other tiles of columns
+
+    size_t num_tiles = (num_rows + GEMM_TILE_ROWS - 1) / GEMM_TILE_ROWS;
+    reduce_ranges(num_tiles, REDUCTION_CHUNK_SIZE / (GEMM_TILE_ROWS * GEMM_TILE_COLS), num_vecs, [&](size_t tile_begin, size_t tile_end, double * partial)
+    {
+        for(size_t t = tile_begin; t < tile_end; t++)
+        {
+            size_t r_begin = t * GEMM_TILE_ROWS;
+            size_t height = std::min(GEMM_TILE_ROWS, num_rows - r_begin);
+            const real * A_tile = A + r_begin * num_cols;
+            for(size_t j_begin = 0; j_begin < num_vecs; j_begin += GEMM_TILE_COLS)
+            {
+                size_t width = std::min(GEMM_TILE_COLS, num_vecs - j_begin);
+                double y_tile[GEMM_TILE_ROWS * GEMM_TILE_COLS];
+                const real * X_tile = X + j_begin;
+                switch(width)
+                {
+                    case 1: gemm_tile<1>(A_tile, X_tile, num_cols, ld, height, y_tile); break;
+                    case 2: gemm_tile<2>(A_tile, X_tile, num_cols, ld, height, y_tile); break;
+                    case 3: gemm_tile<3>(A_tile, X_tile, num_cols, ld, height, y_tile); break;
+                    case 4: gemm_tile<4>(A_tile, X_tile, num_cols, ld, height, y_tile); break;
+                    case 5: gemm_tile<5>(A_tile, X_tile, num_cols, ld, height, y_tile); break;
+                    case 6: gemm_tile<6>(A_tile, X_tile, num_cols, ld, height, y_tile); break;
+                    case 7: gemm_tile<7>(A_tile, X_tile, num_cols, ld, height, y_tile); break;
+                    default: gemm_tile<GEMM_TILE_COLS>(A_tile, X_tile, num_cols, ld, height, y_tile); break;
+                }
+                for(size_t i = 0; i < height; i++)
+                {
+                    size_t r = r_begin + i;
+                    for(size_t j = 0; j < width; j++)
+                    {
+                        Y[r * ld + j_begin + j] = y_tile[i * width + j];
+                        partial[j_begin + j] += X[(row_offset + r) * ld + j_begin + j] * y_tile[i * width + j];
+                    }
+                }
+            }
+        }
+    }, result);
+}
+
+
+
+template<typename real>
+inline void csr_spmm_dot(const real * values, const size_t * row_ptr, const uint32_t * col_idx, const real * X, real * Y, size_t num_rows, size_t ld, size_t num_vecs, double * result)
+{
+    // Y = A * X for A in the CSR format; result[j] = dot(X[:, j], Y[:, j])
+
+    reduce_ranges(num_rows, REDUCTION_CHUNK_SIZE / std::max<size_t>(num_vecs, 1), num_vecs, [&](size_t begin, size_t end, double * partial)
+    {
+        for(size_t r = begin; r < end; r++)
+        {
+            real * y_row = Y + r * ld;
+            for(size_t j = 0; j < num_vecs; j++)
+            {
+                y_row[j] = 0.0;
+            }
+            for(size_t k = row_ptr[r]; k < row_ptr[r + 1]; k++)
+            {
+                real a = values[k];
+                const real * x_row = X + static_cast<size_t>(col_idx[k]) * ld;
+                #pragma omp simd
+                for(size_t j = 0; j < num_vecs; j++)
+                {
+                    y_row[j] += a * x_row[j];
+                }
+            }
+            for(size_t j = 0; j < num_vecs; j++)
+            {
+                partial[j] += X[r * ld + j] * y_row[j];
+            }
+        }
+    }, result);
+}
+
+
+
+template<typename real>
+inline void dot_block(const real * X, const real * Y, size_t size, size_t ld, size_t num_vecs, double * result)
+{
+    // result[j] = dot(X[:, j], Y[:, j])
+
+    reduce_ranges(size, REDUCTION_CHUNK_SIZE / std::max<size_t>(num_vecs, 1), num_vecs, [&](size_t begin, size_t end, double * partial)
+    {
+        for(size_t i = begin; i < end; i++)
+        {
+            for(size_t j = 0; j < num_vecs; j++)
+            {
+                partial[j] += static_cast<double>(X[i * ld + j]) * Y[i * ld + j];
+            }
+        }
+    }, result);
+}
+
+
+
+template<typename real>
+inline void update_solution_residual_block(const double * alpha, const real * P, const real * AP, real * X, real * R, size_t size, size_t ld, size_t num_vecs, double * result)
+{
+    // X[:, j] = X[:, j] + alpha[j] * P[:, j]; R[:, j] = R[:, j] - alpha[j] * AP[:, j]; result[j] = dot(R[:, j], R[:, j])
+
+    reduce_ranges(size, REDUCTION_CHUNK_SIZE / std::max<size_t>(num_vecs, 1), num_vecs, [&](size_t begin, size_t end, double * partial)
+    {
+        for(size_t i = begin; i < end; i++)
+        {
+            for(size_t j = 0; j < num_vecs; j++)
+            {
+                X[i * ld + j] += alpha[j] * P[i * ld + j];
+                real r_val = R[i * ld + j] - alpha[j] * AP[i * ld + j];
+                R[i * ld + j] = r_val;
+                partial[j] += r_val * r_val;
+            }
+        }
+    }, result);
+}
+
+
+
+template<typename real>
+inline void axpby_block(const real * X, const double * beta, real * Y, size_t size, size_t ld, size_t num_vecs)
+{
+    // Y[:, j] = X[:, j] + beta[j] * Y[:, j]
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < size; i++)
+    {
+        for(size_t j = 0; j < num_vecs; j++)
+        {
+            Y[i * ld + j] = X[i * ld + j] + beta[j] * Y[i * ld + j];
+        }
+    }
+}
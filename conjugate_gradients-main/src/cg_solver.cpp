@@ -0,0 +1,918 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <chrono>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "cg_solver.h"
+#include "cg_kernels.h"
+#include "performance_report.h"
+
+
+
+template<typename real>
+size_t matvec_buffer_size(const basic_matrix_storage<real> & A)
+{
+    int num_threads = 1;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+    if(A.format == MATRIX_FORMAT_PACKED_SYMMETRIC) return A.num_rows * num_threads;
+    return 0;
+}
+
+
+
+static double out_of_core_dot(const basic_matrix_storage<double> & A, const double * x, double * y)
+{
+    return out_of_core_gemv_dot(A.out_of_core, x, y);
+}
+
+
+
+static double out_of_core_dot(const basic_matrix_storage<float> &, const float *, float *)
+{
+    // setup_cg_solver does not make single precision copies of out-of-core matrices
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+
+
+static double operator_dot(const matrix_operator & op, const double * x, double * y)
+{
+    return op.apply_dot(op.context, x, y);
+}
+
+
+
+static double operator_dot(const matrix_operator & op, const float * x, float * y)
+{
+    // setup_cg_solver checks that the operator has a single precision product
+    return op.apply_dot_float(op.context, x, y);
+}
+
+
+
+template<typename real>
+double matvec_dot(const basic_matrix_storage<real> & A, const real * x, real * y, real * buffer)
+{
+    // y = A * x; returns dot(x, y)
+
+    switch(A.format)
+    {
+        case MATRIX_FORMAT_DENSE: return gemv_dot(A.data, x, y, A.num_rows, A.num_cols);
+        case MATRIX_FORMAT_PACKED_SYMMETRIC: return symv_dot(A.data, x, y, A.num_rows, buffer);
+        case MATRIX_FORMAT_CSR: return csr_spmv_dot(A.data, A.row_ptr, A.col_idx, x, y, A.num_rows);
+        case MATRIX_FORMAT_SELL: return sell_spmv_dot<SELL_CHUNK_SIZE>(A.data, A.row_ptr, A.col_idx, A.row_perm, x, y, A.num_rows);
+        case MATRIX_FORMAT_OPERATOR: return operator_dot(A.op, x, y);
+        case MATRIX_FORMAT_OUT_OF_CORE: return out_of_core_dot(A, x, y);
+    }
+    return 0.0;
+}
+
+
+
+template<typename real>
+double compute_residual(const basic_matrix_storage<real> & A, const real * b, const real * x, real * r, real * buffer, size_t size)
+{
+    // r = b - A * x; returns dot(r, r)
+
+    matvec_dot(A, x, r, buffer);
+
+    return reduce_range(size, REDUCTION_CHUNK_SIZE, [&](size_t begin, size_t end)
+    {
+        double result = 0.0;
+        for(size_t i = begin; i < end; i++)
+        {
+            real r_val = b[i] - r[i];
+            r[i] = r_val;
+            result += r_val * r_val;
+        }
+        return result;
+    });
+}
+
+
+
+template<typename real>
+int conjugate_gradients_iterations(const basic_matrix_storage<real> & A, const preconditioner<real> & M, const real * b, const real * x0, real * x, size_t size, int max_iters, double rel_error, const cg_vectors<real> & vectors, const cg_checkpoint * restart, checkpoint_writer * checkpoint, double * rel_residual_out, solver_status * status_out)
+{
+    // runs (preconditioned) CG starting from the initial guess x0, or from x = 0 if x0 is nullptr;
+    // returns the number of iterations, or max_iters + 1 if it did not converge
+    // a failed product (NaN) stops the iterations and sets *status_out
+    // without a preconditioner, z is the same vector as r
+    // with a restart checkpoint, x0 is ignored and the iterations continue after the one that wrote
+    // the checkpoint; with a checkpoint writer, the state after an iteration is checkpointed when it is due
+
+    double alpha, beta, bb, rr, rz, rz_new;
+    bool preconditioned = (M.type != PRECONDITIONER_NONE);
+    real * r = vectors.r;
+    real * p = vectors.p;
+    real * Ap = vectors.Ap;
+    real * z = vectors.z;
+    real * buffer = vectors.buffer;
+    int num_iters;
+    double matvec_bytes, matvec_flops, preconditioner_bytes, preconditioner_flops, start;
+    matvec_cost(A, 1, &matvec_bytes, &matvec_flops);
+    preconditioner_cost(M, &preconditioner_bytes, &preconditioner_flops);
+    double vector_bytes = static_cast<double>(size) * sizeof(real);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < size; i++)
+    {
+        x[i] = (x0 != nullptr) ? x0[i] : 0.0;
+        r[i] = b[i];
+        p[i] = b[i];
+    }
+
+    start = kernel_timer_start();
+    bb = dot(b, b, size);
+    kernel_timer_stop(KERNEL_DOT, start, 2.0 * vector_bytes, 2.0 * size);
+    rr = bb;
+    if(x0 != nullptr)
+    {
+        // r = b - A * x0 costs one extra matrix-vector product
+        rr = compute_residual(A, b, x, r, buffer, size);
+        axpby(1.0, r, 0.0, p, size);
+    }
+    *status_out = SOLVER_SUCCESS;
+    if(std::isnan(rr))
+    {
+        *status_out = SOLVER_PRODUCT_FAILED;
+        *rel_residual_out = rr;
+        return max_iters + 1;
+    }
+    rz = rr;
+    if(preconditioned)
+    {
+        rz = apply_preconditioner_dot(M, r, z);
+        axpby(1.0, z, 0.0, p, size);
+    }
+
+    num_iters = 0;
+    if(restart != nullptr)
+    {
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++)
+        {
+            x[i] = restart->x[i];
+            r[i] = restart->r[i];
+            p[i] = restart->p[i];
+        }
+        rr = restart->rr;
+        rz = restart->rz;
+        num_iters = restart->num_iters;
+    }
+    if(checkpoint != nullptr) reset_checkpoint_writer(checkpoint, num_iters);
+
+    // an initial guess may already be accurate enough
+    if(std::sqrt(rr / bb) >= rel_error)
+    {
+        for(num_iters = num_iters + 1; num_iters <= max_iters; num_iters++)
+        {
+            start = kernel_timer_start();
+            double pAp = matvec_dot(A, p, Ap, buffer);
+            kernel_timer_stop(KERNEL_MATVEC, start, matvec_bytes, matvec_flops);
+            if(std::isnan(pAp))
+            {
+                *status_out = SOLVER_PRODUCT_FAILED;
+                break;
+            }
+            alpha = rz / pAp;
+
+            start = kernel_timer_start();
+            rr = update_solution_residual(alpha, p, Ap, x, r, size);
+            kernel_timer_stop(KERNEL_UPDATE, start, 6.0 * vector_bytes, 6.0 * size);
+
+            record_residual(std::sqrt(rr / bb));
+            if(std::sqrt(rr / bb) < rel_error) { break; }
+
+            rz_new = rr;
+            if(preconditioned)
+            {
+                start = kernel_timer_start();
+                rz_new = apply_preconditioner_dot(M, r, z);
+                kernel_timer_stop(KERNEL_PRECONDITIONER, start, preconditioner_bytes, preconditioner_flops);
+            }
+            beta = rz_new / rz;
+            rz = rz_new;
+
+            start = kernel_timer_start();
+            axpby(1.0, z, beta, p, size);
+            kernel_timer_stop(KERNEL_AXPBY, start, 3.0 * vector_bytes, 3.0 * size);
+
+            if(checkpoint != nullptr) checkpoint_iteration(checkpoint, num_iters, x, r, p, rr, rz, bb);
+        }
+    }
+
+    *rel_residual_out = std::sqrt(rr / bb);
+
+    return num_iters;
+}
+
+
+
+template<typename real>
+int pipelined_conjugate_gradients_iterations(const basic_matrix_storage<real> & A, const preconditioner<real> & M, const real * b, const real * x0, real * x, size_t size, int max_iters, double rel_error, int replacement_interval, const cg_vectors<real> & vectors, double * rel_residual_out, solver_status * status_out)
+{
+    // pipelined (Ghysels-Vanroose) variant of conjugate_gradients_iterations: besides x, r and p it
+    // keeps u = M^-1 * r, w = A * u, s = A * p, q = M^-1 * s and z = A * q up to date by recurrences,
+    // so the three dot products of an iteration are computed in one pass with the vector updates
+    // and the next matrix-vector product does not have to wait for them
+    // the recurrences drift away from the true vectors, so every replacement_interval iterations
+    // (0 disables it) they are recomputed from x and p
+    // without a preconditioner, u, m and q are the same vectors as r, w and s
+
+    double alpha, beta, bb, gamma, gamma_old, alpha_old;
+    double dots[3];
+    bool preconditioned = (M.type != PRECONDITIONER_NONE);
+    real * r = vectors.r;
+    real * w = vectors.w;
+    real * n = vectors.n;
+    real * p = vectors.p;
+    real * s = vectors.s;
+    real * z = vectors.z;
+    real * u = vectors.u;
+    real * m = vectors.m;
+    real * q = vectors.q;
+    real * buffer = vectors.buffer;
+    int num_iters;
+    double matvec_bytes, matvec_flops, preconditioner_bytes, preconditioner_flops, start;
+    matvec_cost(A, 1, &matvec_bytes, &matvec_flops);
+    preconditioner_cost(M, &preconditioner_bytes, &preconditioner_flops);
+    double vector_bytes = static_cast<double>(size) * sizeof(real);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < size; i++)
+    {
+        x[i] = (x0 != nullptr) ? x0[i] : 0.0;
+        r[i] = b[i];
+        p[i] = 0.0;
+        s[i] = 0.0;
+        q[i] = 0.0;
+        z[i] = 0.0;
+    }
+
+    bb = dot(b, b, size);
+    dots[2] = bb;
+    if(x0 != nullptr) dots[2] = compute_residual(A, b, x, r, buffer, size);
+    if(preconditioned) apply_preconditioner_dot(M, r, u);
+    bool failed = std::isnan(dots[2]) || std::isnan(matvec_dot(A, u, w, buffer));
+    dots[0] = dot(r, u, size);
+    dots[1] = dot(w, u, size);
+    gamma_old = 1.0;
+    alpha_old = 1.0;
+
+    // an initial guess may already be accurate enough
+    num_iters = 0;
+    if(failed) num_iters = max_iters + 1;
+    if(!failed && std::sqrt(dots[2] / bb) >= rel_error)
+    {
+        for(num_iters = 1; num_iters <= max_iters; num_iters++)
+        {
+            if(preconditioned)
+            {
+                start = kernel_timer_start();
+                apply_preconditioner_dot(M, w, m);
+                kernel_timer_stop(KERNEL_PRECONDITIONER, start, preconditioner_bytes, preconditioner_flops);
+            }
+            start = kernel_timer_start();
+            failed = std::isnan(matvec_dot(A, m, n, buffer));
+            kernel_timer_stop(KERNEL_MATVEC, start, matvec_bytes, matvec_flops);
+            if(failed) { break; }
+
+            gamma = dots[0];
+            beta = (num_iters == 1) ? 0.0 : gamma / gamma_old;
+            alpha = gamma / (dots[1] - beta * gamma / alpha_old);
+            gamma_old = gamma;
+            alpha_old = alpha;
+            start = kernel_timer_start();
+            pipelined_update(alpha, beta, m, n, x, r, u, w, p, s, q, z, size, dots);
+            kernel_timer_stop(KERNEL_PIPELINED_UPDATE, start, (preconditioned ? 18.0 : 13.0) * vector_bytes, (preconditioned ? 22.0 : 18.0) * size);
+
+            if(replacement_interval > 0 && num_iters % replacement_interval == 0)
+            {
+                failed = std::isnan(compute_residual(A, b, x, r, buffer, size));
+                if(preconditioned) apply_preconditioner_dot(M, r, u);
+                failed = std::isnan(matvec_dot(A, u, w, buffer)) || failed;
+                failed = std::isnan(matvec_dot(A, p, s, buffer)) || failed;
+                if(preconditioned) apply_preconditioner_dot(M, s, q);
+                failed = std::isnan(matvec_dot(A, q, z, buffer)) || failed;
+                dots[0] = dot(r, u, size);
+                dots[1] = dot(w, u, size);
+                dots[2] = dot(r, r, size);
+                if(failed) { break; }
+            }
+
+            record_residual(std::sqrt(dots[2] / bb));
+            if(std::sqrt(dots[2] / bb) < rel_error) { break; }
+        }
+    }
+
+    *rel_residual_out = std::sqrt(dots[2] / bb);
+    *status_out = failed ? SOLVER_PRODUCT_FAILED : SOLVER_SUCCESS;
+
+    return num_iters;
+}
+
+
+
+
+
+
+static void matvec_block_dot(const matrix_storage & A, const double * X, double * Y, size_t ld, size_t num_vecs, double * buffer, double * result)
+{
+    // Y = A * X for the first num_vecs columns of the row-major blocks X and Y; result[j] = dot(X[:, j], Y[:, j])
+    // the packed and SELL formats and the matrix-free operators have no block kernel, their columns are multiplied one at a time
+    // through the first 2 * size entries of buffer, followed by the buffer of matvec_dot
+
+    size_t size = A.num_rows;
+    switch(A.format)
+    {
+        case MATRIX_FORMAT_DENSE: gemm_dot(A.data, X, Y, size, A.num_cols, ld, num_vecs, result); return;
+        case MATRIX_FORMAT_CSR: csr_spmm_dot(A.data, A.row_ptr, A.col_idx, X, Y, size, ld, num_vecs, result); return;
+        case MATRIX_FORMAT_OUT_OF_CORE: out_of_core_gemm_dot(A.out_of_core, X, Y, ld, num_vecs, result); return;
+        default: break;
+    }
+
+    double * x = buffer;
+    double * y = buffer + size;
+    for(size_t j = 0; j < num_vecs; j++)
+    {
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++)
+        {
+            x[i] = X[i * ld + j];
+        }
+        result[j] = matvec_dot(A, x, y, buffer + 2 * size);
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++)
+        {
+            Y[i * ld + j] = y[i];
+        }
+    }
+}
+
+
+
+static void swap_columns(double * X, size_t size, size_t ld, size_t a, size_t b)
+{
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < size; i++)
+    {
+        std::swap(X[i * ld + a], X[i * ld + b]);
+    }
+}
+
+
+
+static void block_conjugate_gradients(const matrix_storage & A, const double * B, const double * X0, double * X, size_t size, size_t num_rhs, int max_iters, double rel_error, const block_vectors & vectors, solver_result * result)
+{
+    // solves A * X = B for all columns of the row-major size x num_rhs matrix B at once; every column
+    // runs its own CG recurrence, but the matrix is streamed only once per iteration for all of them
+    // a converged column is deflated: it is swapped behind the active columns, which are the only
+    // ones the kernels work on from then on, and column[j] keeps track of where column j came from
+
+    size_t k = num_rhs;
+    double * X_work = vectors.X;
+    double * R = vectors.R;
+    double * P = vectors.P;
+    double * AP = vectors.AP;
+    double * buffer = vectors.buffer;
+    double * bb = vectors.bb;
+    double * rr = vectors.rr;
+    double * rr_new = vectors.rr_new;
+    double * alpha = vectors.alpha;
+    double * beta = vectors.beta;
+    size_t * column = vectors.column;
+    int * num_iters = vectors.num_iters;
+    double * rel_residual = vectors.rel_residual;
+    size_t num_active = k;
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < size * k; i++)
+    {
+        X_work[i] = (X0 != nullptr) ? X0[i] : 0.0;
+        R[i] = B[i];
+    }
+    if(X0 != nullptr)
+    {
+        // R = B - A * X0
+        matvec_block_dot(A, X_work, AP, k, k, buffer, alpha);
+        if(std::isnan(alpha[0])) result->status = SOLVER_PRODUCT_FAILED;
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size * k; i++)
+        {
+            R[i] -= AP[i];
+        }
+    }
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < size * k; i++)
+    {
+        P[i] = R[i];
+    }
+
+    for(size_t j = 0; j < k; j++)
+    {
+        beta[j] = 0.0;
+        column[j] = j;
+        num_iters[j] = max_iters + 1;
+    }
+    dot_block(B, B, size, k, k, bb);
+    dot_block(R, R, size, k, k, rr);
+    for(size_t j = 0; j < k; j++)
+    {
+        rel_residual[j] = std::sqrt(rr[j] / bb[j]);
+    }
+
+    for(int iter = 0; iter <= max_iters && num_active > 0 && result->status == SOLVER_SUCCESS; iter++)
+    {
+        double vector_bytes = static_cast<double>(size) * num_active * sizeof(double);
+        if(iter > 0)
+        {
+            double matvec_bytes, matvec_flops;
+            matvec_cost(A, num_active, &matvec_bytes, &matvec_flops);
+            double start = kernel_timer_start();
+            matvec_block_dot(A, P, AP, k, num_active, buffer, alpha);
+            kernel_timer_stop(KERNEL_MATVEC, start, matvec_bytes, matvec_flops);
+            for(size_t j = 0; j < num_active; j++)
+            {
+                if(std::isnan(alpha[j])) result->status = SOLVER_PRODUCT_FAILED;
+                alpha[j] = rr[j] / alpha[j];
+            }
+            if(result->status != SOLVER_SUCCESS) { break; }
+
+            start = kernel_timer_start();
+            update_solution_residual_block(alpha, P, AP, X_work, R, size, k, num_active, rr_new);
+            kernel_timer_stop(KERNEL_UPDATE, start, 6.0 * vector_bytes, 6.0 * size * num_active);
+
+            double max_rel_residual = 0.0;
+            for(size_t j = 0; j < num_active; j++)
+            {
+                beta[j] = rr_new[j] / rr[j];
+                rr[j] = rr_new[j];
+                rel_residual[column[j]] = std::sqrt(rr[j] / bb[j]);
+                max_rel_residual = std::fmax(max_rel_residual, rel_residual[column[j]]);
+            }
+            record_residual(max_rel_residual);
+        }
+
+        // deflate the converged columns, a zero right-hand side is converged from the start
+        for(size_t j = num_active; j-- > 0; )
+        {
+            if(bb[j] != 0.0 && std::sqrt(rr[j] / bb[j]) >= rel_error) continue;
+            if(bb[j] == 0.0)
+            {
+                // the solution is zero, whatever the initial guess was
+                for(size_t i = 0; i < size; i++)
+                {
+                    X_work[i * k + j] = 0.0;
+                }
+                rel_residual[column[j]] = 0.0;
+            }
+            num_iters[column[j]] = iter;
+            size_t last = num_active - 1;
+            if(j != last)
+            {
+                swap_columns(X_work, size, k, j, last);
+                swap_columns(R, size, k, j, last);
+                swap_columns(P, size, k, j, last);
+                std::swap(bb[j], bb[last]);
+                std::swap(rr[j], rr[last]);
+                std::swap(beta[j], beta[last]);
+                std::swap(column[j], column[last]);
+            }
+            num_active--;
+        }
+
+        if(iter > 0)
+        {
+            double start = kernel_timer_start();
+            axpby_block(R, beta, P, size, k, num_active);
+            kernel_timer_stop(KERNEL_AXPBY, start, 3.0 * static_cast<double>(size) * num_active * sizeof(double), 3.0 * size * num_active);
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < size; i++)
+    {
+        for(size_t j = 0; j < k; j++)
+        {
+            X[i * k + column[j]] = X_work[i * k + j];
+        }
+    }
+
+    result->converged = (result->status == SOLVER_SUCCESS);
+    result->num_iters = 0;
+    result->rel_residual = 0.0;
+    for(size_t j = 0; j < k; j++)
+    {
+        result->converged = result->converged && (num_iters[j] <= max_iters);
+        result->num_iters = std::max(result->num_iters, std::min(num_iters[j], max_iters));
+        result->rel_residual = std::fmax(result->rel_residual, rel_residual[j]);
+    }
+    result->column_num_iters = num_iters;
+    result->column_rel_residual = rel_residual;
+}
+
+
+
+static basic_matrix_storage<float> convert_to_float(const matrix_storage & A)
+{
+    // the index arrays of the sparse formats are shared with A, only the values are converted
+    // (a matrix-free operator has none)
+
+    basic_matrix_storage<float> A_float;
+    A_float.format = A.format;
+    A_float.num_rows = A.num_rows;
+    A_float.num_cols = A.num_cols;
+    A_float.op = A.op;
+    A_float.op.release = nullptr;
+    A_float.num_nonzeros = A.num_nonzeros;
+    A_float.row_ptr = A.row_ptr;
+    A_float.col_idx = A.col_idx;
+    A_float.row_perm = A.row_perm;
+    allocate_matrix_storage(&A_float);
+
+    size_t num_values = matrix_storage_size(A);
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < num_values; i++)
+    {
+        A_float.data[i] = static_cast<float>(A.data[i]);
+    }
+
+    return A_float;
+}
+
+
+
+static void mixed_precision_conjugate_gradients(const cg_solver & solver, const double * b, const double * x0, double * x, solver_result * result)
+{
+    // iterative refinement: the correction equation A * d = r is solved by CG in single precision,
+    // which streams only half of the bytes of the matrix, and the residual r = b - A * x is then
+    // recomputed in double precision; max_iters limits the total number of inner iterations
+
+    const int max_outer_iters = 100;
+    const double min_inner_rel_error = 1e-5;
+
+    const matrix_storage & A = *solver.A;
+    size_t size = solver.size;
+    int max_iters = solver.options.max_iters;
+    double rel_error = solver.options.rel_error;
+    double * r = solver.vectors.r;
+    double * buffer = solver.vectors.buffer;
+    float * r_float = solver.r_float;
+    float * d_float = solver.d_float;
+    int num_outer_iters = 0;
+    int num_inner_iters = 0;
+    bool stagnated = false;
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < size; i++)
+    {
+        x[i] = (x0 != nullptr) ? x0[i] : 0.0;
+        r[i] = b[i];
+    }
+
+    double bb = dot(b, b, size);
+    double rr = bb;
+    if(x0 != nullptr) rr = compute_residual(A, b, x, r, buffer, size);
+    solver_status status = std::isnan(rr) ? SOLVER_PRODUCT_FAILED : SOLVER_SUCCESS;
+    while(status == SOLVER_SUCCESS && std::sqrt(rr / bb) >= rel_error && num_outer_iters < max_outer_iters && num_inner_iters < max_iters)
+    {
+        // scale the residual to unit norm, so that the single precision values stay well within range
+        double r_norm = std::sqrt(rr);
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++)
+        {
+            r_float[i] = static_cast<float>(r[i] / r_norm);
+        }
+
+        // there is no point in solving the correction more accurately than needed to reach rel_error
+        double inner_rel_error = std::fmax(min_inner_rel_error, rel_error / std::sqrt(rr / bb));
+        double inner_rel_residual;
+        global_report().residual_scale = std::sqrt(rr / bb);
+        int inner_iters = conjugate_gradients_iterations(solver.A_float, solver.M_float, r_float, static_cast<const float *>(nullptr), d_float, size, max_iters - num_inner_iters, inner_rel_error, solver.vectors_float, nullptr, nullptr, &inner_rel_residual, &status);
+        global_report().residual_scale = 1.0;
+        num_inner_iters += std::min(inner_iters, max_iters - num_inner_iters);
+        num_outer_iters++;
+        if(status != SOLVER_SUCCESS) { break; }
+
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++)
+        {
+            x[i] += r_norm * d_float[i];
+        }
+
+        double rr_new = compute_residual(A, b, x, r, buffer, size);
+        if(std::isnan(rr_new))
+        {
+            status = SOLVER_PRODUCT_FAILED;
+            break;
+        }
+        stagnated = (rr_new >= rr);
+        rr = rr_new;
+        if(stagnated) { break; }
+    }
+
+    result->status = status;
+    result->converged = (status == SOLVER_SUCCESS && std::sqrt(rr / bb) < rel_error);
+    result->num_iters = num_inner_iters;
+    result->num_outer_iters = num_outer_iters;
+    result->stagnated = stagnated;
+    result->rel_residual = std::sqrt(rr / bb);
+}
+
+
+
+const size_t WORKSPACE_ALIGNMENT = 64;
+
+
+
+template<typename T>
+T * take_workspace(char * base, size_t * offset, size_t count)
+{
+    // the next count entries of the workspace, starting at a cache line; the entries are zeroed in
+    // parallel, so that their pages are first touched by the threads that work on them later
+    // while the size of the workspace is measured, base is nullptr and only the offset advances
+
+    T * part = nullptr;
+    if(base != nullptr)
+    {
+        part = reinterpret_cast<T *>(base + *offset);
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < count; i++)
+        {
+            part[i] = T();
+        }
+    }
+    *offset += (count * sizeof(T) + WORKSPACE_ALIGNMENT - 1) / WORKSPACE_ALIGNMENT * WORKSPACE_ALIGNMENT;
+    return part;
+}
+
+
+
+template<typename real>
+void layout_cg_vectors(cg_vectors<real> * vectors, char * base, size_t * offset, size_t size, size_t buffer_size, bool preconditioned, bool pipelined)
+{
+    *vectors = cg_vectors<real>();
+    vectors->r = take_workspace<real>(base, offset, size);
+    vectors->p = take_workspace<real>(base, offset, size);
+    if(pipelined)
+    {
+        vectors->w = take_workspace<real>(base, offset, size);
+        vectors->n = take_workspace<real>(base, offset, size);
+        vectors->s = take_workspace<real>(base, offset, size);
+        vectors->z = take_workspace<real>(base, offset, size);
+        vectors->u = preconditioned ? take_workspace<real>(base, offset, size) : vectors->r;
+        vectors->m = preconditioned ? take_workspace<real>(base, offset, size) : vectors->w;
+        vectors->q = preconditioned ? take_workspace<real>(base, offset, size) : vectors->s;
+    }
+    else
+    {
+        vectors->Ap = take_workspace<real>(base, offset, size);
+        vectors->z = preconditioned ? take_workspace<real>(base, offset, size) : vectors->r;
+    }
+    vectors->buffer = take_workspace<real>(base, offset, buffer_size);
+}
+
+
+
+static size_t layout_workspace(cg_solver * solver, char * base)
+{
+    // places the vectors the selected algorithm needs in the workspace at base; returns the size of the workspace
+    // r and the buffer of matvec_dot are always there, true_relative_residual needs them
+
+    const solver_options & options = solver->options;
+    size_t size = solver->size;
+    size_t k = options.num_rhs;
+    size_t buffer_size = matvec_buffer_size(*solver->A);
+    bool preconditioned = (solver->M->type != PRECONDITIONER_NONE);
+    size_t offset = 0;
+
+    solver->vectors_float = cg_vectors<float>();
+    solver->r_float = nullptr;
+    solver->d_float = nullptr;
+    solver->block = block_vectors();
+
+    if(k > 1)
+    {
+        solver->vectors = cg_vectors<double>();
+        solver->vectors.r = take_workspace<double>(base, &offset, size);
+        solver->vectors.buffer = take_workspace<double>(base, &offset, buffer_size);
+
+        block_vectors & block = solver->block;
+        block.X = take_workspace<double>(base, &offset, size * k);
+        block.R = take_workspace<double>(base, &offset, size * k);
+        block.P = take_workspace<double>(base, &offset, size * k);
+        block.AP = take_workspace<double>(base, &offset, size * k);
+        block.buffer = take_workspace<double>(base, &offset, 2 * size + buffer_size);
+        block.bb = take_workspace<double>(base, &offset, k);
+        block.rr = take_workspace<double>(base, &offset, k);
+        block.rr_new = take_workspace<double>(base, &offset, k);
+        block.alpha = take_workspace<double>(base, &offset, k);
+        block.beta = take_workspace<double>(base, &offset, k);
+        block.rel_residual = take_workspace<double>(base, &offset, k);
+        block.column = take_workspace<size_t>(base, &offset, k);
+        block.num_iters = take_workspace<int>(base, &offset, k);
+    }
+    else if(options.mixed_precision)
+    {
+        solver->vectors = cg_vectors<double>();
+        solver->vectors.r = take_workspace<double>(base, &offset, size);
+        solver->vectors.buffer = take_workspace<double>(base, &offset, buffer_size);
+        solver->r_float = take_workspace<float>(base, &offset, size);
+        solver->d_float = take_workspace<float>(base, &offset, size);
+        layout_cg_vectors(&solver->vectors_float, base, &offset, size, buffer_size, preconditioned, false);
+    }
+    else
+    {
+        layout_cg_vectors(&solver->vectors, base, &offset, size, buffer_size, preconditioned, options.pipelined);
+    }
+
+    return offset;
+}
+
+
+
+static void free_float_copies(cg_solver * solver)
+{
+    // the single precision matrix shares the index arrays of A, only its values are owned by the solver
+
+    delete[] solver->A_float.data;
+    solver->A_float = basic_matrix_storage<float>();
+    free_preconditioner(&solver->M_float);
+    solver->M_float = preconditioner<float>();
+}
+
+
+
+solver_status setup_cg_solver(cg_solver * solver, const matrix_storage & A, const preconditioner<double> & M, const solver_options & options)
+{
+    // a solver can be set up again, e.g. for another matrix; its workspace is only reallocated if it has to grow
+
+    if(A.num_rows != A.num_cols) return SOLVER_NOT_SQUARE;
+    if(options.num_rhs == 0) return SOLVER_NO_RHS;
+    if(options.num_rhs > 1 && (options.mixed_precision || options.pipelined || M.type != PRECONDITIONER_NONE)) return SOLVER_UNSUPPORTED_MULTIPLE_RHS;
+    if(A.format == MATRIX_FORMAT_OUT_OF_CORE && options.mixed_precision) return SOLVER_UNSUPPORTED_OUT_OF_CORE;
+    if(A.format == MATRIX_FORMAT_OPERATOR && (A.op.apply_dot == nullptr || (options.mixed_precision && A.op.apply_dot_float == nullptr))) return SOLVER_UNSUPPORTED_OPERATOR;
+    if(options.checkpoint_file != nullptr && (options.num_rhs > 1 || options.mixed_precision || options.pipelined)) return SOLVER_UNSUPPORTED_CHECKPOINT;
+
+    solver->A = &A;
+    solver->M = &M;
+    solver->options = options;
+    solver->size = A.num_rows;
+    solver->max_threads = 1;
+#ifdef _OPENMP
+    solver->max_threads = omp_get_max_threads();
+#endif
+
+    free_float_copies(solver);
+    if(options.mixed_precision)
+    {
+        solver->A_float = convert_to_float(A);
+        solver->M_float = convert_preconditioner_to_float(M);
+    }
+
+    stop_checkpoint_writer(solver->checkpoint);
+    solver->checkpoint = nullptr;
+    if(options.checkpoint_file != nullptr)
+    {
+        solver->checkpoint = start_checkpoint_writer(options.checkpoint_file, options.checkpoint_interval, options.checkpoint_seconds, solver->size, M.type);
+    }
+
+    size_t workspace_size = layout_workspace(solver, nullptr);
+    if(workspace_size > solver->workspace_size)
+    {
+        free(solver->workspace);
+        solver->workspace = nullptr;
+        solver->workspace_size = 0;
+        void * workspace;
+        if(posix_memalign(&workspace, WORKSPACE_ALIGNMENT, workspace_size) != 0) return SOLVER_OUT_OF_MEMORY;
+        solver->workspace = workspace;
+        solver->workspace_size = workspace_size;
+    }
+    layout_workspace(solver, static_cast<char *>(solver->workspace));
+
+    return SOLVER_SUCCESS;
+}
+
+
+
+solver_result cg_solve(cg_solver * solver, const double * b, const double * x0, double * x, const cg_checkpoint * restart)
+{
+    // the workspace of the packed format holds one vector per thread of the setup, more threads are not used
+
+    const solver_options & options = solver->options;
+    solver_result result;
+#ifdef _OPENMP
+    int num_threads = omp_get_max_threads();
+    if(num_threads > solver->max_threads) omp_set_num_threads(solver->max_threads);
+#endif
+
+    auto start = std::chrono::steady_clock::now();
+    if(options.num_rhs > 1)
+    {
+        block_conjugate_gradients(*solver->A, b, x0, x, solver->size, options.num_rhs, options.max_iters, options.rel_error, solver->block, &result);
+    }
+    else if(options.mixed_precision)
+    {
+        mixed_precision_conjugate_gradients(*solver, b, x0, x, &result);
+    }
+    else
+    {
+        if(options.pipelined)
+        {
+            result.num_iters = pipelined_conjugate_gradients_iterations(*solver->A, *solver->M, b, x0, x, solver->size, options.max_iters, options.rel_error, options.replacement_interval, solver->vectors, &result.rel_residual, &result.status);
+        }
+        else
+        {
+            result.num_iters = conjugate_gradients_iterations(*solver->A, *solver->M, b, x0, x, solver->size, options.max_iters, options.rel_error, solver->vectors, restart, solver->checkpoint, &result.rel_residual, &result.status);
+        }
+        result.converged = (result.status == SOLVER_SUCCESS && result.num_iters <= options.max_iters);
+        result.num_iters = std::min(result.num_iters, options.max_iters);
+    }
+    auto end = std::chrono::steady_clock::now();
+    result.solve_time = std::chrono::duration<double>(end - start).count();
+    if(solver->checkpoint != nullptr) result.checkpoints_failed = checkpoint_failures(solver->checkpoint);
+
+#ifdef _OPENMP
+    omp_set_num_threads(num_threads);
+#endif
+    return result;
+}
+
+
+
+double true_relative_residual(cg_solver * solver, const double * b, const double * x)
+{
+    // the columns of several right-hand sides are copied to the block workspace one at a time
+
+    const matrix_storage & A = *solver->A;
+    size_t size = solver->size;
+    size_t k = solver->options.num_rhs;
+    double * r = solver->vectors.r;
+    double * buffer = solver->vectors.buffer;
+    if(k == 1)
+    {
+        double rr = compute_residual(A, b, x, r, buffer, size);
+        return std::sqrt(rr / dot(b, b, size));
+    }
+
+    double * b_column = solver->block.R;
+    double * x_column = solver->block.P;
+    double result = 0.0;
+    for(size_t j = 0; j < k; j++)
+    {
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size; i++)
+        {
+            b_column[i] = b[i * k + j];
+            x_column[i] = x[i * k + j];
+        }
+        double rr = compute_residual(A, b_column, x_column, r, buffer, size);
+        result = std::fmax(result, std::sqrt(rr / dot(b_column, b_column, size)));
+    }
+    return result;
+}
+
+
+
+bool check_restart(cg_solver * solver, const double * b, const cg_checkpoint & checkpoint)
+{
+    return checkpoint_matches(checkpoint, solver->size, solver->M->type, dot(b, b, solver->size));
+}
+
+
+
+void free_cg_solver(cg_solver * solver)
+{
+    stop_checkpoint_writer(solver->checkpoint);
+    free_float_copies(solver);
+    free(solver->workspace);
+    *solver = cg_solver();
+}
+
+
+
+const char * solver_status_message(solver_status status)
+{
+    switch(status)
+    {
+        case SOLVER_SUCCESS: return "Success";
+        case SOLVER_NOT_SQUARE: return "Matrix has to be square";
+        case SOLVER_NO_RHS: return "Right hand side has to have at least one column";
+        case SOLVER_UNSUPPORTED_MULTIPLE_RHS: return "Several right hand sides can only be solved with unpreconditioned classic CG in double precision";
+        case SOLVER_UNSUPPORTED_OUT_OF_CORE: return "Out-of-core matrices are only supported in double precision";
+        case SOLVER_UNSUPPORTED_OPERATOR: return "The matrix-free operator has no product in the precision of the solver";
+        case SOLVER_UNSUPPORTED_CHECKPOINT: return "Checkpoints are only supported by classic CG with a single right hand side in double precision";
+        case SOLVER_OUT_OF_MEMORY: return "Cannot allocate the workspace of the solver";
+        case SOLVER_PRODUCT_FAILED: return "A product with the matrix failed, e.g. a tile of an out-of-core matrix could not be read";
+    }
+    return "Unknown error";
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstddef>
+
+#include "matrix_io.h"
+#include "preconditioner.h"
+#include "checkpoint.h"
+
+
+
+// Solver library
+//
+// A cg_solver owns everything a solve needs besides the operator and the right-hand side: one
+// aligned block of workspace for the vectors of the selected algorithm, and the single precision
+// copies of the matrix and the preconditioner for the mixed precision mode. setup_cg_solver binds
+// the matrix, the preconditioner and the options and allocates the workspace once; cg_solve can
+// then be called any number of times with different right-hand sides without allocating memory.
+// The values of the matrix may change between the solves, but not its size or format, and in the
+// mixed precision mode the single precision copy is only updated by another setup_cg_solver.
+// The solver does not print anything: setup_cg_solver and cg_solve report failures as a
+// solver_status, and solver_status_message turns it into a message for the caller to print.
+//
+// Built as a static library:
+//   icpx -O2 -qopenmp -c src/cg_solver.cpp -o cg_solver.o && ar rcs libcg_solver.a cg_solver.o
+
+struct solver_options
+{
+    int max_iters = 1000;
+    double rel_error = 1e-9;
+    bool mixed_precision = false;       // iterative refinement around single precision CG
+    bool pipelined = false;             // pipelined CG, not used for the mixed precision inner solves
+    int replacement_interval = 100;     // pipelined CG recomputes the residual every N iterations, 0 disables it
+    size_t num_rhs = 1;                 // columns of the row-major right-hand side and solution
+
+    // classic CG with a single right-hand side in double precision can checkpoint its state to
+    // checkpoint_file every checkpoint_interval iterations or checkpoint_seconds seconds (0 disables either)
+    const char * checkpoint_file = nullptr;
+    int checkpoint_interval = 0;
+    double checkpoint_seconds = 0.0;
+};
+
+enum solver_status
+{
+    SOLVER_SUCCESS,
+    SOLVER_NOT_SQUARE,
+    SOLVER_NO_RHS,
+    SOLVER_UNSUPPORTED_MULTIPLE_RHS,
+    SOLVER_UNSUPPORTED_OUT_OF_CORE,
+    SOLVER_UNSUPPORTED_OPERATOR,
+    SOLVER_UNSUPPORTED_CHECKPOINT,
+    SOLVER_OUT_OF_MEMORY,
+    SOLVER_PRODUCT_FAILED,              // a product with the matrix returned NaN, e.g. a tile of an out-of-core matrix could not be read
+};
+
+struct solver_result
+{
+    solver_status status = SOLVER_SUCCESS;  // the solve stops at the first failed product, converged is false then
+    bool converged = false;
+    int num_iters = 0;                  // CG iterations; inner iterations with mixed precision, the most of any column for several right-hand sides
+    int num_outer_iters = 0;            // refinement steps of the mixed precision mode
+    bool stagnated = false;             // the refinement stopped because the residual grew
+    double rel_residual = 0.0;          // recurrence residual of CG, true residual of the refinement, largest over the columns
+    double solve_time = 0.0;            // seconds
+    long checkpoints_failed = 0;        // checkpoints that could not be written since the setup of the solver
+
+    // several right-hand sides: iterations and relative residual of every column, owned by the
+    // solver and valid until its next solve; a column that did not converge has max_iters + 1 iterations
+    const int * column_num_iters = nullptr;
+    const double * column_rel_residual = nullptr;
+};
+
+template<typename real>
+struct cg_vectors
+{
+    // vectors of one CG solve of a single right-hand side; without a preconditioner z, u, m and q
+    // are the same vectors as r, r, w and s
+    real * r = nullptr;
+    real * p = nullptr;
+    real * Ap = nullptr;
+    real * z = nullptr;
+
+    // pipelined CG only
+    real * w = nullptr;
+    real * n = nullptr;
+    real * s = nullptr;
+    real * q = nullptr;
+    real * u = nullptr;
+    real * m = nullptr;
+
+    // scratch space of matvec_dot
+    real * buffer = nullptr;
+};
+
+struct block_vectors
+{
+    // row-major size x num_rhs blocks of the solver for several right-hand sides
+    double * X = nullptr;
+    double * R = nullptr;
+    double * P = nullptr;
+    double * AP = nullptr;
+    double * buffer = nullptr;          // 2 * size entries for a column and its product, then the buffer of matvec_dot
+
+    // one entry per column
+    double * bb = nullptr;
+    double * rr = nullptr;
+    double * rr_new = nullptr;
+    double * alpha = nullptr;
+    double * beta = nullptr;
+    double * rel_residual = nullptr;
+    size_t * column = nullptr;
+    int * num_iters = nullptr;
+};
+
+struct cg_solver
+{
+    const matrix_storage * A = nullptr;
+    const preconditioner<double> * M = nullptr;
+    solver_options options;
+    size_t size = 0;
+    int max_threads = 1;                // the workspace of the packed format holds one vector per thread
+
+    basic_matrix_storage<float> A_float;
+    preconditioner<float> M_float;
+
+    void * workspace = nullptr;
+    size_t workspace_size = 0;
+    cg_vectors<double> vectors;
+    cg_vectors<float> vectors_float;    // inner solves of the mixed precision mode
+    float * r_float = nullptr;
+    float * d_float = nullptr;
+    block_vectors block;
+
+    checkpoint_writer * checkpoint = nullptr;
+};
+
+
+
+// binds A, M and the options to the solver and allocates its workspace; A and M have to outlive the solver
+solver_status setup_cg_solver(cg_solver * solver, const matrix_storage & A, const preconditioner<double> & M, const solver_options & options);
+
+// solves A * x = b starting from x0, or from zero if x0 is nullptr; b, x0 and x are size x num_rhs
+// classic CG continues from a restart checkpoint instead, if one is given
+solver_result cg_solve(cg_solver * solver, const double * b, const double * x0, double * x, const cg_checkpoint * restart = nullptr);
+
+// whether a checkpoint was written for the system of the solver and the right-hand side b
+bool check_restart(cg_solver * solver, const double * b, const cg_checkpoint & checkpoint);
+
+// |b - A * x| / |b| computed from scratch, the largest over the columns for several right-hand sides
+double true_relative_residual(cg_solver * solver, const double * b, const double * x);
+
+void free_cg_solver(cg_solver * solver);
+
+const char * solver_status_message(solver_status status);
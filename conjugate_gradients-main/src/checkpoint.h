@@ -0,0 +1,293 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+
+// Checkpoints of classic CG
+//
+// file: size_t tag, size_t size, int64_t num_iters, int64_t preconditioner, double rr, double rz,
+//       double bb, double x[size], double r[size], double p[size]
+//
+// The state after an iteration is everything the next one needs: the solution x, the residual r,
+// the search direction p, rr = (r, r) and rz = (r, M^-1 * r). A solve that is resumed from it
+// performs exactly the same operations as the one that wrote it (with the same number of threads).
+// bb = (b, b) identifies the right-hand side the checkpoint belongs to, and a restart has to use the
+// same preconditioner (its preconditioner_type), which rz depends on.
+//
+// The file is written by a background thread. The solve loop only copies the three vectors into
+// a snapshot buffer, and skips a checkpoint if the previous one is still being written. Every
+// checkpoint is written to FILE.tmp first and then renamed to FILE, so a job that is killed while
+// writing still leaves the previous checkpoint intact.
+
+const size_t CHECKPOINT_TAG = 0x3154504B48434743; // "CGCHKPT1"
+
+struct cg_checkpoint
+{
+    size_t size = 0;
+    int num_iters = 0;
+    int preconditioner = 0;
+    double rr = 0.0;
+    double rz = 0.0;
+    double bb = 0.0;
+    double * x = nullptr;
+    double * r = nullptr;
+    double * p = nullptr;
+};
+
+struct checkpoint_writer
+{
+    const char * filename = nullptr;
+    int interval = 0;                   // iterations between checkpoints, 0 disables
+    double seconds = 0.0;               // seconds between checkpoints, 0 disables
+
+    int last_iter = 0;
+    std::chrono::steady_clock::time_point last_time;
+    cg_checkpoint snapshot;
+    long num_written = 0;
+    long num_failed = 0;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool pending = false;               // the snapshot holds a checkpoint that is not written yet
+    bool stop = false;
+};
+
+
+
+inline void allocate_checkpoint(cg_checkpoint * checkpoint, size_t size)
+{
+    checkpoint->size = size;
+    checkpoint->x = new double[size];
+    checkpoint->r = new double[size];
+    checkpoint->p = new double[size];
+}
+
+
+
+inline void free_checkpoint(cg_checkpoint * checkpoint)
+{
+    delete[] checkpoint->x;
+    delete[] checkpoint->r;
+    delete[] checkpoint->p;
+    *checkpoint = cg_checkpoint();
+}
+
+
+
+inline bool write_checkpoint_to_file(const char * filename, const cg_checkpoint & checkpoint)
+{
+    // writes FILE.tmp and renames it to FILE, which replaces the previous checkpoint atomically
+
+    char temp_filename[4096];
+    snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+    FILE * file = fopen(temp_filename, "wb");
+    if(file == nullptr) return false;
+
+    int64_t num_iters = checkpoint.num_iters;
+    int64_t preconditioner = checkpoint.preconditioner;
+    fwrite(&CHECKPOINT_TAG, sizeof(size_t), 1, file);
+    fwrite(&checkpoint.size, sizeof(size_t), 1, file);
+    fwrite(&num_iters, sizeof(int64_t), 1, file);
+    fwrite(&preconditioner, sizeof(int64_t), 1, file);
+    fwrite(&checkpoint.rr, sizeof(double), 1, file);
+    fwrite(&checkpoint.rz, sizeof(double), 1, file);
+    fwrite(&checkpoint.bb, sizeof(double), 1, file);
+    fwrite(checkpoint.x, sizeof(double), checkpoint.size, file);
+    fwrite(checkpoint.r, sizeof(double), checkpoint.size, file);
+    fwrite(checkpoint.p, sizeof(double), checkpoint.size, file);
+
+    bool success = (ferror(file) == 0);
+    success = (fflush(file) == 0) && success;
+    success = (fsync(fileno(file)) == 0) && success;
+    fclose(file);
+    if(success) success = (rename(temp_filename, filename) == 0);
+
+    return success;
+}
+
+
+
+inline bool checkpoint_file_exists(const char * filename)
+{
+    struct stat file_stat;
+    return stat(filename, &file_stat) == 0;
+}
+
+
+
+inline bool read_checkpoint_from_file(const char * filename, cg_checkpoint * checkpoint_out)
+{
+    FILE * file = fopen(filename, "rb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open checkpoint file\n");
+        return false;
+    }
+
+    size_t tag;
+    size_t size;
+    int64_t num_iters;
+    int64_t preconditioner;
+    cg_checkpoint checkpoint;
+    bool success = (fread(&tag, sizeof(size_t), 1, file) == 1) && (tag == CHECKPOINT_TAG);
+    success = success && (fread(&size, sizeof(size_t), 1, file) == 1);
+    success = success && (fread(&num_iters, sizeof(int64_t), 1, file) == 1);
+    success = success && (fread(&preconditioner, sizeof(int64_t), 1, file) == 1);
+    success = success && (fread(&checkpoint.rr, sizeof(double), 1, file) == 1);
+    success = success && (fread(&checkpoint.rz, sizeof(double), 1, file) == 1);
+    success = success && (fread(&checkpoint.bb, sizeof(double), 1, file) == 1);
+    struct stat file_stat;
+    success = success && (fstat(fileno(file), &file_stat) == 0);
+    success = success && (static_cast<size_t>(file_stat.st_size) == 2 * sizeof(size_t) + 2 * sizeof(int64_t) + 3 * sizeof(double) + 3 * size * sizeof(double));
+    if(!success)
+    {
+        fprintf(stderr, "%s is not a valid checkpoint\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    allocate_checkpoint(&checkpoint, size);
+    checkpoint.num_iters = static_cast<int>(num_iters);
+    checkpoint.preconditioner = static_cast<int>(preconditioner);
+    success = (fread(checkpoint.x, sizeof(double), size, file) == size);
+    success = success && (fread(checkpoint.r, sizeof(double), size, file) == size);
+    success = success && (fread(checkpoint.p, sizeof(double), size, file) == size);
+    fclose(file);
+    if(!success)
+    {
+        fprintf(stderr, "Cannot read checkpoint data\n");
+        free_checkpoint(&checkpoint);
+        return false;
+    }
+
+    *checkpoint_out = checkpoint;
+
+    return true;
+}
+
+
+
+inline bool checkpoint_matches(const cg_checkpoint & checkpoint, size_t size, int preconditioner, double bb)
+{
+    // (b, b) is recomputed on a restart, possibly with a different number of threads, so it only has to agree up to rounding
+    return checkpoint.size == size && checkpoint.preconditioner == preconditioner && std::fabs(checkpoint.bb - bb) <= 1e-12 * bb;
+}
+
+
+
+inline void checkpoint_writer_loop(checkpoint_writer * writer)
+{
+    std::unique_lock<std::mutex> lock(writer->mutex);
+    while(true)
+    {
+        writer->ready.wait(lock, [writer]() { return writer->pending || writer->stop; });
+        if(!writer->pending) return;
+
+        // the solve loop does not touch the snapshot while it is pending
+        lock.unlock();
+        bool success = write_checkpoint_to_file(writer->filename, writer->snapshot);
+        lock.lock();
+        if(success) writer->num_written++;
+        else writer->num_failed++;
+        writer->pending = false;
+    }
+}
+
+
+
+inline checkpoint_writer * start_checkpoint_writer(const char * filename, int interval, double seconds, size_t size, int preconditioner)
+{
+    checkpoint_writer * writer = new checkpoint_writer;
+    writer->filename = filename;
+    writer->interval = interval;
+    writer->seconds = seconds;
+    writer->last_time = std::chrono::steady_clock::now();
+    allocate_checkpoint(&writer->snapshot, size);
+    writer->snapshot.preconditioner = preconditioner;
+    writer->thread = std::thread(checkpoint_writer_loop, writer);
+    return writer;
+}
+
+
+
+inline void stop_checkpoint_writer(checkpoint_writer * writer)
+{
+    // waits for a pending checkpoint to be written
+
+    if(writer == nullptr) return;
+    {
+        std::lock_guard<std::mutex> lock(writer->mutex);
+        writer->stop = true;
+    }
+    writer->ready.notify_one();
+    writer->thread.join();
+    free_checkpoint(&writer->snapshot);
+    delete writer;
+}
+
+
+
+inline long checkpoint_failures(checkpoint_writer * writer)
+{
+    // the writer thread does not print, the solver reports its failures in the solver_result
+
+    std::lock_guard<std::mutex> lock(writer->mutex);
+    return writer->num_failed;
+}
+
+
+
+inline void reset_checkpoint_writer(checkpoint_writer * writer, int num_iters)
+{
+    // restarts the interval counting at the beginning of a solve
+
+    writer->last_iter = num_iters;
+    writer->last_time = std::chrono::steady_clock::now();
+}
+
+
+
+template<typename real>
+inline void checkpoint_iteration(checkpoint_writer * writer, int num_iters, const real * x, const real * r, const real * p, double rr, double rz, double bb)
+{
+    // hands the state after iteration num_iters to the writer thread if a checkpoint is due and the writer is idle
+
+    bool due = (writer->interval > 0 && num_iters - writer->last_iter >= writer->interval);
+    if(!due && writer->seconds > 0.0)
+    {
+        due = (std::chrono::duration<double>(std::chrono::steady_clock::now() - writer->last_time).count() >= writer->seconds);
+    }
+    if(!due) return;
+
+    std::unique_lock<std::mutex> lock(writer->mutex, std::try_to_lock);
+    if(!lock.owns_lock() || writer->pending) return;
+
+    cg_checkpoint & snapshot = writer->snapshot;
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < snapshot.size; i++)
+    {
+        snapshot.x[i] = x[i];
+        snapshot.r[i] = r[i];
+        snapshot.p[i] = p[i];
+    }
+    snapshot.num_iters = num_iters;
+    snapshot.rr = rr;
+    snapshot.rz = rz;
+    snapshot.bb = bb;
+    writer->pending = true;
+    writer->last_iter = num_iters;
+    writer->last_time = std::chrono::steady_clock::now();
+    lock.unlock();
+    writer->ready.notify_one();
+}
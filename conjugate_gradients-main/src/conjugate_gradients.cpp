@@ -1,55 +1,19 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-
-bool read_matrix_from_file(const char * filename, double ** matrix_out, size_t * num_rows_out, size_t * num_cols_out)
-{
-    double * matrix;
-    size_t num_rows;
-    size_t num_cols;
-
-    FILE * file = fopen(filename, "rb");
-    if(file == nullptr)
-    {
-        fprintf(stderr, "Cannot open output file\n");
-        return false;
-    }
-
-    fread(&num_rows, sizeof(size_t), 1, file);
-    fread(&num_cols, sizeof(size_t), 1, file);
-    matrix = new double[num_rows * num_cols];
-    fread(matrix, sizeof(double), num_rows * num_cols, file);
-
-    *matrix_out = matrix;
-    *num_rows_out = num_rows;
-    *num_cols_out = num_cols;
-
-    fclose(file);
-
-    return true;
-}
-
-
-
-bool write_matrix_to_file(const char * filename, const double * matrix, size_t num_rows, size_t num_cols)
-{
-    FILE * file = fopen(filename, "wb");
-    if(file == nullptr)
-    {
-        fprintf(stderr, "Cannot open output file\n");
-        return false;
-    }
-
-    fwrite(&num_rows, sizeof(size_t), 1, file);
-    fwrite(&num_cols, sizeof(size_t), 1, file);
-    fwrite(matrix, sizeof(double), num_rows * num_cols, file);
-
-    fclose(file);
-
-    return true;
-}
+#include "cg_solver.h"
+#include "matrix_io.h"
+#include "preconditioner.h"
+#include "performance_report.h"
+#include "simd_kernels.h"
 
 
 
@@ -69,88 +33,89 @@ void print_matrix(const double * matrix, size_t num_rows, size_t num_cols, FILE
 
 
 
-double dot(const double * x, const double * y, size_t size)
+void print_solver_result(const solver_result & result, const solver_options & options)
 {
-    double result = 0.0;
-    for(size_t i = 0; i < size; i++)
+    if(options.num_rhs > 1)
     {
-        result += x[i] * y[i];
+        size_t num_converged = 0;
+        for(size_t j = 0; j < options.num_rhs; j++)
+        {
+            if(result.column_num_iters[j] <= options.max_iters)
+            {
+                printf("Column %zu converged in %d iterations, relative error is %e\n", j, result.column_num_iters[j], result.column_rel_residual[j]);
+                num_converged++;
+            }
+            else
+            {
+                printf("Column %zu did not converge in %d iterations, relative error is %e\n", j, options.max_iters, result.column_rel_residual[j]);
+            }
+        }
+        if(result.converged)
+        {
+            printf("Converged all %zu right hand sides in %d iterations\n", options.num_rhs, result.num_iters);
+        }
+        else
+        {
+            printf("Did not converge %zu of %zu right hand sides in %d iterations\n", options.num_rhs - num_converged, options.num_rhs, options.max_iters);
+        }
     }
-    return result;
-}
-
-
-
-void axpby(double alpha, const double * x, double beta, double * y, size_t size)
-{
-    // y = alpha * x + beta * y
-
-    for(size_t i = 0; i < size; i++)
+    else if(options.mixed_precision)
     {
-        y[i] = alpha * x[i] + beta * y[i];
+        if(result.converged)
+        {
+            printf("Converged in %d outer and %d inner iterations, true relative residual is %e\n", result.num_outer_iters, result.num_iters, result.rel_residual);
+        }
+        else
+        {
+            printf("Did not converge in %d outer and %d inner iterations%s, true relative residual is %e\n", result.num_outer_iters, result.num_iters, result.stagnated ? " (refinement stagnated)" : "", result.rel_residual);
+        }
     }
-}
-
-
-
-void gemv(double alpha, const double * A, const double * x, double beta, double * y, size_t num_rows, size_t num_cols)
-{
-    // y = alpha * A * x + beta * y;
-
-    for(size_t r = 0; r < num_rows; r++)
+    else
     {
-        double y_val = 0.0;
-        for(size_t c = 0; c < num_cols; c++)
+        if(result.converged)
+        {
+            printf("Converged in %d iterations, relative error is %e\n", result.num_iters, result.rel_residual);
+        }
+        else
         {
-            y_val += alpha * A[r * num_cols + c] * x[c];
+            printf("Did not converge in %d iterations, relative error is %e\n", options.max_iters, result.rel_residual);
         }
-        y[r] = beta * y[r] + y_val;
     }
 }
 
 
 
-void conjugate_gradients(const double * A, const double * b, double * x, size_t size, int max_iters, double rel_error)
+void measure_thread_scaling(cg_solver * solver, const double * b, const double * x0, double * x, int max_threads)
 {
-    double alpha, beta, bb, rr, rr_new;
-    double * r = new double[size];
-    double * p = new double[size];
-    double * Ap = new double[size];
-    int num_iters;
-
-    for(size_t i = 0; i < size; i++)
-    {
-        x[i] = 0.0;
-        r[i] = b[i];
-        p[i] = b[i];
-    }
+    // solves the system repeatedly with 1, 2, 4, ... threads up to max_threads and reports the speedup against the single-threaded run
 
-    bb = dot(b, b, size);
-    rr = bb;
-    for(num_iters = 1; num_iters <= max_iters; num_iters++)
+    double times[64];
+    int threads[64];
+    int num_runs = 0;
+    for(int t = 1; num_runs < 64; t *= 2)
     {
-        gemv(1.0, A, p, 0.0, Ap, size, size);
-        alpha = rr / dot(p, Ap, size);
-        axpby(alpha, p, 1.0, x, size);
-        axpby(-alpha, Ap, 1.0, r, size);
-        rr_new = dot(r, r, size);
-        beta = rr_new / rr;
-        rr = rr_new;
-        if(std::sqrt(rr / bb) < rel_error) { break; }
-        axpby(1.0, r, beta, p, size);
+        if(t > max_threads) t = max_threads;
+        threads[num_runs] = t;
+#ifdef _OPENMP
+        omp_set_num_threads(t);
+#endif
+        printf("Solving with %d threads ...\n", t);
+        solver_result result = cg_solve(solver, b, x0, x);
+        print_solver_result(result, solver->options);
+        times[num_runs] = result.solve_time;
+        num_runs++;
+        if(t == max_threads) break;
     }
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
 
-    delete[] r;
-    delete[] p;
-    delete[] Ap;
-
-    if(num_iters <= max_iters)
-    {
-        printf("Converged in %d iterations, relative error is %e\n", num_iters, std::sqrt(rr / bb));
-    }
-    else
+    printf("\n");
+    printf("  threads    time [s]   speedup  efficiency\n");
+    for(int i = 0; i < num_runs; i++)
     {
-        printf("Did not converge in %d iterations, relative error is %e\n", max_iters, std::sqrt(rr / bb));
+        double speedup = times[0] / times[i];
+        printf("  %7d  %10.4f  %8.2f  %9.1f%%\n", threads[i], times[i], speedup, 100.0 * speedup / threads[i]);
     }
 }
 
@@ -160,8 +125,43 @@ void conjugate_gradients(const double * A, const double * b, double * x, size_t
 
 int main(int argc, char ** argv)
 {
-    printf("Usage: ./random_matrix input_file_matrix.bin input_file_rhs.bin output_file_sol.bin max_iters rel_error\n");
+    printf("Usage: ./conjugate_gradients input_file_matrix.bin input_file_rhs.bin output_file_sol.bin max_iters rel_error [options]\n");
     printf("All parameters are optional and have default values\n");
+    printf("input_file_matrix can also be laplacian:NXxNY for the matrix-free 5-point Laplacian of an NX x NY grid\n");
+    printf("Options:\n");
+    printf("  --threads N   number of OpenMP threads (default: OMP_NUM_THREADS or all cores)\n");
+    printf("  --scaling     also solve with 1, 2, 4, ... threads and report the speedup against the serial run\n");
+    printf("  --mixed-precision\n");
+    printf("                solve with a single precision copy of the matrix and refine the solution in double precision\n");
+    printf("  --sell        convert a CSR matrix to the SELL-C-sigma layout before solving\n");
+    printf("  --sell-sigma N\n");
+    printf("                sorting window of the SELL-C-sigma layout in rows (default: 256)\n");
+    printf("  --mmap        map the matrix file into memory and use it in place instead of reading it\n");
+    printf("  --huge-pages  back the matrix with transparent huge pages\n");
+    printf("  --out-of-core stream a dense matrix from its file in every iteration instead of reading it into memory\n");
+    printf("  --tile-size MB\n");
+    printf("                size of the two row tiles of --out-of-core in MB (default: 256)\n");
+    printf("  --preconditioner none|jacobi|block-jacobi|ict\n");
+    printf("                preconditioner of the CG iterations (default: none), ict needs a CSR matrix\n");
+    printf("  --block-size N\n");
+    printf("                size of the diagonal blocks of the block-jacobi preconditioner (default: 64)\n");
+    printf("  --ict-threshold T\n");
+    printf("                relative drop tolerance of the incomplete Cholesky factorization (default: 1e-3)\n");
+    printf("  --pipelined   use pipelined CG with a single reduction per iteration\n");
+    printf("  --report FILE time every kernel and write their GB/s and GFLOP/s and the residual history to a JSON file\n");
+    printf("  --initial-guess FILE\n");
+    printf("                start from the solution in FILE (e.g. a previous sol.bin) instead of zero\n");
+    printf("  --replacement-interval N\n");
+    printf("                recompute the residual of pipelined CG every N iterations, 0 disables it (default: 100)\n");
+    printf("  --checkpoint FILE\n");
+    printf("                periodically save the state of classic CG to FILE in the background\n");
+    printf("  --checkpoint-interval N\n");
+    printf("                save a checkpoint every N iterations\n");
+    printf("  --checkpoint-seconds T\n");
+    printf("                save a checkpoint every T seconds (default: 300 unless --checkpoint-interval is given)\n");
+    printf("  --restart     resume from the checkpoint FILE if it exists\n");
+    printf("  --reduction plain|pairwise|compensated\n");
+    printf("                summation of the dot products, pairwise and compensated give the same result for any number of threads (default: plain)\n");
     printf("\n");
 
     const char * input_file_matrix = "io/matrix.bin";
@@ -169,40 +169,248 @@ int main(int argc, char ** argv)
     const char * output_file_sol = "io/sol.bin";
     int max_iters = 1000;
     double rel_error = 1e-9;
+    int num_threads = 1;
+    bool scaling = false;
+    bool mixed_precision = false;
+    bool sell = false;
+    size_t sell_sigma = 256;
+    bool use_mmap = false;
+    bool huge_pages = false;
+    bool out_of_core = false;
+    double tile_size = 256.0;
+    preconditioner_type preconditioner_kind = PRECONDITIONER_NONE;
+    size_t block_size = 64;
+    double ict_threshold = 1e-3;
+    bool pipelined = false;
+    int replacement_interval = 100;
+    const char * input_file_guess = nullptr;
+    const char * output_file_report = nullptr;
+    const char * checkpoint_file = nullptr;
+    int checkpoint_interval = 0;
+    double checkpoint_seconds = 0.0;
+    bool restart = false;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+
+    int num_positional = 0;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) { num_threads = atoi(argv[++i]); continue; }
+        if(strcmp(argv[i], "--scaling") == 0) { scaling = true; continue; }
+        if(strcmp(argv[i], "--mixed-precision") == 0) { mixed_precision = true; continue; }
+        if(strcmp(argv[i], "--sell") == 0) { sell = true; continue; }
+        if(strcmp(argv[i], "--mmap") == 0) { use_mmap = true; continue; }
+        if(strcmp(argv[i], "--block-size") == 0 && i + 1 < argc) { block_size = static_cast<size_t>(atoll(argv[++i])); continue; }
+        if(strcmp(argv[i], "--ict-threshold") == 0 && i + 1 < argc) { ict_threshold = atof(argv[++i]); continue; }
+        if(strcmp(argv[i], "--preconditioner") == 0 && i + 1 < argc)
+        {
+            if(!parse_preconditioner(argv[++i], &preconditioner_kind))
+            {
+                fprintf(stderr, "Unknown preconditioner %s\n", argv[i]);
+                return 8;
+            }
+            continue;
+        }
+        if(strcmp(argv[i], "--huge-pages") == 0) { huge_pages = true; continue; }
+        if(strcmp(argv[i], "--out-of-core") == 0) { out_of_core = true; continue; }
+        if(strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) { tile_size = atof(argv[++i]); continue; }
+        if(strcmp(argv[i], "--pipelined") == 0) { pipelined = true; continue; }
+        if(strcmp(argv[i], "--initial-guess") == 0 && i + 1 < argc) { input_file_guess = argv[++i]; continue; }
+        if(strcmp(argv[i], "--report") == 0 && i + 1 < argc) { output_file_report = argv[++i]; continue; }
+        if(strcmp(argv[i], "--replacement-interval") == 0 && i + 1 < argc) { replacement_interval = atoi(argv[++i]); continue; }
+        if(strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) { checkpoint_file = argv[++i]; continue; }
+        if(strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) { checkpoint_interval = atoi(argv[++i]); continue; }
+        if(strcmp(argv[i], "--checkpoint-seconds") == 0 && i + 1 < argc) { checkpoint_seconds = atof(argv[++i]); continue; }
+        if(strcmp(argv[i], "--restart") == 0) { restart = true; continue; }
+        if(strcmp(argv[i], "--reduction") == 0 && i + 1 < argc)
+        {
+            if(!parse_reduction_mode(argv[++i], &active_reduction_mode()))
+            {
+                fprintf(stderr, "Unknown reduction mode %s\n", argv[i]);
+                return 13;
+            }
+            continue;
+        }
+        if(strcmp(argv[i], "--sell-sigma") == 0 && i + 1 < argc) { sell_sigma = static_cast<size_t>(atoll(argv[++i])); continue; }
+        if(strncmp(argv[i], "--", 2) == 0)
+        {
+            // an unknown option, or the last option without its value
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 15;
+        }
+
+        num_positional++;
+        if(num_positional == 1) input_file_matrix = argv[i];
+        if(num_positional == 2) input_file_rhs = argv[i];
+        if(num_positional == 3) output_file_sol = argv[i];
+        if(num_positional == 4) max_iters = atoi(argv[i]);
+        if(num_positional == 5) rel_error = atof(argv[i]);
+    }
 
-    if(argc > 1) input_file_matrix = argv[1];
-    if(argc > 2) input_file_rhs = argv[2];
-    if(argc > 3) output_file_sol = argv[3];
-    if(argc > 4) max_iters = atoi(argv[4]);
-    if(argc > 5) rel_error = atof(argv[5]);
+    if(num_threads < 1)
+    {
+        fprintf(stderr, "Wrong number of threads\n");
+        return 7;
+    }
+    if(restart && checkpoint_file == nullptr)
+    {
+        fprintf(stderr, "--restart needs a checkpoint file\n");
+        return 12;
+    }
+    if(scaling && checkpoint_file != nullptr)
+    {
+        fprintf(stderr, "--scaling repeats the solve and cannot be combined with --checkpoint\n");
+        return 12;
+    }
+    if(checkpoint_file != nullptr && checkpoint_interval <= 0 && checkpoint_seconds <= 0.0)
+    {
+        checkpoint_seconds = 300.0;
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(num_threads);
+#else
+    if(num_threads > 1)
+    {
+        fprintf(stderr, "Compiled without OpenMP, running on a single thread\n");
+        num_threads = 1;
+    }
+#endif
 
     printf("Command line arguments:\n");
     printf("  input_file_matrix: %s\n", input_file_matrix);
     printf("  input_file_rhs:    %s\n", input_file_rhs);
     printf("  output_file_sol:   %s\n", output_file_sol);
+    printf("  initial_guess:     %s\n", (input_file_guess != nullptr) ? input_file_guess : "zero");
+    printf("  report:            %s\n", (output_file_report != nullptr) ? output_file_report : "none");
+    printf("  checkpoint:        %s\n", (checkpoint_file != nullptr) ? checkpoint_file : "none");
     printf("  max_iters:         %d\n", max_iters);
     printf("  rel_error:         %e\n", rel_error);
+    printf("  num_threads:       %d\n", num_threads);
+    printf("  simd:              %s\n", simd_isa_name(active_simd_isa()));
+    printf("  reduction:         %s\n", reduction_mode_name(active_reduction_mode()));
+    printf("  precision:         %s\n", mixed_precision ? "mixed" : "double");
+    printf("  preconditioner:    %s\n", preconditioner_name(preconditioner_kind));
+    printf("  algorithm:         %s\n", pipelined ? "pipelined" : "classic");
     printf("\n");
 
+    if(pipelined && mixed_precision)
+    {
+        // the rounding errors of the pipelined recurrences limit the attainable accuracy in single
+        // precision to well above the tolerance of the inner solves
+        printf("Pipelined CG is not accurate enough in single precision, the inner solves of the mixed precision mode use classic CG\n");
+        printf("\n");
+        pipelined = false;
+    }
+
 
 
-    double * matrix;
+    matrix_storage matrix;
+    preconditioner<double> M;
     double * rhs;
+    double * guess = nullptr;
     size_t size;
+    size_t num_rhs;
+    double load_time;
+    double setup_time = 0.0;
+    global_report().enabled = (output_file_report != nullptr);
 
     {
         printf("Reading matrix from file ...\n");
-        size_t matrix_rows;
-        size_t matrix_cols;
-        bool success_read_matrix = read_matrix_from_file(input_file_matrix, &matrix, &matrix_rows, &matrix_cols);
+        auto load_start = std::chrono::steady_clock::now();
+        double start = kernel_timer_start();
+        bool success_read_matrix = false;
+        size_t grid_nx;
+        size_t grid_ny;
+        if(parse_laplacian_5point(input_file_matrix, &grid_nx, &grid_ny))
+        {
+            if(out_of_core || use_mmap)
+            {
+                fprintf(stderr, "--out-of-core and --mmap need a matrix file, not a matrix-free operator\n");
+                return 1;
+            }
+            matrix = make_laplacian_5point(grid_nx, grid_ny);
+            success_read_matrix = true;
+            printf("Matrix-free 5-point Laplacian of a %zu x %zu grid\n", grid_nx, grid_ny);
+        }
+        if(out_of_core && !success_read_matrix)
+        {
+            if(!open_out_of_core_matrix(input_file_matrix, static_cast<size_t>(tile_size * 1024 * 1024), &matrix))
+            {
+                fprintf(stderr, "Failed to open matrix\n");
+                return 1;
+            }
+            success_read_matrix = true;
+            printf("Matrix is streamed from the file in tiles of %zu rows\n", matrix.out_of_core->tile_rows);
+        }
+        if(use_mmap && !success_read_matrix)
+        {
+            success_read_matrix = map_matrix_from_file(input_file_matrix, &matrix, huge_pages);
+            if(success_read_matrix) printf("Matrix file is mapped into memory\n");
+            else printf("Mapping the matrix file failed, reading it instead\n");
+        }
+        if(!success_read_matrix)
+        {
+            success_read_matrix = read_matrix_from_file(input_file_matrix, &matrix, huge_pages);
+        }
         if(!success_read_matrix)
         {
             fprintf(stderr, "Failed to read matrix\n");
             return 1;
         }
+        double bytes_read = (matrix.format == MATRIX_FORMAT_OUT_OF_CORE) ? 0.0 : static_cast<double>(matrix_file_size(matrix));
+        kernel_timer_stop(KERNEL_READ_MATRIX, start, bytes_read, 0.0);
+        auto load_end = std::chrono::steady_clock::now();
+        load_time = std::chrono::duration<double>(load_end - load_start).count();
+        printf("Load time: %.4f s\n", load_time);
+        size_t matrix_rows = matrix.num_rows;
+        size_t matrix_cols = matrix.num_cols;
+        printf("Matrix format: %s\n", matrix_format_name(matrix.format));
+        if(matrix.format == MATRIX_FORMAT_CSR)
+        {
+            printf("Number of nonzeros: %zu (%.2f per row)\n", matrix.num_nonzeros, static_cast<double>(matrix.num_nonzeros) / matrix.num_rows);
+        }
         printf("Done\n");
         printf("\n");
 
+        if(preconditioner_kind != PRECONDITIONER_NONE)
+        {
+            printf("Setting up the %s preconditioner ...\n", preconditioner_name(preconditioner_kind));
+            auto setup_start = std::chrono::steady_clock::now();
+            bool success_setup = setup_preconditioner(matrix, preconditioner_kind, block_size, ict_threshold, &M);
+            if(!success_setup)
+            {
+                fprintf(stderr, "Failed to set up the preconditioner\n");
+                return 8;
+            }
+            auto setup_end = std::chrono::steady_clock::now();
+            setup_time = std::chrono::duration<double>(setup_end - setup_start).count();
+            if(M.type == PRECONDITIONER_ICT)
+            {
+                if(M.num_replaced_pivots > 0) printf("Incomplete Cholesky: replaced %zu non-positive pivots\n", M.num_replaced_pivots);
+                printf("Incomplete Cholesky: %zu nonzeros in L (%.2f per row)\n", M.L_row_ptr[M.size], static_cast<double>(M.L_row_ptr[M.size]) / M.size);
+            }
+            printf("Preconditioner setup time: %.4f s\n", setup_time);
+            printf("Done\n");
+            printf("\n");
+        }
+
+        if(sell && matrix.format == MATRIX_FORMAT_CSR)
+        {
+            printf("Converting matrix to SELL-%zu-%zu ...\n", SELL_CHUNK_SIZE, sell_sigma);
+            matrix_storage matrix_sell = convert_csr_to_sell(matrix, sell_sigma);
+            printf("Fill efficiency: %.1f%%\n", 100.0 * matrix.num_nonzeros / std::max<size_t>(matrix_sell.num_nonzeros, 1));
+            free_matrix_storage(&matrix);
+            matrix = matrix_sell;
+            printf("Done\n");
+            printf("\n");
+        }
+        else if(sell)
+        {
+            printf("The SELL-C-sigma layout needs a CSR input matrix, ignoring --sell\n");
+            printf("\n");
+        }
+
         printf("Reading right hand side from file ...\n");
         size_t rhs_rows;
         size_t rhs_cols;
@@ -225,23 +433,135 @@ int main(int argc, char ** argv)
             fprintf(stderr, "Size of right hand side does not match the matrix\n");
             return 4;
         }
-        if(rhs_cols != 1)
+        if(rhs_cols == 0)
+        {
+            fprintf(stderr, "Right hand side has to have at least one column\n");
+            return 5;
+        }
+        if(rhs_cols > 1 && (mixed_precision || pipelined || preconditioner_kind != PRECONDITIONER_NONE))
         {
-            fprintf(stderr, "Right hand side has to have just a single column\n");
+            fprintf(stderr, "Several right hand sides can only be solved with unpreconditioned classic CG in double precision\n");
             return 5;
         }
+        if(rhs_cols > 1)
+        {
+            printf("Solving for %zu right hand sides at once\n", rhs_cols);
+            printf("\n");
+        }
 
         size = matrix_rows;
+        num_rhs = rhs_cols;
+
+        if(input_file_guess != nullptr)
+        {
+            printf("Reading initial guess from file ...\n");
+            size_t guess_rows;
+            size_t guess_cols;
+            bool success_read_guess = read_matrix_from_file(input_file_guess, &guess, &guess_rows, &guess_cols);
+            if(!success_read_guess)
+            {
+                fprintf(stderr, "Failed to read initial guess\n");
+                return 9;
+            }
+            if(guess_rows != size || guess_cols != num_rhs)
+            {
+                fprintf(stderr, "Size of initial guess does not match the right hand side\n");
+                return 9;
+            }
+            printf("Done\n");
+            printf("\n");
+        }
+    }
+
+    solver_options options;
+    options.max_iters = max_iters;
+    options.rel_error = rel_error;
+    options.mixed_precision = mixed_precision;
+    options.pipelined = pipelined;
+    options.replacement_interval = replacement_interval;
+    options.num_rhs = num_rhs;
+    options.checkpoint_file = checkpoint_file;
+    options.checkpoint_interval = checkpoint_interval;
+    options.checkpoint_seconds = checkpoint_seconds;
+
+    printf("Setting up the solver ...\n");
+    if(mixed_precision) printf("Converting matrix to single precision\n");
+    cg_solver solver;
+    solver_status setup_status = setup_cg_solver(&solver, matrix, M, options);
+    if(setup_status != SOLVER_SUCCESS)
+    {
+        fprintf(stderr, "%s\n", solver_status_message(setup_status));
+        fprintf(stderr, "Failed to set up the solver\n");
+        return 11;
+    }
+    printf("Done\n");
+    printf("\n");
+
+    cg_checkpoint checkpoint;
+    bool restarting = false;
+    if(restart && !checkpoint_file_exists(checkpoint_file))
+    {
+        printf("No checkpoint found, starting from the beginning\n");
+        printf("\n");
+    }
+    else if(restart)
+    {
+        printf("Reading checkpoint from file ...\n");
+        bool success_read_checkpoint = read_checkpoint_from_file(checkpoint_file, &checkpoint);
+        if(success_read_checkpoint && !check_restart(&solver, rhs, checkpoint))
+        {
+            fprintf(stderr, "Checkpoint does not belong to this system\n");
+            success_read_checkpoint = false;
+        }
+        if(!success_read_checkpoint)
+        {
+            fprintf(stderr, "Failed to restart from checkpoint\n");
+            return 12;
+        }
+        printf("Resuming after iteration %d\n", checkpoint.num_iters);
+        printf("Done\n");
+        printf("\n");
+        restarting = true;
     }
 
     printf("Solving the system ...\n");
-    double * sol = new double[size];
-    conjugate_gradients(matrix, rhs, sol, size, max_iters, rel_error);
+    double * sol = new double[size * num_rhs];
+    solver_result result = cg_solve(&solver, rhs, guess, sol, restarting ? &checkpoint : nullptr);
+    if(result.status != SOLVER_SUCCESS)
+    {
+        fprintf(stderr, "%s\n", solver_status_message(result.status));
+        fprintf(stderr, "Failed to solve the system\n");
+        return 14;
+    }
+    print_solver_result(result, options);
+    if(result.checkpoints_failed > 0) fprintf(stderr, "%ld checkpoints could not be written to %s\n", result.checkpoints_failed, checkpoint_file);
+    double solve_time = result.solve_time;
+    printf("Solve time: %.4f s\n", solve_time);
+    if(matrix.format == MATRIX_FORMAT_OUT_OF_CORE)
+    {
+        print_out_of_core_statistics(matrix.out_of_core->statistics);
+    }
+    double true_rel_residual = true_relative_residual(&solver, rhs, sol);
+    printf("%s: %e\n", (num_rhs == 1) ? "True relative residual" : "Largest true relative residual", true_rel_residual);
     printf("Done\n");
     printf("\n");
 
+    if(scaling)
+    {
+        // the repeated solves are not part of the report
+        bool report_enabled = global_report().enabled;
+        global_report().enabled = false;
+        printf("Measuring thread scaling ...\n");
+        measure_thread_scaling(&solver, rhs, guess, sol, num_threads);
+        printf("Done\n");
+        printf("\n");
+        global_report().enabled = report_enabled;
+    }
+
     printf("Writing solution to file ...\n");
-    bool success_write_sol = write_matrix_to_file(output_file_sol, sol, size, 1);
+    double start = kernel_timer_start();
+    bool success_write_sol = write_matrix_to_file(output_file_sol, sol, size, num_rhs);
+    kernel_timer_stop(KERNEL_WRITE_SOLUTION, start, 2.0 * sizeof(size_t) + static_cast<double>(size) * num_rhs * sizeof(double), 0.0);
     if(!success_write_sol)
     {
         fprintf(stderr, "Failed to save solution\n");
@@ -250,8 +570,42 @@ int main(int argc, char ** argv)
     printf("Done\n");
     printf("\n");
 
-    delete[] matrix;
+    if(output_file_report != nullptr)
+    {
+        printf("Writing performance report to file ...\n");
+        print_performance_report(global_report());
+        run_summary run;
+        run.matrix_file = input_file_matrix;
+        run.matrix_format = matrix_format_name(matrix.format);
+        run.size = size;
+        run.num_nonzeros = matrix_storage_size(matrix);
+        run.num_rhs = num_rhs;
+        run.num_threads = num_threads;
+        run.precision = mixed_precision ? "mixed" : "double";
+        run.preconditioner = preconditioner_name(preconditioner_kind);
+        run.algorithm = pipelined ? "pipelined" : "classic";
+        run.rel_error = rel_error;
+        run.load_time = load_time;
+        run.setup_time = setup_time;
+        run.solve_time = solve_time;
+        run.converged = result.converged;
+        run.true_rel_residual = true_rel_residual;
+        bool success_write_report = write_performance_report(output_file_report, global_report(), run);
+        if(!success_write_report)
+        {
+            fprintf(stderr, "Failed to save performance report\n");
+            return 10;
+        }
+        printf("Done\n");
+        printf("\n");
+    }
+
+    free_cg_solver(&solver);
+    free_checkpoint(&checkpoint);
+    free_matrix_storage(&matrix);
+    free_preconditioner(&M);
     delete[] rhs;
+    delete[] guess;
     delete[] sol;
 
     printf("Finished successfully\n");
@@ -0,0 +1,536 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include <mpi.h>
+
+#include "cg_kernels.h"
+#include "matrix_io.h"
+
+
+
+// Distributed-memory version of conjugate_gradients. The rows of the matrix are split into
+// contiguous blocks, one per rank. Each rank reads only its own block of the matrix and the
+// right-hand side, keeps its part of x, r and Ap, and the full vector p, which is allgathered
+// before every matrix-vector product.
+
+
+
+struct row_distribution
+{
+    size_t size;
+    size_t row_begin;
+    size_t num_rows;
+    int * counts;
+    int * displs;
+};
+
+
+
+row_distribution distribute_rows(size_t size, int rank, int num_ranks)
+{
+    row_distribution dist;
+    dist.size = size;
+    dist.counts = new int[num_ranks];
+    dist.displs = new int[num_ranks];
+
+    size_t rows_per_rank = size / num_ranks;
+    size_t remainder = size % num_ranks;
+    size_t begin = 0;
+    for(int i = 0; i < num_ranks; i++)
+    {
+        size_t count = rows_per_rank + (static_cast<size_t>(i) < remainder ? 1 : 0);
+        dist.counts[i] = static_cast<int>(count);
+        dist.displs[i] = static_cast<int>(begin);
+        begin += count;
+    }
+
+    dist.row_begin = dist.displs[rank];
+    dist.num_rows = dist.counts[rank];
+
+    return dist;
+}
+
+
+
+bool broadcast_matrix_header(const char * filename, size_t * num_rows_out, size_t * num_cols_out)
+{
+    // rank 0 reads the 16-byte header of a dense matrix file and broadcasts it
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    size_t header[2] = {0, 0};
+    int success = 1;
+    if(rank == 0)
+    {
+        FILE * file = fopen(filename, "rb");
+        matrix_format format;
+        if(file == nullptr || !read_matrix_header(file, &format, &header[0], &header[1]))
+        {
+            fprintf(stderr, "Cannot open input file %s\n", filename);
+            success = 0;
+        }
+        else if(format != MATRIX_FORMAT_DENSE)
+        {
+            fprintf(stderr, "Only the dense matrix format is supported by the distributed solver\n");
+            success = 0;
+        }
+        if(file != nullptr) fclose(file);
+    }
+    MPI_Bcast(&success, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(header, 2 * sizeof(size_t), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    *num_rows_out = header[0];
+    *num_cols_out = header[1];
+
+    return success != 0;
+}
+
+
+
+bool read_row_block_from_file(const char * filename, double * block, size_t total_rows, size_t num_cols, size_t row_begin, size_t num_rows)
+{
+    // reads rows [row_begin, row_begin + num_rows) from a total_rows x num_cols matrix file, skipping the 16-byte header
+    // the read is split into chunks to stay within the int count of MPI-IO
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    MPI_File file;
+    if(MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+    {
+        fprintf(stderr, "Cannot open input file %s\n", filename);
+        return false;
+    }
+
+    // all ranks see the same size, so they all skip the collective reads of a file that is too short or too long
+    MPI_Offset file_size = 0;
+    size_t expected_size = 2 * sizeof(size_t) + total_rows * num_cols * sizeof(double);
+    if(MPI_File_get_size(file, &file_size) != MPI_SUCCESS || static_cast<size_t>(file_size) != expected_size)
+    {
+        if(rank == 0) fprintf(stderr, "Input file %s has %lld bytes instead of %zu\n", filename, static_cast<long long>(file_size), expected_size);
+        MPI_File_close(&file);
+        return false;
+    }
+
+    const size_t max_chunk = size_t(1) << 27;
+    size_t total = num_rows * num_cols;
+    MPI_Offset offset = 2 * sizeof(size_t) + row_begin * num_cols * sizeof(double);
+    bool success = true;
+
+    // every rank has to take part in the same number of collective reads
+    unsigned long long my_chunks = (total + max_chunk - 1) / max_chunk;
+    unsigned long long num_chunks;
+    MPI_Allreduce(&my_chunks, &num_chunks, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+
+    for(size_t done = 0; done < num_chunks * max_chunk; done += max_chunk)
+    {
+        size_t count = (done < total) ? std::min(max_chunk, total - done) : 0;
+        MPI_Status status;
+        int num_read = 0;
+        if(MPI_File_read_at_all(file, offset + done * sizeof(double), block + done, static_cast<int>(count), MPI_DOUBLE, &status) != MPI_SUCCESS || MPI_Get_count(&status, MPI_DOUBLE, &num_read) != MPI_SUCCESS || static_cast<size_t>(num_read) != count)
+        {
+            success = false;
+        }
+    }
+
+    MPI_File_close(&file);
+
+    return success;
+}
+
+
+
+bool write_vector_to_file(const char * filename, const double * block, const row_distribution & dist)
+{
+    // rank 0 writes the header, then every rank writes its own block of rows
+    // returns false on all ranks if any of them failed
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    MPI_File file;
+    if(MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+    {
+        fprintf(stderr, "Cannot open output file\n");
+        return false;
+    }
+    bool success = (MPI_File_set_size(file, 0) == MPI_SUCCESS);
+
+    MPI_Status status;
+    int num_written = 0;
+    if(rank == 0)
+    {
+        size_t header[2] = {dist.size, 1};
+        if(MPI_File_write_at(file, 0, header, 2 * sizeof(size_t), MPI_BYTE, &status) != MPI_SUCCESS || MPI_Get_count(&status, MPI_BYTE, &num_written) != MPI_SUCCESS || static_cast<size_t>(num_written) != 2 * sizeof(size_t))
+        {
+            success = false;
+        }
+    }
+    MPI_Offset offset = 2 * sizeof(size_t) + dist.row_begin * sizeof(double);
+    if(MPI_File_write_at_all(file, offset, block, static_cast<int>(dist.num_rows), MPI_DOUBLE, &status) != MPI_SUCCESS || MPI_Get_count(&status, MPI_DOUBLE, &num_written) != MPI_SUCCESS || static_cast<size_t>(num_written) != dist.num_rows)
+    {
+        success = false;
+    }
+
+    if(MPI_File_close(&file) != MPI_SUCCESS) success = false;
+
+    int local_success = success ? 1 : 0;
+    int all_success;
+    MPI_Allreduce(&local_success, &all_success, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+
+    return all_success != 0;
+}
+
+
+
+double allreduce_sum(double local)
+{
+    double global;
+    MPI_Allreduce(&local, &global, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    return global;
+}
+
+
+
+void conjugate_gradients(const double * A_block, const double * b_block, double * x_block, const row_distribution & dist, int max_iters, double rel_error)
+{
+    // A_block holds the local rows of A, b_block and x_block the local parts of b and x
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    size_t size = dist.size;
+    size_t num_rows = dist.num_rows;
+    double alpha, beta, bb, rr, rr_new;
+    double * r = new double[num_rows];
+    double * p = new double[size];
+    double * Ap = new double[num_rows];
+    double * p_block = p + dist.row_begin;
+    int num_iters;
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < num_rows; i++)
+    {
+        x_block[i] = 0.0;
+        r[i] = b_block[i];
+        p_block[i] = b_block[i];
+    }
+
+    bb = allreduce_sum(dot(b_block, b_block, num_rows));
+    rr = bb;
+    for(num_iters = 1; num_iters <= max_iters; num_iters++)
+    {
+        MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, p, dist.counts, dist.displs, MPI_DOUBLE, MPI_COMM_WORLD);
+        alpha = rr / allreduce_sum(gemv_dot(A_block, p, Ap, num_rows, size, dist.row_begin));
+        rr_new = allreduce_sum(update_solution_residual(alpha, p_block, Ap, x_block, r, num_rows));
+        beta = rr_new / rr;
+        rr = rr_new;
+        if(std::sqrt(rr / bb) < rel_error) { break; }
+        axpby(1.0, r, beta, p_block, num_rows);
+    }
+
+    delete[] r;
+    delete[] p;
+    delete[] Ap;
+
+    if(rank == 0)
+    {
+        if(num_iters <= max_iters)
+        {
+            printf("Converged in %d iterations, relative error is %e\n", num_iters, std::sqrt(rr / bb));
+        }
+        else
+        {
+            printf("Did not converge in %d iterations, relative error is %e\n", max_iters, std::sqrt(rr / bb));
+        }
+    }
+}
+
+
+
+void distributed_gemv(const double * A_block, const double * x_block, double * x, double * y_block, const row_distribution & dist)
+{
+    // y_block = A_block * x, where the full vector x is first allgathered from the blocks x_block of all ranks
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < dist.num_rows; i++)
+    {
+        x[dist.row_begin + i] = x_block[i];
+    }
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, x, dist.counts, dist.displs, MPI_DOUBLE, MPI_COMM_WORLD);
+    gemv_dot(A_block, x, y_block, dist.num_rows, dist.size, dist.row_begin);
+}
+
+
+
+void pipelined_conjugate_gradients(const double * A_block, const double * b_block, double * x_block, const row_distribution & dist, int max_iters, double rel_error, int replacement_interval)
+{
+    // pipelined (Ghysels-Vanroose) CG: the dot products of an iteration are computed together with the
+    // vector updates and summed over the ranks by a single non-blocking allreduce, which completes while
+    // the next matrix-vector product n = A * w, including the allgather of w, is computed
+    // this costs one extra matrix-vector product at the end, since convergence is only known after it
+    // every replacement_interval iterations (0 disables it) the residual and the recurrences for
+    // w = A * r, s = A * p and z = A * s are recomputed to stop them from drifting away
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    size_t num_rows = dist.num_rows;
+    double alpha, beta, bb, rr, gamma, gamma_old, alpha_old;
+    double local_dots[3];
+    double dots[3];
+    double * r = new double[num_rows];
+    double * w = new double[num_rows];
+    double * n = new double[num_rows];
+    double * p = new double[num_rows];
+    double * s = new double[num_rows];
+    double * z = new double[num_rows];
+    double * gathered = new double[dist.size];
+    int num_iters;
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < num_rows; i++)
+    {
+        x_block[i] = 0.0;
+        r[i] = b_block[i];
+        p[i] = 0.0;
+        s[i] = 0.0;
+        z[i] = 0.0;
+    }
+
+    bb = allreduce_sum(dot(b_block, b_block, num_rows));
+    distributed_gemv(A_block, r, gathered, w, dist);
+    local_dots[0] = dot(r, r, num_rows);
+    local_dots[1] = dot(w, r, num_rows);
+    local_dots[2] = local_dots[0];
+    gamma_old = 1.0;
+    alpha_old = 1.0;
+    for(num_iters = 0; ; num_iters++)
+    {
+        MPI_Request request;
+        MPI_Iallreduce(local_dots, dots, 3, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD, &request);
+        distributed_gemv(A_block, w, gathered, n, dist);
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+
+        rr = dots[2];
+        if(std::sqrt(rr / bb) < rel_error || num_iters == max_iters) { break; }
+
+        gamma = dots[0];
+        beta = (num_iters == 0) ? 0.0 : gamma / gamma_old;
+        alpha = gamma / (dots[1] - beta * gamma / alpha_old);
+        gamma_old = gamma;
+        alpha_old = alpha;
+        pipelined_update(alpha, beta, w, n, x_block, r, r, w, p, s, s, z, num_rows, local_dots);
+
+        if(replacement_interval > 0 && (num_iters + 1) % replacement_interval == 0)
+        {
+            distributed_gemv(A_block, x_block, gathered, n, dist);
+            #pragma omp parallel for schedule(static)
+            for(size_t i = 0; i < num_rows; i++)
+            {
+                r[i] = b_block[i] - n[i];
+            }
+            distributed_gemv(A_block, r, gathered, w, dist);
+            distributed_gemv(A_block, p, gathered, s, dist);
+            distributed_gemv(A_block, s, gathered, z, dist);
+            local_dots[0] = dot(r, r, num_rows);
+            local_dots[1] = dot(w, r, num_rows);
+            local_dots[2] = local_dots[0];
+        }
+    }
+
+    delete[] r;
+    delete[] w;
+    delete[] n;
+    delete[] p;
+    delete[] s;
+    delete[] z;
+    delete[] gathered;
+
+    if(rank == 0)
+    {
+        if(std::sqrt(rr / bb) < rel_error)
+        {
+            printf("Converged in %d iterations, relative error is %e\n", num_iters, std::sqrt(rr / bb));
+        }
+        else
+        {
+            printf("Did not converge in %d iterations, relative error is %e\n", max_iters, std::sqrt(rr / bb));
+        }
+    }
+}
+
+
+
+
+
+int main(int argc, char ** argv)
+{
+    MPI_Init(&argc, &argv);
+
+    int rank, num_ranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+
+    const char * input_file_matrix = "io/matrix.bin";
+    const char * input_file_rhs = "io/rhs.bin";
+    const char * output_file_sol = "io/sol.bin";
+    int max_iters = 1000;
+    double rel_error = 1e-9;
+    bool pipelined = false;
+    int replacement_interval = 100;
+
+    if(rank == 0)
+    {
+        printf("Usage: mpirun -np N ./conjugate_gradients_mpi input_file_matrix.bin input_file_rhs.bin output_file_sol.bin max_iters rel_error [options]\n");
+        printf("All parameters are optional and have default values\n");
+        printf("Options:\n");
+        printf("  --pipelined   use pipelined CG with a single non-blocking reduction per iteration\n");
+        printf("  --replacement-interval N\n");
+        printf("                recompute the residual of pipelined CG every N iterations, 0 disables it (default: 100)\n");
+        printf("\n");
+    }
+
+    // every rank parses the same arguments, so all of them stop on a wrong one
+    int num_positional = 0;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--pipelined") == 0) { pipelined = true; continue; }
+        if(strcmp(argv[i], "--replacement-interval") == 0 && i + 1 < argc) { replacement_interval = atoi(argv[++i]); continue; }
+        if(strncmp(argv[i], "--", 2) == 0)
+        {
+            if(rank == 0) fprintf(stderr, "Unknown option %s, the distributed solver only supports --pipelined and --replacement-interval\n", argv[i]);
+            MPI_Finalize();
+            return 7;
+        }
+        if(num_positional == 5)
+        {
+            if(rank == 0) fprintf(stderr, "Unexpected argument %s\n", argv[i]);
+            MPI_Finalize();
+            return 7;
+        }
+
+        num_positional++;
+        if(num_positional == 1) input_file_matrix = argv[i];
+        if(num_positional == 2) input_file_rhs = argv[i];
+        if(num_positional == 3) output_file_sol = argv[i];
+        if(num_positional == 4) max_iters = atoi(argv[i]);
+        if(num_positional == 5) rel_error = atof(argv[i]);
+    }
+
+    if(rank == 0)
+    {
+        printf("Command line arguments:\n");
+        printf("  input_file_matrix: %s\n", input_file_matrix);
+        printf("  input_file_rhs:    %s\n", input_file_rhs);
+        printf("  output_file_sol:   %s\n", output_file_sol);
+        printf("  max_iters:         %d\n", max_iters);
+        printf("  rel_error:         %e\n", rel_error);
+        printf("  num_ranks:         %d\n", num_ranks);
+        printf("  algorithm:         %s\n", pipelined ? "pipelined" : "classic");
+        printf("\n");
+    }
+
+
+
+    size_t matrix_rows, matrix_cols, rhs_rows, rhs_cols;
+    if(!broadcast_matrix_header(input_file_matrix, &matrix_rows, &matrix_cols))
+    {
+        if(rank == 0) fprintf(stderr, "Failed to read matrix\n");
+        MPI_Finalize();
+        return 1;
+    }
+    if(!broadcast_matrix_header(input_file_rhs, &rhs_rows, &rhs_cols))
+    {
+        if(rank == 0) fprintf(stderr, "Failed to read right hand side\n");
+        MPI_Finalize();
+        return 2;
+    }
+    if(matrix_rows != matrix_cols)
+    {
+        if(rank == 0) fprintf(stderr, "Matrix has to be square\n");
+        MPI_Finalize();
+        return 3;
+    }
+    if(rhs_rows != matrix_rows)
+    {
+        if(rank == 0) fprintf(stderr, "Size of right hand side does not match the matrix\n");
+        MPI_Finalize();
+        return 4;
+    }
+    if(rhs_cols != 1)
+    {
+        if(rank == 0) fprintf(stderr, "Right hand side has to have just a single column\n");
+        MPI_Finalize();
+        return 5;
+    }
+
+    size_t size = matrix_rows;
+    row_distribution dist = distribute_rows(size, rank, num_ranks);
+
+    if(rank == 0) printf("Reading matrix and right hand side blocks from file ...\n");
+    double * matrix = new double[dist.num_rows * size];
+    double * rhs = new double[dist.num_rows];
+
+    // first touch the local rows in parallel with the same split as the kernels
+    #pragma omp parallel for schedule(static)
+    for(size_t r = 0; r < dist.num_rows; r++)
+    {
+        for(size_t c = 0; c < size; c++)
+        {
+            matrix[r * size + c] = 0.0;
+        }
+        rhs[r] = 0.0;
+    }
+
+    bool success_read = read_row_block_from_file(input_file_matrix, matrix, size, size, dist.row_begin, dist.num_rows);
+    success_read = read_row_block_from_file(input_file_rhs, rhs, size, 1, dist.row_begin, dist.num_rows) && success_read;
+    if(!success_read)
+    {
+        fprintf(stderr, "Rank %d failed to read its row block\n", rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if(rank == 0) { printf("Done\n"); printf("\n"); }
+
+    if(rank == 0) printf("Solving the system ...\n");
+    double * sol = new double[dist.num_rows];
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    if(pipelined)
+    {
+        pipelined_conjugate_gradients(matrix, rhs, sol, dist, max_iters, rel_error, replacement_interval);
+    }
+    else
+    {
+        conjugate_gradients(matrix, rhs, sol, dist, max_iters, rel_error);
+    }
+    double solve_time = MPI_Wtime() - start;
+    if(rank == 0) printf("Solve time: %.4f s\n", solve_time);
+    if(rank == 0) { printf("Done\n"); printf("\n"); }
+
+    if(rank == 0) printf("Writing solution to file ...\n");
+    bool success_write_sol = write_vector_to_file(output_file_sol, sol, dist);
+    if(!success_write_sol)
+    {
+        if(rank == 0) fprintf(stderr, "Failed to save solution\n");
+        MPI_Finalize();
+        return 6;
+    }
+    if(rank == 0) { printf("Done\n"); printf("\n"); }
+
+    delete[] matrix;
+    delete[] rhs;
+    delete[] sol;
+    delete[] dist.counts;
+    delete[] dist.displs;
+
+    if(rank == 0) printf("Finished successfully\n");
+
+    MPI_Finalize();
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#include "matrix_io.h"
+
+
+
+double * unpack_symmetric(const double * packed, size_t size)
+{
+    double * matrix = new double[size * size];
+    for(size_t r = 0; r < size; r++)
+    {
+        const double * packed_row = packed + packed_row_offset(r, size) - r;
+        for(size_t c = r; c < size; c++)
+        {
+            matrix[r * size + c] = packed_row[c];
+            matrix[c * size + r] = packed_row[c];
+        }
+    }
+    return matrix;
+}
+
+
+
+double * csr_to_dense(const matrix_storage & csr)
+{
+    double * matrix = new double[csr.num_rows * csr.num_cols];
+    for(size_t i = 0; i < csr.num_rows * csr.num_cols; i++)
+    {
+        matrix[i] = 0.0;
+    }
+    for(size_t r = 0; r < csr.num_rows; r++)
+    {
+        for(size_t k = csr.row_ptr[r]; k < csr.row_ptr[r + 1]; k++)
+        {
+            matrix[r * csr.num_cols + csr.col_idx[k]] += csr.data[k];
+        }
+    }
+    return matrix;
+}
+
+
+
+matrix_storage dense_to_csr(const double * matrix, size_t num_rows, size_t num_cols)
+{
+    // keeps all entries that are not exactly zero
+
+    matrix_storage csr;
+    csr.format = MATRIX_FORMAT_CSR;
+    csr.num_rows = num_rows;
+    csr.num_cols = num_cols;
+    csr.row_ptr = new size_t[num_rows + 1];
+    csr.row_ptr[0] = 0;
+    for(size_t r = 0; r < num_rows; r++)
+    {
+        size_t row_nonzeros = 0;
+        for(size_t c = 0; c < num_cols; c++)
+        {
+            if(matrix[r * num_cols + c] != 0.0) row_nonzeros++;
+        }
+        csr.row_ptr[r + 1] = csr.row_ptr[r] + row_nonzeros;
+    }
+    csr.num_nonzeros = csr.row_ptr[num_rows];
+    csr.data = new double[csr.num_nonzeros];
+    csr.col_idx = new uint32_t[csr.num_nonzeros];
+    for(size_t r = 0; r < num_rows; r++)
+    {
+        size_t k = csr.row_ptr[r];
+        for(size_t c = 0; c < num_cols; c++)
+        {
+            if(matrix[r * num_cols + c] != 0.0)
+            {
+                csr.data[k] = matrix[r * num_cols + c];
+                csr.col_idx[k] = static_cast<uint32_t>(c);
+                k++;
+            }
+        }
+    }
+    return csr;
+}
+
+
+
+double max_asymmetry(const double * matrix, size_t size)
+{
+    double result = 0.0;
+    for(size_t r = 0; r < size; r++)
+    {
+        for(size_t c = r + 1; c < size; c++)
+        {
+            result = std::fmax(result, std::fabs(matrix[r * size + c] - matrix[c * size + r]));
+        }
+    }
+    return result;
+}
+
+
+
+
+
+int main(int argc, char ** argv)
+{
+    printf("Usage: ./convert_matrix input_file_matrix.bin output_file_matrix.bin output_format\n");
+    printf("The input format is detected from the file, output_format is dense, packed or csr\n");
+    printf("\n");
+
+    if(argc < 4)
+    {
+        fprintf(stderr, "Wrong number of arguments\n");
+        return 1;
+    }
+
+    const char * input_file_matrix = argv[1];
+    const char * output_file_matrix = argv[2];
+    matrix_format output_format;
+    if(!parse_matrix_format(argv[3], &output_format))
+    {
+        fprintf(stderr, "Unknown matrix format %s\n", argv[3]);
+        return 1;
+    }
+
+    printf("Reading matrix from file ...\n");
+    matrix_storage matrix;
+    bool success_read_matrix = read_matrix_from_file(input_file_matrix, &matrix);
+    if(!success_read_matrix)
+    {
+        fprintf(stderr, "Failed to read matrix\n");
+        return 2;
+    }
+    printf("Converting %zu x %zu matrix from %s to %s\n", matrix.num_rows, matrix.num_cols, matrix_format_name(matrix.format), matrix_format_name(output_format));
+    printf("Done\n");
+    printf("\n");
+
+    if(matrix.format == output_format)
+    {
+        printf("Matrix is already in the requested format, copying ...\n");
+    }
+    else
+    {
+        printf("Writing matrix to file ...\n");
+    }
+
+    bool success_write_matrix;
+    if(matrix.format == output_format)
+    {
+        success_write_matrix = write_matrix_to_file(output_file_matrix, matrix);
+    }
+    else
+    {
+        double * dense = matrix.data;
+        if(matrix.format == MATRIX_FORMAT_PACKED_SYMMETRIC) dense = unpack_symmetric(matrix.data, matrix.num_rows);
+        if(matrix.format == MATRIX_FORMAT_CSR) dense = csr_to_dense(matrix);
+
+        if(output_format == MATRIX_FORMAT_PACKED_SYMMETRIC)
+        {
+            if(matrix.num_rows != matrix.num_cols)
+            {
+                fprintf(stderr, "Only a square matrix can be stored as packed symmetric\n");
+                return 3;
+            }
+            double asymmetry = max_asymmetry(dense, matrix.num_rows);
+            if(asymmetry != 0.0)
+            {
+                printf("Warning: matrix is not exactly symmetric (max |A[i][j] - A[j][i]| = %e), keeping the upper triangle\n", asymmetry);
+            }
+            success_write_matrix = write_packed_symmetric_to_file(output_file_matrix, dense, matrix.num_rows);
+        }
+        else if(output_format == MATRIX_FORMAT_CSR)
+        {
+            matrix_storage csr = dense_to_csr(dense, matrix.num_rows, matrix.num_cols);
+            printf("Number of nonzeros: %zu\n", csr.num_nonzeros);
+            success_write_matrix = write_matrix_to_file(output_file_matrix, csr);
+            free_matrix_storage(&csr);
+        }
+        else
+        {
+            success_write_matrix = write_matrix_to_file(output_file_matrix, dense, matrix.num_rows, matrix.num_cols);
+        }
+
+        if(dense != matrix.data) delete[] dense;
+    }
+    if(!success_write_matrix)
+    {
+        fprintf(stderr, "Failed to save matrix\n");
+        return 4;
+    }
+    printf("Done\n");
+    printf("\n");
+
+    free_matrix_storage(&matrix);
+
+    printf("Finished successfully\n");
+
+    return 0;
+}
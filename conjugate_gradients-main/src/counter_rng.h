@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+
+// Counter-based random numbers
+//
+// Every random value is a pure function of (seed, stream, row, col): the 128-bit counter
+// (row, col) is encrypted with the 64-bit key (seed, stream) by Philox4x32-10 (Salmon et al.,
+// "Parallel random numbers: as easy as 1, 2, 3", SC 2011). There is no generator state, so any
+// entry or block of a matrix can be generated on its own, in any order and on any thread, and a
+// seed always produces the same bits whatever the number of threads or the storage layout.
+// The streams separate the independent quantities generated from the same seed.
+
+enum random_stream
+{
+    RANDOM_STREAM_MATRIX,
+    RANDOM_STREAM_EIGENVALUES,
+    RANDOM_STREAM_RHS,
+    RANDOM_STREAM_DIAGONAL,
+    RANDOM_STREAM_GRAPH,
+};
+
+
+
+inline void philox4x32_10(uint32_t counter[4], uint32_t key0, uint32_t key1)
+{
+    const uint32_t M0 = 0xD2511F53;
+    const uint32_t M1 = 0xCD9E8D57;
+    const uint32_t W0 = 0x9E3779B9;
+    const uint32_t W1 = 0xBB67AE85;
+    for(int round = 0; round < 10; round++)
+    {
+        uint64_t product0 = static_cast<uint64_t>(M0) * counter[0];
+        uint64_t product1 = static_cast<uint64_t>(M1) * counter[2];
+        uint32_t c0 = static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key0;
+        uint32_t c2 = static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key1;
+        counter[0] = c0;
+        counter[1] = static_cast<uint32_t>(product1);
+        counter[2] = c2;
+        counter[3] = static_cast<uint32_t>(product0);
+        key0 += W0;
+        key1 += W1;
+    }
+}
+
+
+
+inline uint64_t counter_random_bits(uint32_t seed, uint32_t stream, uint64_t row, uint64_t col)
+{
+    // 64 random bits of the entry (row, col), the first half of the Philox output
+
+    uint32_t counter[4] = { static_cast<uint32_t>(col), static_cast<uint32_t>(col >> 32), static_cast<uint32_t>(row), static_cast<uint32_t>(row >> 32) };
+    philox4x32_10(counter, seed, stream);
+    return (static_cast<uint64_t>(counter[1]) << 32) | counter[0];
+}
+
+
+
+inline double counter_random_uniform(uint32_t seed, uint32_t stream, uint64_t row, uint64_t col)
+{
+    // uniform in [-1, 1) with 53 random bits
+
+    double u = static_cast<double>(counter_random_bits(seed, stream, row, col) >> 11) * (1.0 / 9007199254740992.0);
+    return 2.0 * u - 1.0;
+}
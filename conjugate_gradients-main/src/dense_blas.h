@@ -0,0 +1,352 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef USE_MKL
+#include <mkl.h>
+#endif
+
+#include "simd_kernels.h"
+
+
+
+// Dense BLAS routines of the generator
+//
+// Built with -DUSE_MKL, the routines forward to MKL. Otherwise a built-in backend is used, so the
+// generator also builds with a plain g++. Its DGEMM follows the blocking of Goto and van de Geijn
+// ("Anatomy of high-performance matrix multiplication", TOMS 2008): op(B) is packed in panels of
+// KC x NC and op(A) in blocks of MC x KC, both into micro-panels that a register-blocked micro
+// kernel of MR x NR reads contiguously. The B panel is packed by all threads together, then the
+// threads multiply different MC blocks of A with it. The micro kernel is instantiated for every
+// instruction set of simd_kernels.h and chosen at run time like the solver kernels.
+//
+// All matrices are column-major.
+
+const size_t DENSE_GEMM_KC = 256;
+const size_t DENSE_GEMM_MC = 128;
+const size_t DENSE_GEMM_NC = 2048;
+
+struct dense_gemm_block
+{
+    size_t kc = 0;
+    const double * A_packed = nullptr; // MR x kc micro-panels
+    const double * B_packed = nullptr; // kc x NR micro-panels
+    double alpha = 1.0;
+    double beta = 0.0;
+    double * C = nullptr;
+    size_t ldc = 0;
+    size_t m = 0;                      // rows of C in the MC block
+    size_t n = 0;                      // columns of C in the NC panel
+};
+
+typedef void (*dense_gemm_macro_kernel)(const dense_gemm_block & block);
+
+struct dense_gemm_kernel
+{
+    size_t mr;
+    size_t nr;
+    dense_gemm_macro_kernel macro_kernel;
+};
+
+
+
+template<size_t W, size_t NR>
+SIMD_INLINE void simd_dense_gemm_micro_kernel(size_t kc, const double * a, const double * b, double alpha, double beta, double * C, size_t ldc, size_t m, size_t n)
+{
+    // C[0:m, 0:n] = alpha * a * b + beta * C for a micro-panel a of 2W x kc and b of kc x NR
+    // the 2 x NR vector accumulators stay in registers over the whole kc loop
+
+    typedef typename simd_vector<double, W>::type vector;
+    const size_t MR = 2 * W;
+    vector c[2][NR] = {};
+    for(size_t p = 0; p < kc; p++)
+    {
+        vector a0, a1;
+        simd_load<W>(a0, a + p * MR);
+        simd_load<W>(a1, a + p * MR + W);
+        #pragma GCC unroll 16
+        for(size_t j = 0; j < NR; j++)
+        {
+            double b_pj = b[p * NR + j];
+            c[0][j] += a0 * b_pj;
+            c[1][j] += a1 * b_pj;
+        }
+    }
+
+    if(m == MR && n == NR)
+    {
+        for(size_t j = 0; j < NR; j++)
+        {
+            for(size_t h = 0; h < 2; h++)
+            {
+                vector result = alpha * c[h][j];
+                if(beta != 0.0)
+                {
+                    vector c_old;
+                    simd_load<W>(c_old, C + j * ldc + h * W);
+                    result += beta * c_old;
+                }
+                simd_store<W>(C + j * ldc + h * W, result);
+            }
+        }
+        return;
+    }
+
+    // edge of C: only the valid part is written, and C is not read where beta is 0 (like BLAS)
+    double tile[MR * NR];
+    for(size_t j = 0; j < NR; j++)
+    {
+        simd_store<W>(tile + j * MR, c[0][j]);
+        simd_store<W>(tile + j * MR + W, c[1][j]);
+    }
+    for(size_t j = 0; j < n; j++)
+    {
+        for(size_t i = 0; i < m; i++)
+        {
+            double result = alpha * tile[j * MR + i];
+            if(beta != 0.0) result += beta * C[j * ldc + i];
+            C[j * ldc + i] = result;
+        }
+    }
+}
+
+
+
+template<size_t W, size_t NR>
+SIMD_INLINE void simd_dense_gemm_macro_kernel(const dense_gemm_block & block)
+{
+    // multiplies a packed MC block of A with a packed NC panel of B, one MR x NR tile of C after another
+
+    const size_t MR = 2 * W;
+    for(size_t j = 0; j < block.n; j += NR)
+    {
+        const double * b = block.B_packed + j * block.kc;
+        for(size_t i = 0; i < block.m; i += MR)
+        {
+            const double * a = block.A_packed + i * block.kc;
+            double * C = block.C + j * block.ldc + i;
+            simd_dense_gemm_micro_kernel<W, NR>(block.kc, a, b, block.alpha, block.beta, C, block.ldc, std::min(MR, block.m - i), std::min(NR, block.n - j));
+        }
+    }
+}
+
+
+
+// instantiations of the macro kernel for every instruction set, as in simd_kernels.h
+// the tiles use 12 (SSE2, AVX2) and 24 (AVX-512) of the 16 and 32 vector registers for C
+
+inline void dense_gemm_macro_kernel_scalar(const dense_gemm_block & block)
+{
+    simd_dense_gemm_macro_kernel<2, 6>(block);
+}
+
+#ifdef SIMD_X86
+
+SIMD_TARGET_AVX2 inline void dense_gemm_macro_kernel_avx2(const dense_gemm_block & block)
+{
+    simd_dense_gemm_macro_kernel<4, 6>(block);
+}
+
+SIMD_TARGET_AVX512 inline void dense_gemm_macro_kernel_avx512(const dense_gemm_block & block)
+{
+    simd_dense_gemm_macro_kernel<8, 12>(block);
+}
+
+#endif
+
+
+
+inline dense_gemm_kernel dense_gemm_kernel_for(simd_isa isa)
+{
+#ifdef SIMD_X86
+    if(isa == SIMD_AVX2) return { 8, 6, &dense_gemm_macro_kernel_avx2 };
+    if(isa == SIMD_AVX512) return { 16, 12, &dense_gemm_macro_kernel_avx512 };
+#endif
+    (void)isa;
+    return { 4, 6, &dense_gemm_macro_kernel_scalar };
+}
+
+
+
+inline void dense_gemm_pack_A(bool trans_A, const double * A, size_t lda, size_t row_begin, size_t m, size_t col_begin, size_t kc, size_t mr, double * packed)
+{
+    // op(A)[row_begin : row_begin + m, col_begin : col_begin + kc] into micro-panels of mr rows, zero padded
+
+    for(size_t i = 0; i < m; i += mr)
+    {
+        size_t rows = std::min(mr, m - i);
+        double * panel = packed + i * kc;
+        for(size_t p = 0; p < kc; p++)
+        {
+            for(size_t h = 0; h < mr; h++)
+            {
+                size_t r = row_begin + i + h;
+                size_t c = col_begin + p;
+                panel[p * mr + h] = (h >= rows) ? 0.0 : (trans_A ? A[r * lda + c] : A[c * lda + r]);
+            }
+        }
+    }
+}
+
+
+
+inline void dense_gemm_pack_B_panel(bool trans_B, const double * B, size_t ldb, size_t row_begin, size_t kc, size_t col_begin, size_t nr, size_t n, double * panel)
+{
+    // op(B)[row_begin : row_begin + kc, col_begin : col_begin + nr] into one micro-panel, columns past n are zero
+
+    size_t cols = std::min(nr, n - col_begin);
+    for(size_t p = 0; p < kc; p++)
+    {
+        for(size_t h = 0; h < nr; h++)
+        {
+            size_t r = row_begin + p;
+            size_t c = col_begin + h;
+            panel[p * nr + h] = (h >= cols) ? 0.0 : (trans_B ? B[r * ldb + c] : B[c * ldb + r]);
+        }
+    }
+}
+
+
+
+inline void builtin_dgemm(bool trans_A, bool trans_B, size_t m, size_t n, size_t k, double alpha, const double * A, size_t lda, const double * B, size_t ldb, double beta, double * C, size_t ldc)
+{
+    // C = alpha * op(A) * op(B) + beta * C
+
+    if(m == 0 || n == 0) return;
+    if(k == 0 || alpha == 0.0)
+    {
+        #pragma omp parallel for schedule(static)
+        for(size_t j = 0; j < n; j++)
+        {
+            for(size_t i = 0; i < m; i++)
+            {
+                C[j * ldc + i] = (beta == 0.0) ? 0.0 : beta * C[j * ldc + i];
+            }
+        }
+        return;
+    }
+
+    dense_gemm_kernel kernel = dense_gemm_kernel_for(active_simd_isa());
+    size_t mr = kernel.mr;
+    size_t nr = kernel.nr;
+    int num_threads = 1;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+
+    // smaller A blocks when there would be fewer blocks than threads, but at least one micro-panel
+    size_t mc = std::min(DENSE_GEMM_MC, (m + num_threads - 1) / num_threads);
+    mc = std::max((mc + mr - 1) / mr * mr, mr);
+    size_t nc_max = std::min(DENSE_GEMM_NC / nr * nr, (n + nr - 1) / nr * nr);
+    size_t kc_max = std::min(DENSE_GEMM_KC, k);
+    double * B_packed = new double[kc_max * nc_max];
+
+    #pragma omp parallel
+    {
+        double * A_packed = new double[mc * kc_max];
+
+        for(size_t jc = 0; jc < n; jc += nc_max)
+        {
+            size_t nc = std::min(nc_max, n - jc);
+            for(size_t pc = 0; pc < k; pc += kc_max)
+            {
+                size_t kc = std::min(kc_max, k - pc);
+
+                #pragma omp for schedule(static)
+                for(size_t j = 0; j < nc; j += nr)
+                {
+                    dense_gemm_pack_B_panel(trans_B, B, ldb, pc, kc, jc + j, nr, jc + nc, B_packed + j * kc);
+                }
+
+                #pragma omp for schedule(dynamic)
+                for(size_t ic = 0; ic < m; ic += mc)
+                {
+                    dense_gemm_block block;
+                    block.kc = kc;
+                    block.m = std::min(mc, m - ic);
+                    block.n = nc;
+                    dense_gemm_pack_A(trans_A, A, lda, ic, block.m, pc, kc, mr, A_packed);
+                    block.A_packed = A_packed;
+                    block.B_packed = B_packed;
+                    block.alpha = alpha;
+                    block.beta = (pc == 0) ? beta : 1.0;
+                    block.C = C + jc * ldc + ic;
+                    block.ldc = ldc;
+                    kernel.macro_kernel(block);
+                }
+            }
+        }
+
+        delete[] A_packed;
+    }
+
+    delete[] B_packed;
+}
+
+
+
+inline void dense_dgemm(bool trans_A, bool trans_B, size_t m, size_t n, size_t k, double alpha, const double * A, size_t lda, const double * B, size_t ldb, double beta, double * C, size_t ldc)
+{
+    // C = alpha * op(A) * op(B) + beta * C, op(X) is X or X^T
+
+#ifdef USE_MKL
+    cblas_dgemm(CblasColMajor, trans_A ? CblasTrans : CblasNoTrans, trans_B ? CblasTrans : CblasNoTrans, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+#else
+    builtin_dgemm(trans_A, trans_B, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+#endif
+}
+
+
+
+inline double dense_dnrm2(size_t n, const double * x)
+{
+    // Euclidean norm, scaled by the largest magnitude so that the squares cannot overflow
+
+#ifdef USE_MKL
+    return cblas_dnrm2(n, x, 1);
+#else
+    double scale = 0.0;
+    for(size_t i = 0; i < n; i++)
+    {
+        scale = std::max(scale, std::fabs(x[i]));
+    }
+    if(scale == 0.0 || !std::isfinite(scale)) return scale;
+    double sum = 0.0;
+    for(size_t i = 0; i < n; i++)
+    {
+        double value = x[i] / scale;
+        sum += value * value;
+    }
+    return scale * std::sqrt(sum);
+#endif
+}
+
+
+
+inline void dense_dscal(size_t n, double alpha, double * x)
+{
+#ifdef USE_MKL
+    cblas_dscal(n, alpha, x, 1);
+#else
+    for(size_t i = 0; i < n; i++)
+    {
+        x[i] *= alpha;
+    }
+#endif
+}
+
+
+
+inline const char * dense_blas_backend_name()
+{
+#ifdef USE_MKL
+    return "mkl";
+#else
+    return "built-in";
+#endif
+}
@@ -0,0 +1,899 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "cg_kernels.h"
+#include "out_of_core.h"
+
+
+
+// Matrix file formats
+//
+// dense:             size_t num_rows, size_t num_cols, double data[num_rows * num_cols] (row-major)
+// packed symmetric:  size_t tag, size_t num_rows, size_t num_cols, double data[n * (n + 1) / 2]
+//                    (upper triangle, row-major, row i holds A[i][i] ... A[i][n-1])
+// CSR:               size_t tag, size_t num_rows, size_t num_cols, size_t num_nonzeros,
+//                    size_t row_ptr[num_rows + 1], uint32_t col_idx[num_nonzeros], double values[num_nonzeros]
+//
+// The first 8 bytes of the non-dense formats are a tag made of 8 ASCII characters. Read as
+// a row count it would be far larger than any dense matrix that fits on a disk, so dense files
+// without a tag are still recognised.
+//
+// A matrix-free operator stores no values, it is applied on the fly by a function of the
+// matrix_operator below, so it is never read from or written to a file.
+//
+// An out-of-core matrix is a dense matrix file that is not read into memory; its rows are
+// streamed from the file in every product, see out_of_core.h.
+
+const size_t MATRIX_TAG_PACKED_SYMMETRIC = 0x314b504d59534743; // "CGSYMPK1"
+const size_t MATRIX_TAG_CSR = 0x3152534353524743; // "CGRSCSR1"
+
+enum matrix_format
+{
+    MATRIX_FORMAT_DENSE,
+    MATRIX_FORMAT_PACKED_SYMMETRIC,
+    MATRIX_FORMAT_CSR,
+    MATRIX_FORMAT_SELL,
+    MATRIX_FORMAT_OPERATOR,
+    MATRIX_FORMAT_OUT_OF_CORE,
+};
+
+// Matrix-free operators, e.g. stencils: apply_dot computes y = A * x and returns dot(x, y), the
+// fused dot product of the CG iterations, and is called from outside of parallel regions, so it
+// can distribute the rows over the threads itself (see laplacian_5point_dot). The other functions
+// are optional: apply_dot_float enables the mixed precision mode, and entry, which returns
+// A[row][col], lets the jacobi and block-jacobi preconditioners extract the diagonal (blocks).
+// Every function gets context; free_matrix_storage calls release on it, if set.
+struct matrix_operator
+{
+    void * context = nullptr;
+    double (*apply_dot)(void * context, const double * x, double * y) = nullptr;
+    double (*apply_dot_float)(void * context, const float * x, float * y) = nullptr;
+    double (*entry)(void * context, size_t row, size_t col) = nullptr;
+    void (*release)(void * context) = nullptr;
+
+    // cost of a product for the performance report, besides streaming x and y and the dot product
+    double bytes = 0.0;
+    double flops = 0.0;
+};
+
+// SELL-C-sigma: rows are sorted by their length within windows of sigma rows, and groups of
+// SELL_CHUNK_SIZE consecutive sorted rows form a chunk. A chunk is padded to the length of its
+// longest row and stored column by column, so that one SIMD vector processes one entry of each
+// of the rows of the chunk.
+const size_t SELL_CHUNK_SIZE = 8;
+
+template<typename real>
+struct basic_matrix_storage
+{
+    matrix_format format = MATRIX_FORMAT_DENSE;
+    size_t num_rows = 0;
+    size_t num_cols = 0;
+    real * data = nullptr;          // all values, the packed upper triangle, or the stored entries of a sparse matrix
+
+    // sparse formats only
+    size_t num_nonzeros = 0;        // number of stored entries, including the padding of SELL
+    size_t * row_ptr = nullptr;     // CSR: start of each row in data, SELL: start of each chunk
+    uint32_t * col_idx = nullptr;
+    uint32_t * row_perm = nullptr;  // SELL: original row of each sorted row, num_rows for padding rows
+
+    // matrix-free operators only
+    matrix_operator op;
+
+    // out-of-core only: the open matrix file and its tile buffers, data stays empty
+    out_of_core_matrix * out_of_core = nullptr;
+
+    // set when the arrays live in a memory mapping (of the matrix file, or anonymous with huge pages)
+    // instead of being allocated with new[]
+    void * mapping = nullptr;
+    size_t mapping_size = 0;
+};
+
+typedef basic_matrix_storage<double> matrix_storage;
+
+
+
+inline const char * matrix_format_name(matrix_format format)
+{
+    switch(format)
+    {
+        case MATRIX_FORMAT_DENSE: return "dense";
+        case MATRIX_FORMAT_PACKED_SYMMETRIC: return "packed";
+        case MATRIX_FORMAT_CSR: return "csr";
+        case MATRIX_FORMAT_SELL: return "sell";
+        case MATRIX_FORMAT_OPERATOR: return "operator";
+        case MATRIX_FORMAT_OUT_OF_CORE: return "out-of-core";
+    }
+    return "unknown";
+}
+
+
+
+inline bool parse_matrix_format(const char * name, matrix_format * format_out)
+{
+    if(strcmp(name, "dense") == 0) { *format_out = MATRIX_FORMAT_DENSE; return true; }
+    if(strcmp(name, "packed") == 0) { *format_out = MATRIX_FORMAT_PACKED_SYMMETRIC; return true; }
+    if(strcmp(name, "csr") == 0) { *format_out = MATRIX_FORMAT_CSR; return true; }
+    return false;
+}
+
+
+
+template<typename real>
+inline size_t matrix_storage_size(const basic_matrix_storage<real> & matrix)
+{
+    // number of stored values
+    if(matrix.format == MATRIX_FORMAT_PACKED_SYMMETRIC) return packed_row_offset(matrix.num_rows, matrix.num_rows);
+    if(matrix.format == MATRIX_FORMAT_CSR || matrix.format == MATRIX_FORMAT_SELL) return matrix.num_nonzeros;
+    if(matrix.format == MATRIX_FORMAT_OPERATOR) return 0;
+    return matrix.num_rows * matrix.num_cols;
+}
+
+
+
+template<typename real>
+inline bool is_in_mapping(const basic_matrix_storage<real> & matrix, const void * pointer)
+{
+    const char * begin = static_cast<const char *>(matrix.mapping);
+    const char * p = static_cast<const char *>(pointer);
+    return begin != nullptr && p >= begin && p < begin + matrix.mapping_size;
+}
+
+
+
+template<typename real>
+inline void free_matrix_storage(basic_matrix_storage<real> * matrix)
+{
+    if(!is_in_mapping(*matrix, matrix->data)) delete[] matrix->data;
+    if(!is_in_mapping(*matrix, matrix->row_ptr)) delete[] matrix->row_ptr;
+    if(!is_in_mapping(*matrix, matrix->col_idx)) delete[] matrix->col_idx;
+    delete[] matrix->row_perm;
+    if(matrix->mapping != nullptr) munmap(matrix->mapping, matrix->mapping_size);
+    matrix->mapping = nullptr;
+    matrix->mapping_size = 0;
+    matrix->data = nullptr;
+    matrix->row_ptr = nullptr;
+    matrix->col_idx = nullptr;
+    matrix->row_perm = nullptr;
+    stop_out_of_core_matrix(matrix->out_of_core);
+    matrix->out_of_core = nullptr;
+    if(matrix->op.release != nullptr) matrix->op.release(matrix->op.context);
+    matrix->op = matrix_operator();
+}
+
+
+
+template<typename real>
+inline void allocate_matrix_storage(basic_matrix_storage<real> * matrix, bool huge_pages = false)
+{
+    // allocates the data of a matrix with given format and size and first touches the pages
+    // in parallel with the same row split the kernels use
+    // for the sparse formats, row_ptr has to be filled in already, col_idx is allocated as well
+    // unless it is set already (a single precision copy shares the indices of the original)
+    // with huge_pages, the values are placed in an anonymous mapping backed by transparent huge pages,
+    // which saves TLB misses when streaming the matrix; new[] is the fallback
+
+    matrix->data = nullptr;
+    if(matrix->format == MATRIX_FORMAT_OPERATOR || matrix->format == MATRIX_FORMAT_OUT_OF_CORE) return;
+    if(huge_pages)
+    {
+        const size_t huge_page_size = size_t(2) << 20;
+        size_t mapping_size = (matrix_storage_size(*matrix) * sizeof(real) + huge_page_size - 1) / huge_page_size * huge_page_size;
+        void * mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mapping != MAP_FAILED)
+        {
+            madvise(mapping, mapping_size, MADV_HUGEPAGE);
+            matrix->mapping = mapping;
+            matrix->mapping_size = mapping_size;
+            matrix->data = static_cast<real *>(mapping);
+        }
+    }
+    if(matrix->data == nullptr)
+    {
+        matrix->data = new real[matrix_storage_size(*matrix)];
+    }
+
+    if(matrix->format == MATRIX_FORMAT_CSR || matrix->format == MATRIX_FORMAT_SELL)
+    {
+        size_t num_blocks = matrix->num_rows;
+        if(matrix->format == MATRIX_FORMAT_SELL) num_blocks = (matrix->num_rows + SELL_CHUNK_SIZE - 1) / SELL_CHUNK_SIZE;
+        bool allocate_col_idx = (matrix->col_idx == nullptr);
+        if(allocate_col_idx) matrix->col_idx = new uint32_t[matrix->num_nonzeros];
+        #pragma omp parallel for schedule(static)
+        for(size_t b = 0; b < num_blocks; b++)
+        {
+            size_t begin = matrix->row_ptr[b];
+            size_t end = matrix->row_ptr[b + 1];
+            memset(matrix->data + begin, 0, (end - begin) * sizeof(real));
+            if(allocate_col_idx) memset(matrix->col_idx + begin, 0, (end - begin) * sizeof(uint32_t));
+        }
+    }
+    else if(matrix->format == MATRIX_FORMAT_PACKED_SYMMETRIC)
+    {
+        #pragma omp parallel
+        {
+            size_t thread = 0;
+            size_t num_threads = 1;
+#ifdef _OPENMP
+            thread = omp_get_thread_num();
+            num_threads = omp_get_num_threads();
+#endif
+            size_t begin = packed_row_offset(packed_partition_begin(thread, num_threads, matrix->num_rows), matrix->num_rows);
+            size_t end = packed_row_offset(packed_partition_begin(thread + 1, num_threads, matrix->num_rows), matrix->num_rows);
+            memset(matrix->data + begin, 0, (end - begin) * sizeof(real));
+        }
+    }
+    else
+    {
+        #pragma omp parallel for schedule(static)
+        for(size_t r = 0; r < matrix->num_rows; r++)
+        {
+            memset(matrix->data + r * matrix->num_cols, 0, matrix->num_cols * sizeof(real));
+        }
+    }
+}
+
+
+
+inline bool read_matrix_header(FILE * file, matrix_format * format_out, size_t * num_rows_out, size_t * num_cols_out)
+{
+    size_t first;
+    if(fread(&first, sizeof(size_t), 1, file) != 1) return false;
+
+    if(first == MATRIX_TAG_PACKED_SYMMETRIC || first == MATRIX_TAG_CSR)
+    {
+        *format_out = (first == MATRIX_TAG_CSR) ? MATRIX_FORMAT_CSR : MATRIX_FORMAT_PACKED_SYMMETRIC;
+        if(fread(num_rows_out, sizeof(size_t), 1, file) != 1) return false;
+    }
+    else
+    {
+        *format_out = MATRIX_FORMAT_DENSE;
+        *num_rows_out = first;
+    }
+    if(fread(num_cols_out, sizeof(size_t), 1, file) != 1) return false;
+
+    return true;
+}
+
+
+
+inline bool read_matrix_from_file(const char * filename, double ** matrix_out, size_t * num_rows_out, size_t * num_cols_out)
+{
+    double * matrix;
+    size_t num_rows;
+    size_t num_cols;
+
+    FILE * file = fopen(filename, "rb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open output file\n");
+        return false;
+    }
+
+    matrix_format format;
+    if(!read_matrix_header(file, &format, &num_rows, &num_cols) || format != MATRIX_FORMAT_DENSE)
+    {
+        fprintf(stderr, "Expected a dense matrix in %s\n", filename);
+        fclose(file);
+        return false;
+    }
+    struct stat file_stat;
+    if(fstat(fileno(file), &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) != 2 * sizeof(size_t) + num_rows * num_cols * sizeof(double))
+    {
+        fprintf(stderr, "Size of %s does not match its header\n", filename);
+        fclose(file);
+        return false;
+    }
+    matrix = new double[num_rows * num_cols];
+
+    // first touch the pages in parallel with the same static row split the kernels use,
+    // so that on NUMA systems each block of rows lands on the socket of the thread working on it
+    #pragma omp parallel for schedule(static)
+    for(size_t r = 0; r < num_rows; r++)
+    {
+        for(size_t c = 0; c < num_cols; c++)
+        {
+            matrix[r * num_cols + c] = 0.0;
+        }
+    }
+
+    if(fread(matrix, sizeof(double), num_rows * num_cols, file) != num_rows * num_cols)
+    {
+        fprintf(stderr, "Cannot read matrix data\n");
+        delete[] matrix;
+        fclose(file);
+        return false;
+    }
+
+    *matrix_out = matrix;
+    *num_rows_out = num_rows;
+    *num_cols_out = num_cols;
+
+    fclose(file);
+
+    return true;
+}
+
+
+
+inline size_t matrix_header_size(const matrix_storage & matrix)
+{
+    if(matrix.format == MATRIX_FORMAT_PACKED_SYMMETRIC) return 3 * sizeof(size_t);
+    if(matrix.format == MATRIX_FORMAT_CSR) return 4 * sizeof(size_t);
+    return 2 * sizeof(size_t);
+}
+
+
+
+inline size_t matrix_file_size(const matrix_storage & matrix)
+{
+    size_t result = matrix_header_size(matrix) + matrix_storage_size(matrix) * sizeof(double);
+    if(matrix.format == MATRIX_FORMAT_CSR)
+    {
+        result += (matrix.num_rows + 1) * sizeof(size_t) + matrix.num_nonzeros * sizeof(uint32_t);
+    }
+    return result;
+}
+
+
+
+inline FILE * open_matrix_file(const char * filename, matrix_storage * matrix)
+{
+    // opens a matrix file, reads its header and checks that the file size matches it
+    // on success, the file is positioned after the header
+
+    FILE * file = fopen(filename, "rb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open input file\n");
+        return nullptr;
+    }
+
+    if(!read_matrix_header(file, &matrix->format, &matrix->num_rows, &matrix->num_cols))
+    {
+        fprintf(stderr, "Cannot read matrix header\n");
+        fclose(file);
+        return nullptr;
+    }
+    if(matrix->format == MATRIX_FORMAT_PACKED_SYMMETRIC && matrix->num_rows != matrix->num_cols)
+    {
+        fprintf(stderr, "Packed symmetric matrix has to be square\n");
+        fclose(file);
+        return nullptr;
+    }
+    if(matrix->format == MATRIX_FORMAT_CSR && matrix->num_cols > UINT32_MAX)
+    {
+        fprintf(stderr, "CSR matrix has too many columns for 32-bit column indices\n");
+        fclose(file);
+        return nullptr;
+    }
+    if(matrix->format == MATRIX_FORMAT_CSR && fread(&matrix->num_nonzeros, sizeof(size_t), 1, file) != 1)
+    {
+        fprintf(stderr, "Cannot read matrix header\n");
+        fclose(file);
+        return nullptr;
+    }
+
+    struct stat file_stat;
+    size_t expected_size = matrix_file_size(*matrix);
+    if(fstat(fileno(file), &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) != expected_size)
+    {
+        fprintf(stderr, "Matrix file has %lld bytes, but its header describes %zu bytes\n", static_cast<long long>(file_stat.st_size), expected_size);
+        fclose(file);
+        return nullptr;
+    }
+
+    return file;
+}
+
+
+
+inline bool check_csr_structure(const matrix_storage & matrix, bool check_col_idx)
+{
+    if(matrix.row_ptr[0] != 0 || matrix.row_ptr[matrix.num_rows] != matrix.num_nonzeros)
+    {
+        fprintf(stderr, "Invalid CSR row pointers\n");
+        return false;
+    }
+    for(size_t r = 0; r < matrix.num_rows; r++)
+    {
+        if(matrix.row_ptr[r] > matrix.row_ptr[r + 1])
+        {
+            fprintf(stderr, "Invalid CSR row pointers\n");
+            return false;
+        }
+    }
+    if(!check_col_idx) return true;
+
+    bool valid = true;
+    #pragma omp parallel for schedule(static) reduction(&&:valid)
+    for(size_t i = 0; i < matrix.num_nonzeros; i++)
+    {
+        valid = valid && matrix.col_idx[i] < matrix.num_cols;
+    }
+    if(!valid)
+    {
+        fprintf(stderr, "Column index out of range in CSR matrix\n");
+    }
+    return valid;
+}
+
+
+
+inline bool read_matrix_from_file(const char * filename, matrix_storage * matrix_out, bool huge_pages = false)
+{
+    // reads a matrix in any of the supported formats
+
+    matrix_storage matrix;
+    FILE * file = open_matrix_file(filename, &matrix);
+    if(file == nullptr)
+    {
+        return false;
+    }
+
+    if(matrix.format == MATRIX_FORMAT_CSR)
+    {
+        matrix.row_ptr = new size_t[matrix.num_rows + 1];
+        if(fread(matrix.row_ptr, sizeof(size_t), matrix.num_rows + 1, file) != matrix.num_rows + 1 || !check_csr_structure(matrix, false))
+        {
+            free_matrix_storage(&matrix);
+            fclose(file);
+            return false;
+        }
+    }
+
+    size_t num_values = matrix_storage_size(matrix);
+    allocate_matrix_storage(&matrix, huge_pages);
+
+    bool success = true;
+    if(matrix.format == MATRIX_FORMAT_CSR)
+    {
+        success = fread(matrix.col_idx, sizeof(uint32_t), num_values, file) == num_values;
+    }
+    success = success && fread(matrix.data, sizeof(double), num_values, file) == num_values;
+    fclose(file);
+    if(!success)
+    {
+        fprintf(stderr, "Cannot read matrix data\n");
+        free_matrix_storage(&matrix);
+        return false;
+    }
+    if(matrix.format == MATRIX_FORMAT_CSR && !check_csr_structure(matrix, true))
+    {
+        free_matrix_storage(&matrix);
+        return false;
+    }
+
+    *matrix_out = matrix;
+
+    return true;
+}
+
+
+
+inline bool map_matrix_from_file(const char * filename, matrix_storage * matrix_out, bool huge_pages = false)
+{
+    // maps the matrix file into memory read-only and points the matrix straight at the data after
+    // the header, so there is no copy and no second buffer besides the page cache
+    // the solver never writes to the matrix; the pages are placed by the page cache, not by first touch
+
+    matrix_storage matrix;
+    FILE * file = open_matrix_file(filename, &matrix);
+    if(file == nullptr)
+    {
+        return false;
+    }
+
+    size_t file_size = matrix_file_size(matrix);
+    void * mapping = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+    fclose(file);
+    if(mapping == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map matrix file into memory\n");
+        return false;
+    }
+
+    // read the whole file ahead asynchronously; MADV_SEQUENTIAL is not used, because it lets
+    // the kernel drop the pages behind the first pass, while CG streams the matrix in every iteration
+    madvise(mapping, file_size, MADV_WILLNEED);
+    if(huge_pages)
+    {
+        madvise(mapping, file_size, MADV_HUGEPAGE);
+    }
+
+    char * position = static_cast<char *>(mapping) + matrix_header_size(matrix);
+    if(matrix.format == MATRIX_FORMAT_CSR)
+    {
+        matrix.row_ptr = reinterpret_cast<size_t *>(position);
+        position += (matrix.num_rows + 1) * sizeof(size_t);
+        matrix.col_idx = reinterpret_cast<uint32_t *>(position);
+        position += matrix.num_nonzeros * sizeof(uint32_t);
+    }
+    matrix.data = reinterpret_cast<double *>(position);
+    matrix.mapping = mapping;
+    matrix.mapping_size = file_size;
+
+    if(reinterpret_cast<uintptr_t>(matrix.data) % alignof(double) != 0)
+    {
+        fprintf(stderr, "Matrix values in the file are not aligned, cannot use them in place\n");
+        free_matrix_storage(&matrix);
+        return false;
+    }
+    if(matrix.format == MATRIX_FORMAT_CSR && !check_csr_structure(matrix, true))
+    {
+        free_matrix_storage(&matrix);
+        return false;
+    }
+
+    *matrix_out = matrix;
+
+    return true;
+}
+
+
+
+inline bool open_out_of_core_matrix(const char * filename, size_t tile_bytes, matrix_storage * matrix_out)
+{
+    // keeps a dense matrix file open for streaming it in tiles of about tile_bytes, see out_of_core.h
+
+    matrix_storage matrix;
+    FILE * file = open_matrix_file(filename, &matrix);
+    if(file == nullptr)
+    {
+        return false;
+    }
+    fclose(file);
+    if(matrix.format != MATRIX_FORMAT_DENSE)
+    {
+        fprintf(stderr, "Out-of-core solves need a dense matrix file\n");
+        return false;
+    }
+
+    int descriptor = open(filename, O_RDONLY);
+    if(descriptor < 0)
+    {
+        fprintf(stderr, "Cannot open input file\n");
+        return false;
+    }
+    matrix.out_of_core = start_out_of_core_matrix(descriptor, matrix_header_size(matrix), matrix.num_rows, matrix.num_cols, tile_bytes);
+    matrix.format = MATRIX_FORMAT_OUT_OF_CORE;
+
+    *matrix_out = matrix;
+
+    return true;
+}
+
+
+
+inline bool close_matrix_file(FILE * file)
+{
+    bool success = (ferror(file) == 0);
+    success = (fclose(file) == 0) && success;
+    if(!success) fprintf(stderr, "Cannot write output file\n");
+    return success;
+}
+
+
+
+inline bool write_matrix_to_file(const char * filename, const double * matrix, size_t num_rows, size_t num_cols)
+{
+    FILE * file = fopen(filename, "wb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open output file\n");
+        return false;
+    }
+
+    fwrite(&num_rows, sizeof(size_t), 1, file);
+    fwrite(&num_cols, sizeof(size_t), 1, file);
+    fwrite(matrix, sizeof(double), num_rows * num_cols, file);
+
+    return close_matrix_file(file);
+}
+
+
+
+inline FILE * create_matrix_file(const char * filename, matrix_format format, size_t num_rows, size_t num_cols)
+{
+    // writes the header of a dense or packed symmetric matrix file, the rows are appended with
+    // append_matrix_rows, so that a matrix never has to be held in memory as a whole
+
+    if(format != MATRIX_FORMAT_DENSE && format != MATRIX_FORMAT_PACKED_SYMMETRIC)
+    {
+        fprintf(stderr, "Only dense and packed matrices can be written row by row\n");
+        return nullptr;
+    }
+    if(format == MATRIX_FORMAT_PACKED_SYMMETRIC && num_rows != num_cols)
+    {
+        fprintf(stderr, "Only a square matrix can be stored as packed symmetric\n");
+        return nullptr;
+    }
+    FILE * file = fopen(filename, "wb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open output file\n");
+        return nullptr;
+    }
+
+    if(format == MATRIX_FORMAT_PACKED_SYMMETRIC)
+    {
+        fwrite(&MATRIX_TAG_PACKED_SYMMETRIC, sizeof(size_t), 1, file);
+    }
+    fwrite(&num_rows, sizeof(size_t), 1, file);
+    fwrite(&num_cols, sizeof(size_t), 1, file);
+
+    return file;
+}
+
+
+
+inline bool append_matrix_rows(FILE * file, matrix_format format, const double * rows, size_t row_begin, size_t num_rows, size_t num_cols)
+{
+    // appends the full row-major rows [row_begin, row_begin + num_rows), of which the packed format keeps the upper triangle
+
+    if(format == MATRIX_FORMAT_PACKED_SYMMETRIC)
+    {
+        for(size_t i = 0; i < num_rows; i++)
+        {
+            size_t r = row_begin + i;
+            fwrite(rows + i * num_cols + r, sizeof(double), num_cols - r, file);
+        }
+    }
+    else
+    {
+        fwrite(rows, sizeof(double), num_rows * num_cols, file);
+    }
+    return ferror(file) == 0;
+}
+
+
+
+inline bool write_packed_symmetric_to_file(const char * filename, const double * matrix, size_t size)
+{
+    // writes the upper triangle of a dense row-major symmetric matrix in the packed format
+
+    FILE * file = fopen(filename, "wb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open output file\n");
+        return false;
+    }
+
+    fwrite(&MATRIX_TAG_PACKED_SYMMETRIC, sizeof(size_t), 1, file);
+    fwrite(&size, sizeof(size_t), 1, file);
+    fwrite(&size, sizeof(size_t), 1, file);
+    for(size_t r = 0; r < size; r++)
+    {
+        fwrite(matrix + r * size + r, sizeof(double), size - r, file);
+    }
+
+    return close_matrix_file(file);
+}
+
+
+
+inline bool write_matrix_to_file(const char * filename, const matrix_storage & matrix)
+{
+    FILE * file = fopen(filename, "wb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open output file\n");
+        return false;
+    }
+
+    if(matrix.format == MATRIX_FORMAT_SELL)
+    {
+        fprintf(stderr, "SELL matrices cannot be written, convert them to CSR first\n");
+        fclose(file);
+        return false;
+    }
+    if(matrix.format == MATRIX_FORMAT_OPERATOR)
+    {
+        fprintf(stderr, "Matrix-free operators cannot be written\n");
+        fclose(file);
+        return false;
+    }
+    if(matrix.format == MATRIX_FORMAT_OUT_OF_CORE)
+    {
+        fprintf(stderr, "Out-of-core matrices are already in a file\n");
+        fclose(file);
+        return false;
+    }
+
+    if(matrix.format == MATRIX_FORMAT_PACKED_SYMMETRIC)
+    {
+        fwrite(&MATRIX_TAG_PACKED_SYMMETRIC, sizeof(size_t), 1, file);
+    }
+    if(matrix.format == MATRIX_FORMAT_CSR)
+    {
+        fwrite(&MATRIX_TAG_CSR, sizeof(size_t), 1, file);
+    }
+    fwrite(&matrix.num_rows, sizeof(size_t), 1, file);
+    fwrite(&matrix.num_cols, sizeof(size_t), 1, file);
+    if(matrix.format == MATRIX_FORMAT_CSR)
+    {
+        fwrite(&matrix.num_nonzeros, sizeof(size_t), 1, file);
+        fwrite(matrix.row_ptr, sizeof(size_t), matrix.num_rows + 1, file);
+        fwrite(matrix.col_idx, sizeof(uint32_t), matrix.num_nonzeros, file);
+    }
+    fwrite(matrix.data, sizeof(double), matrix_storage_size(matrix), file);
+
+    return close_matrix_file(file);
+}
+
+
+
+template<typename real>
+inline basic_matrix_storage<real> convert_csr_to_sell(const basic_matrix_storage<real> & csr, size_t sigma)
+{
+    // builds the SELL-C-sigma layout of a CSR matrix, sigma is rounded up to a multiple of the chunk size
+
+    const size_t C = SELL_CHUNK_SIZE;
+    sigma = std::max(C, (sigma + C - 1) / C * C);
+    size_t num_rows = csr.num_rows;
+    size_t num_chunks = (num_rows + C - 1) / C;
+
+    basic_matrix_storage<real> sell;
+    sell.format = MATRIX_FORMAT_SELL;
+    sell.num_rows = num_rows;
+    sell.num_cols = csr.num_cols;
+    sell.row_perm = new uint32_t[num_chunks * C];
+    sell.row_ptr = new size_t[num_chunks + 1];
+
+    for(size_t i = 0; i < num_chunks * C; i++)
+    {
+        sell.row_perm[i] = static_cast<uint32_t>(std::min(i, num_rows));
+    }
+    for(size_t window = 0; window < num_rows; window += sigma)
+    {
+        std::stable_sort(sell.row_perm + window, sell.row_perm + std::min(window + sigma, num_rows), [&](uint32_t a, uint32_t b)
+        {
+            return csr.row_ptr[a + 1] - csr.row_ptr[a] > csr.row_ptr[b + 1] - csr.row_ptr[b];
+        });
+    }
+
+    sell.row_ptr[0] = 0;
+    for(size_t c = 0; c < num_chunks; c++)
+    {
+        size_t chunk_len = 0;
+        for(size_t k = 0; k < C; k++)
+        {
+            size_t row = sell.row_perm[c * C + k];
+            if(row < num_rows) chunk_len = std::max(chunk_len, csr.row_ptr[row + 1] - csr.row_ptr[row]);
+        }
+        sell.row_ptr[c + 1] = sell.row_ptr[c] + chunk_len * C;
+    }
+    sell.num_nonzeros = sell.row_ptr[num_chunks];
+
+    allocate_matrix_storage(&sell);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t c = 0; c < num_chunks; c++)
+    {
+        size_t chunk_len = (sell.row_ptr[c + 1] - sell.row_ptr[c]) / C;
+        for(size_t k = 0; k < C; k++)
+        {
+            size_t row = sell.row_perm[c * C + k];
+            size_t row_begin = (row < num_rows) ? csr.row_ptr[row] : 0;
+            size_t row_len = (row < num_rows) ? csr.row_ptr[row + 1] - row_begin : 0;
+            for(size_t j = 0; j < chunk_len; j++)
+            {
+                size_t pos = sell.row_ptr[c] + j * C + k;
+                if(j < row_len)
+                {
+                    sell.data[pos] = csr.data[row_begin + j];
+                    sell.col_idx[pos] = csr.col_idx[row_begin + j];
+                }
+                else
+                {
+                    // padding entries multiply x[0] by zero
+                    sell.data[pos] = 0.0;
+                    sell.col_idx[pos] = 0;
+                }
+            }
+        }
+    }
+
+    return sell;
+}
+
+
+
+inline matrix_storage make_operator_matrix(size_t size, const matrix_operator & op)
+{
+    // a size x size matrix-free operator; the matrix takes over op.context if op.release is set
+
+    matrix_storage matrix;
+    matrix.format = MATRIX_FORMAT_OPERATOR;
+    matrix.num_rows = size;
+    matrix.num_cols = size;
+    matrix.op = op;
+    return matrix;
+}
+
+
+
+struct laplacian_5point_grid
+{
+    size_t nx = 0;
+    size_t ny = 0;
+};
+
+
+
+template<typename real>
+inline double laplacian_5point_apply_dot(void * context, const real * x, real * y)
+{
+    const laplacian_5point_grid * grid = static_cast<const laplacian_5point_grid *>(context);
+    return laplacian_5point_dot(x, y, grid->nx, grid->ny);
+}
+
+
+
+inline double laplacian_5point_entry(void * context, size_t row, size_t col)
+{
+    // the neighbours of a grid point are the rows 1 and nx away, unless the point is on the edge of the grid
+
+    size_t nx = static_cast<const laplacian_5point_grid *>(context)->nx;
+    if(row == col) return 4.0;
+    size_t low = std::min(row, col);
+    size_t high = std::max(row, col);
+    if(high - low == 1 && high % nx != 0) return -1.0;
+    if(high - low == nx) return -1.0;
+    return 0.0;
+}
+
+
+
+inline void laplacian_5point_release(void * context)
+{
+    delete static_cast<laplacian_5point_grid *>(context);
+}
+
+
+
+inline matrix_storage make_laplacian_5point(size_t nx, size_t ny)
+{
+    // the matrix-free 5-point Laplacian of an nx x ny grid, see laplacian_5point_dot
+
+    laplacian_5point_grid * grid = new laplacian_5point_grid;
+    grid->nx = nx;
+    grid->ny = ny;
+
+    matrix_operator op;
+    op.context = grid;
+    op.apply_dot = &laplacian_5point_apply_dot<double>;
+    op.apply_dot_float = &laplacian_5point_apply_dot<float>;
+    op.entry = &laplacian_5point_entry;
+    op.release = &laplacian_5point_release;
+    // the stencil is applied on the fly: 1 multiplication and 4 subtractions per row
+    op.flops = 5.0 * nx * ny;
+    return make_operator_matrix(nx * ny, op);
+}
+
+
+
+inline bool parse_laplacian_5point(const char * name, size_t * nx_out, size_t * ny_out)
+{
+    // recognises "laplacian:NXxNY" in place of a matrix file name
+
+    unsigned long long nx;
+    unsigned long long ny;
+    char end;
+    if(sscanf(name, "laplacian:%llux%llu%c", &nx, &ny, &end) != 2 || nx == 0 || ny == 0) return false;
+    *nx_out = static_cast<size_t>(nx);
+    *ny_out = static_cast<size_t>(ny);
+    return true;
+}
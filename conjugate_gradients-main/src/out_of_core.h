@@ -0,0 +1,296 @@
+#pragma once
+
+#include <cstdio>
+#include <cerrno>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cg_kernels.h"
+
+
+
+// Out-of-core dense matrices
+//
+// A dense matrix that does not fit into memory stays in its file and is streamed through two tile
+// buffers of tile_rows rows in every product. The values follow the header in row-major order,
+// so a tile is a single contiguous range of the file. A background thread reads the next tile
+// with pread while the OpenMP threads multiply the current one, and drops the pages it has read
+// from the page cache again, so that the cache does not compete with the vectors of the solver
+// for memory. With the reads and the products overlapped, a tile costs the longer of the two
+// instead of their sum; the statistics record how much of the shorter one was hidden.
+//
+// The tiles are multiplied one after another in a fixed order, so the deterministic reduction
+// modes still give the same result for any number of threads (for a given tile size).
+
+struct out_of_core_statistics
+{
+    long num_products = 0;
+    double bytes_read = 0.0;
+    double read_time = 0.0;             // seconds the reader thread spent reading tiles
+    double compute_time = 0.0;          // seconds spent multiplying tiles
+    double wait_time = 0.0;             // seconds the products waited for a tile to arrive
+    double product_time = 0.0;          // seconds of the whole products
+};
+
+struct out_of_core_matrix
+{
+    int file = -1;
+    size_t data_offset = 0;             // bytes before the first value
+    size_t num_rows = 0;
+    size_t num_cols = 0;
+    size_t tile_rows = 0;
+    double * tiles[2] = {nullptr, nullptr};
+    std::vector<double> partial;        // dot products of a tile of gemm_dot
+    out_of_core_statistics statistics;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t requested_tile = 0;
+    bool pending = false;               // the reader thread has to read requested_tile
+    bool ready = false;                 // requested_tile has been read (or failed)
+    bool failed = false;
+    bool stop = false;
+};
+
+
+
+inline bool read_file_range(int file, void * buffer, size_t size, size_t offset)
+{
+    // pread returns short counts for large ranges, it is repeated until the range is complete
+
+    char * p = static_cast<char *>(buffer);
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t count = pread(file, p + done, size - done, static_cast<off_t>(offset + done));
+        if(count < 0 && errno == EINTR) continue;
+        if(count <= 0) return false;
+        done += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+
+
+inline void out_of_core_tile_range(const out_of_core_matrix & A, size_t tile, size_t * row_begin, size_t * num_rows)
+{
+    *row_begin = tile * A.tile_rows;
+    *num_rows = std::min(A.tile_rows, A.num_rows - *row_begin);
+}
+
+
+
+inline void out_of_core_reader_loop(out_of_core_matrix * A)
+{
+    std::unique_lock<std::mutex> lock(A->mutex);
+    while(true)
+    {
+        A->changed.wait(lock, [A]() { return A->pending || A->stop; });
+        if(A->stop) return;
+
+        // the product does not touch the buffer of a pending tile
+        size_t tile = A->requested_tile;
+        lock.unlock();
+        size_t row_begin, num_rows;
+        out_of_core_tile_range(*A, tile, &row_begin, &num_rows);
+        size_t size = num_rows * A->num_cols * sizeof(double);
+        size_t offset = A->data_offset + row_begin * A->num_cols * sizeof(double);
+        auto start = std::chrono::steady_clock::now();
+        bool success = read_file_range(A->file, A->tiles[tile % 2], size, offset);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(A->file, static_cast<off_t>(offset), static_cast<off_t>(size), POSIX_FADV_DONTNEED);
+#endif
+        lock.lock();
+        A->statistics.read_time += seconds;
+        if(success) A->statistics.bytes_read += static_cast<double>(size);
+        A->failed = A->failed || !success;
+        A->pending = false;
+        A->ready = true;
+        A->changed.notify_all();
+    }
+}
+
+
+
+inline out_of_core_matrix * start_out_of_core_matrix(int file, size_t data_offset, size_t num_rows, size_t num_cols, size_t tile_bytes)
+{
+    // takes over the open file; the tile buffers are first touched in parallel with the row split of gemv_dot
+
+    out_of_core_matrix * A = new out_of_core_matrix;
+    A->file = file;
+    A->data_offset = data_offset;
+    A->num_rows = num_rows;
+    A->num_cols = num_cols;
+    A->tile_rows = std::min(std::max<size_t>(tile_bytes / (std::max<size_t>(num_cols, 1) * sizeof(double)), 1), std::max<size_t>(num_rows, 1));
+    for(int k = 0; k < 2; k++)
+    {
+        A->tiles[k] = new double[A->tile_rows * num_cols];
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < A->tile_rows; i++)
+        {
+            for(size_t j = 0; j < num_cols; j++)
+            {
+                A->tiles[k][i * num_cols + j] = 0.0;
+            }
+        }
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    A->thread = std::thread(out_of_core_reader_loop, A);
+    return A;
+}
+
+
+
+inline void stop_out_of_core_matrix(out_of_core_matrix * A)
+{
+    if(A == nullptr) return;
+    {
+        std::lock_guard<std::mutex> lock(A->mutex);
+        A->stop = true;
+    }
+    A->changed.notify_all();
+    A->thread.join();
+    close(A->file);
+    delete[] A->tiles[0];
+    delete[] A->tiles[1];
+    delete A;
+}
+
+
+
+inline void request_out_of_core_tile(out_of_core_matrix * A, size_t tile)
+{
+    {
+        std::lock_guard<std::mutex> lock(A->mutex);
+        A->requested_tile = tile;
+        A->pending = true;
+        A->ready = false;
+    }
+    A->changed.notify_all();
+}
+
+
+
+inline bool wait_for_out_of_core_tile(out_of_core_matrix * A)
+{
+    std::unique_lock<std::mutex> lock(A->mutex);
+    A->changed.wait(lock, [A]() { return A->ready; });
+    return !A->failed;
+}
+
+
+
+template<typename tile_product>
+inline bool stream_out_of_core_tiles(out_of_core_matrix * A, tile_product product)
+{
+    // calls product(tile, row_begin, num_rows) for the tiles of A in order, the next tile is read
+    // while the product of the current one runs; returns false if a tile could not be read
+
+    typedef std::chrono::steady_clock clock;
+    auto product_start = clock::now();
+    out_of_core_statistics & statistics = A->statistics;
+    size_t num_tiles = (A->num_rows + A->tile_rows - 1) / A->tile_rows;
+    bool success = true;
+
+    if(num_tiles > 0) request_out_of_core_tile(A, 0);
+    for(size_t t = 0; t < num_tiles; t++)
+    {
+        auto wait_start = clock::now();
+        success = wait_for_out_of_core_tile(A);
+        auto compute_start = clock::now();
+        statistics.wait_time += std::chrono::duration<double>(compute_start - wait_start).count();
+        if(!success) break;
+        if(t + 1 < num_tiles) request_out_of_core_tile(A, t + 1);
+
+        size_t row_begin, num_rows;
+        out_of_core_tile_range(*A, t, &row_begin, &num_rows);
+        product(A->tiles[t % 2], row_begin, num_rows);
+        statistics.compute_time += std::chrono::duration<double>(clock::now() - compute_start).count();
+    }
+
+    statistics.num_products++;
+    statistics.product_time += std::chrono::duration<double>(clock::now() - product_start).count();
+
+    return success;
+}
+
+
+
+inline double out_of_core_gemv_dot(out_of_core_matrix * A, const double * x, double * y)
+{
+    // y = A * x; returns dot(x, y), or NaN if the matrix file cannot be read
+
+    double result = 0.0;
+    bool success = stream_out_of_core_tiles(A, [&](const double * tile, size_t row_begin, size_t num_rows)
+    {
+        result += gemv_dot(tile, x, y + row_begin, num_rows, A->num_cols, row_begin);
+    });
+    return success ? result : std::numeric_limits<double>::quiet_NaN();
+}
+
+
+
+inline void out_of_core_gemm_dot(out_of_core_matrix * A, const double * X, double * Y, size_t ld, size_t num_vecs, double * result)
+{
+    // Y = A * X; result[j] = dot(X[:, j], Y[:, j]), or NaN if the matrix file cannot be read
+    // every tile is read once for all the columns
+
+    if(A->partial.size() < num_vecs) A->partial.resize(num_vecs);
+    double * partial = A->partial.data();
+    for(size_t j = 0; j < num_vecs; j++)
+    {
+        result[j] = 0.0;
+    }
+    bool success = stream_out_of_core_tiles(A, [&](const double * tile, size_t row_begin, size_t num_rows)
+    {
+        gemm_dot(tile, X, Y + row_begin * ld, num_rows, A->num_cols, ld, num_vecs, partial, row_begin);
+        for(size_t j = 0; j < num_vecs; j++)
+        {
+            result[j] += partial[j];
+        }
+    });
+    for(size_t j = 0; j < num_vecs && !success; j++)
+    {
+        result[j] = std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+
+
+inline bool read_out_of_core_row(const out_of_core_matrix & A, size_t row, size_t col_begin, size_t count, double * values)
+{
+    // reads A[row][col_begin : col_begin + count] directly from the file, e.g. for a preconditioner
+
+    return read_file_range(A.file, values, count * sizeof(double), A.data_offset + (row * A.num_cols + col_begin) * sizeof(double));
+}
+
+
+
+inline void print_out_of_core_statistics(const out_of_core_statistics & statistics)
+{
+    // overlap: the part of the shorter of reading and computing that ran at the same time as the other
+
+    double hidden = statistics.read_time + statistics.compute_time - statistics.product_time;
+    double shorter = std::min(statistics.read_time, statistics.compute_time);
+    double overlap = (shorter > 0.0) ? std::min(std::max(hidden / shorter, 0.0), 1.0) : 0.0;
+    double gigabytes = statistics.bytes_read / 1e9;
+    printf("Out-of-core products: %ld, %.2f GB read\n", statistics.num_products, gigabytes);
+    printf("  disk:     %10.4f s  %8.3f GB/s\n", statistics.read_time, (statistics.read_time > 0.0) ? gigabytes / statistics.read_time : 0.0);
+    printf("  compute:  %10.4f s  %8.3f GB/s\n", statistics.compute_time, (statistics.compute_time > 0.0) ? gigabytes / statistics.compute_time : 0.0);
+    printf("  waiting:  %10.4f s\n", statistics.wait_time);
+    printf("  total:    %10.4f s  %8.3f GB/s sustained\n", statistics.product_time, (statistics.product_time > 0.0) ? gigabytes / statistics.product_time : 0.0);
+    printf("  overlap:  %9.1f%% of the %s time hidden\n", 100.0 * overlap, (statistics.read_time < statistics.compute_time) ? "disk" : "compute");
+}
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <cstdio>
+#include <chrono>
+#include <vector>
+
+#include "matrix_io.h"
+#include "preconditioner.h"
+
+
+
+// Per-kernel instrumentation of the solver
+//
+// Every timed kernel call adds its duration and the number of bytes and floating point operations
+// it performs to the statistics of its kernel. The byte counts are a model of the minimal memory
+// traffic: the matrix, the preconditioner and every vector are counted once per call, assuming
+// that the reused entries of a vector stay in the cache. Dot products fused into another kernel
+// are counted with that kernel. Recording is switched off unless the report is enabled, so the
+// timers cost nothing in a normal run.
+
+enum kernel_id
+{
+    KERNEL_READ_MATRIX,
+    KERNEL_MATVEC,
+    KERNEL_DOT,
+    KERNEL_AXPBY,
+    KERNEL_UPDATE,
+    KERNEL_PIPELINED_UPDATE,
+    KERNEL_PRECONDITIONER,
+    KERNEL_WRITE_SOLUTION,
+    NUM_KERNELS,
+};
+
+struct kernel_stats
+{
+    long long calls = 0;
+    double seconds = 0.0;
+    double bytes = 0.0;
+    double flops = 0.0;
+};
+
+struct performance_report
+{
+    bool enabled = false;
+    kernel_stats kernels[NUM_KERNELS];
+
+    // relative residual after every iteration; recorded values are multiplied by residual_scale,
+    // which lets the inner solves of the mixed precision mode report the residual of the outer system
+    std::vector<double> residual_history;
+    double residual_scale = 1.0;
+};
+
+// information about the run that is written to the report alongside the statistics
+struct run_summary
+{
+    const char * matrix_file;
+    const char * matrix_format;
+    size_t size;
+    size_t num_nonzeros;
+    size_t num_rhs;
+    int num_threads;
+    const char * precision;
+    const char * preconditioner;
+    const char * algorithm;
+    double rel_error;
+    double load_time;
+    double setup_time;
+    double solve_time;
+    bool converged;                     // as reported by the solver
+    double true_rel_residual;
+};
+
+
+
+inline performance_report & global_report()
+{
+    static performance_report report;
+    return report;
+}
+
+
+
+inline const char * kernel_name(kernel_id id)
+{
+    switch(id)
+    {
+        case KERNEL_READ_MATRIX: return "read_matrix_from_file";
+        case KERNEL_MATVEC: return "matvec";
+        case KERNEL_DOT: return "dot";
+        case KERNEL_AXPBY: return "axpby";
+        case KERNEL_UPDATE: return "update_solution_residual";
+        case KERNEL_PIPELINED_UPDATE: return "pipelined_update";
+        case KERNEL_PRECONDITIONER: return "preconditioner";
+        case KERNEL_WRITE_SOLUTION: return "write_matrix_to_file";
+        case NUM_KERNELS: break;
+    }
+    return "unknown";
+}
+
+
+
+inline double kernel_timer_start()
+{
+    if(!global_report().enabled) return 0.0;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+
+inline void kernel_timer_stop(kernel_id id, double start, double bytes, double flops)
+{
+    performance_report & report = global_report();
+    if(!report.enabled) return;
+    double now = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    kernel_stats & stats = report.kernels[id];
+    stats.calls++;
+    stats.seconds += now - start;
+    stats.bytes += bytes;
+    stats.flops += flops;
+}
+
+
+
+inline void record_residual(double rel_residual)
+{
+    performance_report & report = global_report();
+    if(!report.enabled) return;
+    report.residual_history.push_back(report.residual_scale * rel_residual);
+}
+
+
+
+template<typename real>
+inline void matvec_cost(const basic_matrix_storage<real> & A, size_t num_vecs, double * bytes_out, double * flops_out)
+{
+    // bytes and flops of a product of A with num_vecs vectors, including the fused dot products
+
+    double n = static_cast<double>(A.num_rows);
+    double values = static_cast<double>(matrix_storage_size(A));
+    double bytes = values * sizeof(real) + 2.0 * n * num_vecs * sizeof(real);
+    double flops = 2.0 * values * num_vecs + 2.0 * n * num_vecs;
+    if(A.format == MATRIX_FORMAT_PACKED_SYMMETRIC)
+    {
+        // every stored entry is used for two rows
+        flops += 2.0 * values * num_vecs;
+    }
+    if(A.format == MATRIX_FORMAT_CSR)
+    {
+        bytes += values * sizeof(uint32_t) + (n + 1) * sizeof(size_t);
+    }
+    if(A.format == MATRIX_FORMAT_SELL)
+    {
+        bytes += values * sizeof(uint32_t) + n * sizeof(uint32_t) + (n / SELL_CHUNK_SIZE + 1) * sizeof(size_t);
+    }
+    if(A.format == MATRIX_FORMAT_OPERATOR)
+    {
+        bytes += A.op.bytes * num_vecs;
+        flops += A.op.flops * num_vecs;
+    }
+    *bytes_out = bytes;
+    *flops_out = flops;
+}
+
+
+
+template<typename real>
+inline void preconditioner_cost(const preconditioner<real> & M, double * bytes_out, double * flops_out)
+{
+    // bytes and flops of z = M^-1 * r including the fused dot(r, z)
+
+    double n = static_cast<double>(M.size);
+    double bytes = 2.0 * n * sizeof(real);
+    double flops = 2.0 * n;
+    if(M.type == PRECONDITIONER_JACOBI)
+    {
+        bytes += n * sizeof(real);
+        flops += n;
+    }
+    if(M.type == PRECONDITIONER_BLOCK_JACOBI)
+    {
+        // both substitutions use the lower triangle of each block, which stays in the cache for the second one
+        double lower = n * (M.block_size + 1) / 2.0;
+        bytes += lower * sizeof(real);
+        flops += 4.0 * lower;
+    }
+    if(M.type == PRECONDITIONER_ICT)
+    {
+        // L is streamed once for each of the two substitutions
+        double nnz = static_cast<double>(M.L_row_ptr[M.size]);
+        bytes += 2.0 * (nnz * (sizeof(real) + sizeof(uint32_t)) + (n + 1) * sizeof(size_t));
+        flops += 4.0 * nnz;
+    }
+    *bytes_out = bytes;
+    *flops_out = flops;
+}
+
+
+
+inline void print_performance_report(const performance_report & report)
+{
+    printf("  kernel                        calls    time [s]      GB/s   GFLOP/s\n");
+    for(int k = 0; k < NUM_KERNELS; k++)
+    {
+        const kernel_stats & stats = report.kernels[k];
+        if(stats.calls == 0) continue;
+        double seconds = (stats.seconds > 0.0) ? stats.seconds : 1e-30;
+        printf("  %-26s %8lld  %10.4f  %8.2f  %8.2f\n", kernel_name(static_cast<kernel_id>(k)), stats.calls, stats.seconds, stats.bytes / seconds * 1e-9, stats.flops / seconds * 1e-9);
+    }
+}
+
+
+
+inline void write_json_string(FILE * file, const char * text)
+{
+    // text as a quoted JSON string, with quotes, backslashes and control characters escaped
+
+    fputc('"', file);
+    for(const char * c = text; *c != '\0'; c++)
+    {
+        unsigned char value = static_cast<unsigned char>(*c);
+        if(value == '"' || value == '\\') fprintf(file, "\\%c", value);
+        else if(value < 0x20) fprintf(file, "\\u%04x", value);
+        else fputc(value, file);
+    }
+    fputc('"', file);
+}
+
+
+
+inline bool write_performance_report(const char * filename, const performance_report & report, const run_summary & run)
+{
+    FILE * file = fopen(filename, "w");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Cannot open output file\n");
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"matrix_file\": ");
+    write_json_string(file, run.matrix_file);
+    fprintf(file, ",\n");
+    fprintf(file, "  \"matrix_format\": \"%s\",\n", run.matrix_format);
+    fprintf(file, "  \"size\": %zu,\n", run.size);
+    fprintf(file, "  \"num_nonzeros\": %zu,\n", run.num_nonzeros);
+    fprintf(file, "  \"num_rhs\": %zu,\n", run.num_rhs);
+    fprintf(file, "  \"num_threads\": %d,\n", run.num_threads);
+    fprintf(file, "  \"precision\": \"%s\",\n", run.precision);
+    fprintf(file, "  \"preconditioner\": \"%s\",\n", run.preconditioner);
+    fprintf(file, "  \"algorithm\": \"%s\",\n", run.algorithm);
+    fprintf(file, "  \"rel_error\": %.6e,\n", run.rel_error);
+    fprintf(file, "  \"iterations\": %zu,\n", report.residual_history.size());
+    fprintf(file, "  \"converged\": %s,\n", run.converged ? "true" : "false");
+    fprintf(file, "  \"true_rel_residual\": %.6e,\n", run.true_rel_residual);
+    fprintf(file, "  \"load_time\": %.6f,\n", run.load_time);
+    fprintf(file, "  \"setup_time\": %.6f,\n", run.setup_time);
+    fprintf(file, "  \"solve_time\": %.6f,\n", run.solve_time);
+
+    fprintf(file, "  \"kernels\": [");
+    bool first = true;
+    for(int k = 0; k < NUM_KERNELS; k++)
+    {
+        const kernel_stats & stats = report.kernels[k];
+        if(stats.calls == 0) continue;
+        double seconds = (stats.seconds > 0.0) ? stats.seconds : 1e-30;
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"calls\": %lld, \"time\": %.6f, \"bytes\": %.6e, \"flops\": %.6e, \"GB/s\": %.3f, \"GFLOP/s\": %.3f}",
+            first ? "" : ",", kernel_name(static_cast<kernel_id>(k)), stats.calls, stats.seconds, stats.bytes, stats.flops, stats.bytes / seconds * 1e-9, stats.flops / seconds * 1e-9);
+        first = false;
+    }
+    fprintf(file, "\n  ],\n");
+
+    fprintf(file, "  \"residual_history\": [");
+    for(size_t i = 0; i < report.residual_history.size(); i++)
+    {
+        fprintf(file, "%s%.6e", (i % 8 == 0) ? "\n    " : " ", report.residual_history[i]);
+        if(i + 1 < report.residual_history.size()) fprintf(file, ",");
+    }
+    fprintf(file, "\n  ]\n");
+    fprintf(file, "}\n");
+
+    bool success = (ferror(file) == 0);
+    fclose(file);
+
+    return success;
+}
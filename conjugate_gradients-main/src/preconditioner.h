@@ -0,0 +1,524 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include <queue>
+#include <functional>
+
+#include "matrix_io.h"
+
+
+
+// Preconditioners for CG
+//
+// jacobi:        z = D^-1 * r with the diagonal D of A
+// block-jacobi:  the diagonal blocks of A are factored by dense Cholesky, z is obtained by forward
+//                and backward substitution with each block independently
+// ict:           threshold incomplete Cholesky A ~ L * L^T for sparse (CSR) matrices, entries of L
+//                smaller than threshold * |row of A| are dropped
+
+enum preconditioner_type
+{
+    PRECONDITIONER_NONE,
+    PRECONDITIONER_JACOBI,
+    PRECONDITIONER_BLOCK_JACOBI,
+    PRECONDITIONER_ICT,
+};
+
+template<typename real>
+struct preconditioner
+{
+    preconditioner_type type = PRECONDITIONER_NONE;
+    size_t size = 0;
+
+    // jacobi
+    real * inv_diag = nullptr;
+
+    // block-jacobi: lower Cholesky factors of the diagonal blocks, each stored as a dense
+    // block_size x block_size row-major matrix (the last block can be smaller)
+    size_t block_size = 0;
+    real * blocks = nullptr;
+
+    // ict: rows of L in CSR, the diagonal entry is the last one in each row; L_row_ptr[size] is the
+    // number of nonzeros of L, and num_replaced_pivots counts the pivots the factorization replaced
+    size_t * L_row_ptr = nullptr;
+    uint32_t * L_col_idx = nullptr;
+    real * L_values = nullptr;
+    size_t num_replaced_pivots = 0;
+};
+
+
+
+inline const char * preconditioner_name(preconditioner_type type)
+{
+    switch(type)
+    {
+        case PRECONDITIONER_NONE: return "none";
+        case PRECONDITIONER_JACOBI: return "jacobi";
+        case PRECONDITIONER_BLOCK_JACOBI: return "block-jacobi";
+        case PRECONDITIONER_ICT: return "ict";
+    }
+    return "unknown";
+}
+
+
+
+inline bool parse_preconditioner(const char * name, preconditioner_type * type_out)
+{
+    if(strcmp(name, "none") == 0) { *type_out = PRECONDITIONER_NONE; return true; }
+    if(strcmp(name, "jacobi") == 0) { *type_out = PRECONDITIONER_JACOBI; return true; }
+    if(strcmp(name, "block-jacobi") == 0) { *type_out = PRECONDITIONER_BLOCK_JACOBI; return true; }
+    if(strcmp(name, "ict") == 0) { *type_out = PRECONDITIONER_ICT; return true; }
+    return false;
+}
+
+
+
+template<typename real>
+inline void free_preconditioner(preconditioner<real> * M)
+{
+    delete[] M->inv_diag;
+    delete[] M->blocks;
+    delete[] M->L_row_ptr;
+    delete[] M->L_col_idx;
+    delete[] M->L_values;
+    *M = preconditioner<real>();
+}
+
+
+
+inline void extract_matrix_block(const matrix_storage & A, size_t row_begin, size_t num_rows, double * block)
+{
+    // copies the square diagonal block A[row_begin : row_begin + num_rows][same] into a dense row-major array
+
+    for(size_t i = 0; i < num_rows * num_rows; i++)
+    {
+        block[i] = 0.0;
+    }
+
+    size_t n = A.num_rows;
+    for(size_t i = 0; i < num_rows; i++)
+    {
+        size_t row = row_begin + i;
+        if(A.format == MATRIX_FORMAT_DENSE)
+        {
+            for(size_t j = 0; j < num_rows; j++)
+            {
+                block[i * num_rows + j] = A.data[row * A.num_cols + row_begin + j];
+            }
+        }
+        else if(A.format == MATRIX_FORMAT_PACKED_SYMMETRIC)
+        {
+            const double * A_row = A.data + packed_row_offset(row, n) - row;
+            for(size_t j = i; j < num_rows; j++)
+            {
+                block[i * num_rows + j] = A_row[row_begin + j];
+                block[j * num_rows + i] = A_row[row_begin + j];
+            }
+        }
+        else if(A.format == MATRIX_FORMAT_CSR)
+        {
+            for(size_t k = A.row_ptr[row]; k < A.row_ptr[row + 1]; k++)
+            {
+                size_t col = A.col_idx[k];
+                if(col >= row_begin && col < row_begin + num_rows)
+                {
+                    block[i * num_rows + col - row_begin] += A.data[k];
+                }
+            }
+        }
+        else if(A.format == MATRIX_FORMAT_OUT_OF_CORE)
+        {
+            // a row that cannot be read makes the block non-positive definite, so the setup fails
+            if(!read_out_of_core_row(*A.out_of_core, row, row_begin, num_rows, block + i * num_rows))
+            {
+                block[i * num_rows + i] = std::numeric_limits<double>::quiet_NaN();
+            }
+        }
+        else if(A.format == MATRIX_FORMAT_OPERATOR && A.op.entry != nullptr)
+        {
+            for(size_t j = 0; j < num_rows; j++)
+            {
+                block[i * num_rows + j] = A.op.entry(A.op.context, row, row_begin + j);
+            }
+        }
+    }
+}
+
+
+
+inline bool cholesky_factorize(double * block, size_t size)
+{
+    // in-place lower Cholesky factorization of a dense row-major SPD matrix, the upper triangle is zeroed
+
+    for(size_t j = 0; j < size; j++)
+    {
+        double d = block[j * size + j];
+        for(size_t k = 0; k < j; k++)
+        {
+            d -= block[j * size + k] * block[j * size + k];
+        }
+        if(!(d > 0.0)) return false;
+        d = std::sqrt(d);
+        block[j * size + j] = d;
+
+        for(size_t i = j + 1; i < size; i++)
+        {
+            double val = block[i * size + j];
+            for(size_t k = 0; k < j; k++)
+            {
+                val -= block[i * size + k] * block[j * size + k];
+            }
+            block[i * size + j] = val / d;
+            block[j * size + i] = 0.0;
+        }
+    }
+    return true;
+}
+
+
+
+inline bool setup_block_jacobi(const matrix_storage & A, size_t block_size, preconditioner<double> * M)
+{
+    size_t n = A.num_rows;
+    size_t num_blocks = (n + block_size - 1) / block_size;
+    M->block_size = block_size;
+    M->blocks = new double[num_blocks * block_size * block_size];
+
+    bool success = true;
+    #pragma omp parallel for schedule(dynamic) reduction(&&:success)
+    for(size_t b = 0; b < num_blocks; b++)
+    {
+        size_t row_begin = b * block_size;
+        size_t rows = std::min(block_size, n - row_begin);
+        double * block = M->blocks + b * block_size * block_size;
+        extract_matrix_block(A, row_begin, rows, block);
+        success = cholesky_factorize(block, rows) && success;
+    }
+    if(!success)
+    {
+        fprintf(stderr, "A diagonal block is not positive definite\n");
+    }
+    return success;
+}
+
+
+
+inline bool setup_ict(const matrix_storage & A, double threshold, preconditioner<double> * M)
+{
+    // row-by-row incomplete Cholesky with threshold dropping
+    // L[i][k] = (A[i][k] - sum_{j<k} L[i][j] * L[k][j]) / L[k][k]; the row i is built in the dense work
+    // vector w, and whenever w[j] is final, it is eliminated from the later entries w[k] using column j
+    // of the already computed rows of L, which are kept as column lists
+    // the matrix has to be stored with both triangles
+
+    size_t n = A.num_rows;
+    std::vector<double> w(n, 0.0);
+    std::vector<char> in_pattern(n, 0);
+    std::vector<std::vector<std::pair<uint32_t, double>>> columns(n);
+    std::vector<size_t> row_ptr(1, 0);
+    std::vector<uint32_t> col_idx;
+    std::vector<double> values;
+    size_t num_breakdowns = 0;
+
+    for(size_t i = 0; i < n; i++)
+    {
+        std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t>> pattern;
+        double row_norm = 0.0;
+        double diag = 0.0;
+        for(size_t k = A.row_ptr[i]; k < A.row_ptr[i + 1]; k++)
+        {
+            uint32_t col = A.col_idx[k];
+            row_norm += A.data[k] * A.data[k];
+            if(col == i) diag += A.data[k];
+            if(col >= i) continue;
+            if(!in_pattern[col])
+            {
+                in_pattern[col] = 1;
+                pattern.push(col);
+            }
+            w[col] += A.data[k];
+        }
+        double drop_tolerance = threshold * std::sqrt(row_norm);
+
+        size_t row_begin = col_idx.size();
+        double sum_squares = 0.0;
+        while(!pattern.empty())
+        {
+            uint32_t j = pattern.top();
+            pattern.pop();
+            in_pattern[j] = 0;
+            double val = w[j] / values[row_ptr[j + 1] - 1];
+            w[j] = 0.0;
+            if(std::fabs(val) < drop_tolerance) continue;
+
+            col_idx.push_back(j);
+            values.push_back(val);
+            sum_squares += val * val;
+            for(const auto & entry : columns[j])
+            {
+                uint32_t k = entry.first;
+                if(!in_pattern[k])
+                {
+                    in_pattern[k] = 1;
+                    pattern.push(k);
+                }
+                w[k] -= val * entry.second;
+            }
+        }
+
+        double d = diag - sum_squares;
+        if(!(d > threshold * std::fabs(diag)))
+        {
+            // the incomplete factorization broke down, keep the factor positive definite
+            num_breakdowns++;
+            d = std::fabs(diag);
+        }
+        col_idx.push_back(static_cast<uint32_t>(i));
+        values.push_back(std::sqrt(d));
+        row_ptr.push_back(col_idx.size());
+
+        for(size_t k = row_begin; k + 1 < col_idx.size(); k++)
+        {
+            columns[col_idx[k]].push_back(std::make_pair(static_cast<uint32_t>(i), values[k]));
+        }
+    }
+
+    M->num_replaced_pivots = num_breakdowns;
+    M->L_row_ptr = new size_t[n + 1];
+    M->L_col_idx = new uint32_t[col_idx.size()];
+    M->L_values = new double[values.size()];
+    std::copy(row_ptr.begin(), row_ptr.end(), M->L_row_ptr);
+    std::copy(col_idx.begin(), col_idx.end(), M->L_col_idx);
+    std::copy(values.begin(), values.end(), M->L_values);
+
+    return true;
+}
+
+
+
+inline bool setup_preconditioner(const matrix_storage & A, preconditioner_type type, size_t block_size, double ict_threshold, preconditioner<double> * M_out)
+{
+    preconditioner<double> M;
+    M.type = type;
+    M.size = A.num_rows;
+    size_t n = A.num_rows;
+
+    if(A.format == MATRIX_FORMAT_SELL)
+    {
+        fprintf(stderr, "The preconditioner has to be set up before conversion to SELL\n");
+        return false;
+    }
+
+    if((type == PRECONDITIONER_JACOBI || type == PRECONDITIONER_BLOCK_JACOBI) && A.format == MATRIX_FORMAT_OPERATOR && A.op.entry == nullptr)
+    {
+        fprintf(stderr, "The preconditioner needs the entries of the matrix-free operator\n");
+        return false;
+    }
+
+    bool success = true;
+    if(type == PRECONDITIONER_JACOBI)
+    {
+        M.inv_diag = new double[n];
+        #pragma omp parallel for schedule(static) reduction(&&:success)
+        for(size_t i = 0; i < n; i++)
+        {
+            double diag;
+            extract_matrix_block(A, i, 1, &diag);
+            M.inv_diag[i] = 1.0 / diag;
+            success = (diag > 0.0) && success;
+        }
+        if(!success)
+        {
+            fprintf(stderr, "Matrix has a non-positive diagonal entry\n");
+        }
+    }
+    else if(type == PRECONDITIONER_BLOCK_JACOBI)
+    {
+        success = setup_block_jacobi(A, std::max<size_t>(1, std::min(block_size, n)), &M);
+    }
+    else if(type == PRECONDITIONER_ICT)
+    {
+        if(A.format != MATRIX_FORMAT_CSR)
+        {
+            fprintf(stderr, "The incomplete Cholesky preconditioner needs a sparse (CSR) matrix\n");
+            return false;
+        }
+        success = setup_ict(A, ict_threshold, &M);
+    }
+
+    if(!success)
+    {
+        free_preconditioner(&M);
+        return false;
+    }
+
+    *M_out = M;
+
+    return true;
+}
+
+
+
+template<typename real>
+inline preconditioner<float> convert_preconditioner_to_float(const preconditioner<real> & M)
+{
+    preconditioner<float> M_float;
+    M_float.type = M.type;
+    M_float.size = M.size;
+    M_float.block_size = M.block_size;
+    M_float.num_replaced_pivots = M.num_replaced_pivots;
+
+    auto convert = [](const real * values, size_t count)
+    {
+        float * result = new float[count];
+        for(size_t i = 0; i < count; i++)
+        {
+            result[i] = static_cast<float>(values[i]);
+        }
+        return result;
+    };
+
+    size_t n = M.size;
+    if(M.inv_diag != nullptr)
+    {
+        M_float.inv_diag = convert(M.inv_diag, n);
+    }
+    if(M.blocks != nullptr)
+    {
+        size_t num_blocks = (n + M.block_size - 1) / M.block_size;
+        M_float.blocks = convert(M.blocks, num_blocks * M.block_size * M.block_size);
+    }
+    if(M.L_values != nullptr)
+    {
+        size_t nnz = M.L_row_ptr[n];
+        M_float.L_row_ptr = new size_t[n + 1];
+        M_float.L_col_idx = new uint32_t[nnz];
+        std::copy(M.L_row_ptr, M.L_row_ptr + n + 1, M_float.L_row_ptr);
+        std::copy(M.L_col_idx, M.L_col_idx + nnz, M_float.L_col_idx);
+        M_float.L_values = convert(M.L_values, nnz);
+    }
+
+    return M_float;
+}
+
+
+
+template<typename real>
+inline double apply_preconditioner_dot(const preconditioner<real> & M, const real * r, real * z)
+{
+    // z = M^-1 * r; returns dot(r, z)
+
+    size_t n = M.size;
+    double result = 0.0;
+
+    if(M.type == PRECONDITIONER_JACOBI)
+    {
+        result = reduce_range(n, REDUCTION_CHUNK_SIZE, [&](size_t begin, size_t end)
+        {
+            double partial = 0.0;
+            for(size_t i = begin; i < end; i++)
+            {
+                real z_val = M.inv_diag[i] * r[i];
+                z[i] = z_val;
+                partial += r[i] * z_val;
+            }
+            return partial;
+        });
+    }
+    else if(M.type == PRECONDITIONER_BLOCK_JACOBI)
+    {
+        size_t bs = M.block_size;
+        size_t num_blocks = (n + bs - 1) / bs;
+        result = reduce_range(num_blocks, REDUCTION_CHUNK_SIZE / bs, [&](size_t block_begin, size_t block_end)
+        {
+            double partial = 0.0;
+            for(size_t b = block_begin; b < block_end; b++)
+            {
+                size_t row_begin = b * bs;
+                size_t rows = std::min(bs, n - row_begin);
+                const real * L = M.blocks + b * bs * bs;
+                const real * r_block = r + row_begin;
+                real * z_block = z + row_begin;
+
+                // L * y = r
+                for(size_t i = 0; i < rows; i++)
+                {
+                    double val = r_block[i];
+                    for(size_t k = 0; k < i; k++)
+                    {
+                        val -= L[i * rows + k] * z_block[k];
+                    }
+                    z_block[i] = val / L[i * rows + i];
+                }
+                // L^T * z = y
+                for(size_t i = rows; i-- > 0; )
+                {
+                    double val = z_block[i];
+                    for(size_t k = i + 1; k < rows; k++)
+                    {
+                        val -= L[k * rows + i] * z_block[k];
+                    }
+                    z_block[i] = val / L[i * rows + i];
+                }
+
+                for(size_t i = 0; i < rows; i++)
+                {
+                    partial += r_block[i] * z_block[i];
+                }
+            }
+            return partial;
+        });
+    }
+    else if(M.type == PRECONDITIONER_ICT)
+    {
+        // the triangular solves are inherently sequential
+
+        // L * y = r
+        for(size_t i = 0; i < n; i++)
+        {
+            size_t diag_pos = M.L_row_ptr[i + 1] - 1;
+            double val = r[i];
+            for(size_t k = M.L_row_ptr[i]; k < diag_pos; k++)
+            {
+                val -= M.L_values[k] * z[M.L_col_idx[k]];
+            }
+            z[i] = val / M.L_values[diag_pos];
+        }
+        // L^T * z = y, column oriented on the rows of L
+        for(size_t i = n; i-- > 0; )
+        {
+            size_t diag_pos = M.L_row_ptr[i + 1] - 1;
+            real z_val = z[i] / M.L_values[diag_pos];
+            z[i] = z_val;
+            for(size_t k = M.L_row_ptr[i]; k < diag_pos; k++)
+            {
+                z[M.L_col_idx[k]] -= M.L_values[k] * z_val;
+            }
+        }
+        for(size_t i = 0; i < n; i++)
+        {
+            result += r[i] * z[i];
+        }
+    }
+    else
+    {
+        result = reduce_range(n, REDUCTION_CHUNK_SIZE, [&](size_t begin, size_t end)
+        {
+            double partial = 0.0;
+            for(size_t i = begin; i < end; i++)
+            {
+                z[i] = r[i];
+                partial += r[i] * r[i];
+            }
+            return partial;
+        });
+    }
+
+    return result;
+}
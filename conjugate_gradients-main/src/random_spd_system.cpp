@@ -1,10 +1,15 @@
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <cstring>
 #include <cmath>
+#include <algorithm>
 #include <vector>
 
-#include <mkl.h>
+#include "matrix_io.h"
+#include "counter_rng.h"
+#include "dense_blas.h"
+#include "batched_solver.h"
 
 
 
@@ -24,14 +29,16 @@ void print_matrix(const double * matrix, size_t num_rows, size_t num_cols, FILE
 
 
 
-void random_matrix(double * matrix, size_t num_rows, size_t num_cols, int seed)
+void random_matrix(double * matrix, size_t num_rows, size_t num_cols, int seed, random_stream stream)
 {
-    srand(seed);
+    // column-major, entry (r, c) is uniform in [-1, 1) and only depends on seed, stream, r and c
+
+    #pragma omp parallel for schedule(static)
     for(size_t c = 0; c < num_cols; c++)
     {
         for(size_t r = 0; r < num_rows; r++)
         {
-            matrix[c * num_rows + r] = ((2.0 * rand()) / RAND_MAX) - 1.0;
+            matrix[c * num_rows + r] = counter_random_uniform(static_cast<uint32_t>(seed), stream, r, c);
         }
     }
 }
@@ -44,8 +51,8 @@ void gram_schmidt_recursive(double * A, size_t col_begin, size_t col_end, size_t
     size_t num_cols_curr = col_end - col_begin;
     if(num_cols_curr == 1)
     {
-        double norm = cblas_dnrm2(num_rows, A + col_begin * ld, 1);
-        cblas_dscal(num_rows, 1.0/norm, A + col_begin * ld, 1);
+        double norm = dense_dnrm2(num_rows, A + col_begin * ld);
+        dense_dscal(num_rows, 1.0/norm, A + col_begin * ld);
         return;
     }
 
@@ -55,32 +62,72 @@ void gram_schmidt_recursive(double * A, size_t col_begin, size_t col_end, size_t
 
     gram_schmidt_recursive(A, col_begin, col_mid, num_rows, buffer_alphas);
 
-    cblas_dgemm(CblasColMajor, CblasTrans, CblasNoTrans, num_cols_first_half, num_cols_second_half, num_rows, 1.0, A + col_begin * ld, ld, A + col_mid * ld, ld, 0.0, buffer_alphas, ld);
-    cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, num_rows, num_cols_second_half, num_cols_first_half, -1.0, A + col_begin * ld, ld, buffer_alphas, ld, 1.0, A + col_mid * ld, ld);
+    dense_dgemm(true, false, num_cols_first_half, num_cols_second_half, num_rows, 1.0, A + col_begin * ld, ld, A + col_mid * ld, ld, 0.0, buffer_alphas, ld);
+    dense_dgemm(false, false, num_rows, num_cols_second_half, num_cols_first_half, -1.0, A + col_begin * ld, ld, buffer_alphas, ld, 1.0, A + col_mid * ld, ld);
 
     gram_schmidt_recursive(A, col_mid, col_end, num_rows, buffer_alphas);
 }
 
 
 
-void random_spd_matrix(double * A, size_t size, int seed)
+size_t default_panel_rows(size_t size)
+{
+    // rows of a panel of about 64 MB
+    return std::max<size_t>(std::min<size_t>((size_t(1) << 23) / size, size), 1);
+}
+
+
+
+bool write_spd_panels(const char * filename, matrix_format format, const double * W, size_t size, size_t rank, const double * shift, size_t panel_rows)
+{
+    // streams A = W * W^T + diag(shift) to the file in panels of panel_rows rows; W is column-major size x rank
+    // a panel of rows is a panel of columns of the symmetric A, computed by one GEMM with the rows of W
+
+    FILE * file = create_matrix_file(filename, format, size, size);
+    if(file == nullptr) return false;
+
+    double * panel = new double[panel_rows * size];
+    bool success = true;
+    for(size_t row_begin = 0; row_begin < size && success; row_begin += panel_rows)
+    {
+        size_t num_rows = std::min(panel_rows, size - row_begin);
+        dense_dgemm(false, true, size, num_rows, rank, 1.0, W, size, W + row_begin, size, 0.0, panel, size);
+        if(shift != nullptr)
+        {
+            for(size_t i = 0; i < num_rows; i++)
+            {
+                panel[i * size + row_begin + i] += shift[row_begin + i];
+            }
+        }
+        success = append_matrix_rows(file, format, panel, row_begin, num_rows, size);
+    }
+    delete[] panel;
+
+    return close_matrix_file(file) && success;
+}
+
+
+
+bool write_random_spd_matrix(const char * filename, matrix_format format, size_t size, int seed, size_t panel_rows)
 {
     // generate random orthogonal matrix Q and diagonal matrix with positive eigenvalues D
     // then A = Q*D*Qt = Q*d*d*Qt = (Q*d)*(dt*Qt) = (Q*d)*(Q*d)^T
     // we are doing the opposite of eigendecomposition of an SPD matrix
+    // A is written in panels, so besides Q only a panel of rows is held in memory
 
     double * Q = new double[size * size];
     double * D = new double[size];
     double * buffer_alphas = new double[size * size];
 
     // generate random matrix
-    random_matrix(Q, size, size, seed);
+    random_matrix(Q, size, size, seed, RANDOM_STREAM_MATRIX);
 
     // orthonormalize the matrix columns using gram-schmidt
     gram_schmidt_recursive(Q, 0, size, size, buffer_alphas);
+    delete[] buffer_alphas;
 
     // generate random positive eigenvalues
-    random_matrix(D, size, 1, seed - 10);
+    random_matrix(D, size, 1, seed, RANDOM_STREAM_EIGENVALUES);
     for(size_t i = 0; i < size; i++)
     {
         D[i] = std::exp(3.5 * D[i]);
@@ -89,34 +136,361 @@ void random_spd_matrix(double * A, size_t size, int seed)
     // multiply Q*d
     for(size_t c = 0; c < size; c++)
     {
-        cblas_dscal(size, std::sqrt(D[c]), Q + c * size, 1);
+        dense_dscal(size, std::sqrt(D[c]), Q + c * size);
     }
 
-    // multiply (Q*d)*(Q*d)^T
-    cblas_dgemm(CblasColMajor, CblasNoTrans, CblasTrans, size, size, size, 1.0, Q, size, Q, size, 0.0, A, size);
+    // multiply (Q*d)*(Q*d)^T panel by panel
+    bool success = write_spd_panels(filename, format, Q, size, size, nullptr, panel_rows);
 
     delete[] Q;
     delete[] D;
+
+    return success;
+}
+
+
+
+bool write_low_rank_spd_matrix(const char * filename, matrix_format format, size_t size, size_t rank, double condition, int seed, size_t panel_rows)
+{
+    // A = Q*D*Qt + S with Q of orthonormal columns size x rank, D diagonal with entries spaced evenly
+    // in [0, condition - sqrt(condition)] and S diagonal with random entries in [1, sqrt(condition)]
+    // the eigenvalues of A lie in [1, condition], so its condition number is at most condition
+    // memory is O(size * rank) plus a panel, the time O(size^2 * rank)
+
+    double * Q = new double[size * rank];
+    double * buffer_alphas = new double[size * rank];
+    double * S = new double[size];
+
+    random_matrix(Q, size, rank, seed, RANDOM_STREAM_MATRIX);
+    gram_schmidt_recursive(Q, 0, rank, size, buffer_alphas);
     delete[] buffer_alphas;
+
+    double largest_low_rank = condition - std::sqrt(condition);
+    for(size_t c = 0; c < rank; c++)
+    {
+        dense_dscal(size, std::sqrt(largest_low_rank * (c + 1) / rank), Q + c * size);
+    }
+
+    random_matrix(S, size, 1, seed, RANDOM_STREAM_DIAGONAL);
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < size; i++)
+    {
+        S[i] = std::pow(condition, 0.25 * (S[i] + 1.0));
+    }
+
+    bool success = write_spd_panels(filename, format, Q, size, rank, S, panel_rows);
+
+    delete[] Q;
+    delete[] S;
+
+    return success;
 }
 
 
 
-bool write_matrix_to_file(const char * filename, const double * matrix, size_t num_rows, size_t num_cols)
+bool write_random_batch(const char * filename, size_t num_systems, size_t size, int seed)
 {
+    // num_systems independent systems in the batch format of batched_solver.h, generated in parallel
+    // in chunks of about 64 MB; system s uses the rows s * size ... (s + 1) * size - 1 of the streams
+    // every matrix is symmetric with off-diagonal entries in [-1, 1) and a diagonal 1 larger than the
+    // sum of the magnitudes of the rest of its row, so it is diagonally dominant and positive definite
+
     FILE * file = fopen(filename, "wb");
     if(file == nullptr)
     {
         fprintf(stderr, "Cannot open output file\n");
         return false;
     }
+    size_t header[3] = { MATRIX_TAG_BATCH, num_systems, size };
+    fwrite(header, sizeof(size_t), 3, file);
+
+    size_t system_size = size * size + size;
+    size_t chunk_systems = std::max<size_t>((size_t(1) << 23) / system_size, 1);
+    double * systems = new double[std::min(chunk_systems, num_systems) * system_size];
+    bool success = true;
+    for(size_t first = 0; first < num_systems && success; first += chunk_systems)
+    {
+        size_t count = std::min(chunk_systems, num_systems - first);
+        #pragma omp parallel for schedule(static)
+        for(size_t s = 0; s < count; s++)
+        {
+            double * A = systems + s * system_size;
+            double * b = A + size * size;
+            size_t row_offset = (first + s) * size;
+            for(size_t i = 0; i < size; i++)
+            {
+                double row_sum = 0.0;
+                for(size_t j = 0; j < size; j++)
+                {
+                    if(j == i) continue;
+                    A[i * size + j] = counter_random_uniform(static_cast<uint32_t>(seed), RANDOM_STREAM_MATRIX, row_offset + std::min(i, j), std::max(i, j));
+                    row_sum += std::fabs(A[i * size + j]);
+                }
+                A[i * size + i] = row_sum + 1.0;
+                b[i] = counter_random_uniform(static_cast<uint32_t>(seed), RANDOM_STREAM_RHS, row_offset + i, 0);
+            }
+        }
+        success = (fwrite(systems, sizeof(double), count * system_size, file) == count * system_size);
+    }
+    delete[] systems;
+
+    return close_matrix_file(file) && success;
+}
+
+
+
+enum generator_method
+{
+    METHOD_FULL,
+    METHOD_LOW_RANK,
+    METHOD_POISSON_2D,
+    METHOD_POISSON_3D,
+    METHOD_GRAPH,
+};
+
+
+
+const char * generator_method_name(generator_method method)
+{
+    switch(method)
+    {
+        case METHOD_FULL: return "full";
+        case METHOD_LOW_RANK: return "low-rank";
+        case METHOD_POISSON_2D: return "poisson2d";
+        case METHOD_POISSON_3D: return "poisson3d";
+        case METHOD_GRAPH: return "graph";
+    }
+    return "unknown";
+}
+
+
+
+bool parse_generator_method(const char * name, generator_method * method_out)
+{
+    if(strcmp(name, "full") == 0) { *method_out = METHOD_FULL; return true; }
+    if(strcmp(name, "low-rank") == 0) { *method_out = METHOD_LOW_RANK; return true; }
+    if(strcmp(name, "poisson2d") == 0) { *method_out = METHOD_POISSON_2D; return true; }
+    if(strcmp(name, "poisson3d") == 0) { *method_out = METHOD_POISSON_3D; return true; }
+    if(strcmp(name, "graph") == 0) { *method_out = METHOD_GRAPH; return true; }
+    return false;
+}
+
+
+
+void prefix_sum_row_ptr(size_t * row_ptr, size_t num_rows)
+{
+    // turns row_ptr[r + 1] = length of row r into the start of every row
+
+    row_ptr[0] = 0;
+    for(size_t r = 0; r < num_rows; r++)
+    {
+        row_ptr[r + 1] += row_ptr[r];
+    }
+}
+
+
+
+matrix_storage poisson_matrix(size_t nx, size_t ny, size_t nz, double anisotropy)
+{
+    // finite differences of -u_xx - u_yy (- u_zz) on an nx x ny (x nz) grid with zero boundary values,
+    // 5-point for nz = 1 and 7-point otherwise; the couplings of the last direction are scaled by anisotropy
+    // the points are numbered row by row and plane by plane, like laplacian_5point_dot,
+    // and the entries of every row are sorted by column
+
+    double wx = 1.0;
+    double wy = (nz > 1) ? 1.0 : anisotropy;
+    double wz = (nz > 1) ? anisotropy : 0.0;
+    size_t n = nx * ny * nz;
+    size_t plane = nx * ny;
+
+    matrix_storage matrix;
+    matrix.format = MATRIX_FORMAT_CSR;
+    matrix.num_rows = n;
+    matrix.num_cols = n;
+    matrix.row_ptr = new size_t[n + 1];
+
+    // the neighbours of a point, in the order of their columns
+    auto for_each_entry = [&](size_t r, auto && entry)
+    {
+        size_t ix = r % nx;
+        size_t iy = (r / nx) % ny;
+        size_t iz = r / plane;
+        if(iz > 0) entry(r - plane, -wz);
+        if(iy > 0) entry(r - nx, -wy);
+        if(ix > 0) entry(r - 1, -wx);
+        entry(r, 2.0 * (wx + wy + wz));
+        if(ix + 1 < nx) entry(r + 1, -wx);
+        if(iy + 1 < ny) entry(r + nx, -wy);
+        if(iz + 1 < nz) entry(r + plane, -wz);
+    };
+
+    #pragma omp parallel for schedule(static)
+    for(size_t r = 0; r < n; r++)
+    {
+        size_t count = 0;
+        for_each_entry(r, [&](size_t, double) { count++; });
+        matrix.row_ptr[r + 1] = count;
+    }
+    prefix_sum_row_ptr(matrix.row_ptr, n);
+    matrix.num_nonzeros = matrix.row_ptr[n];
+
+    allocate_matrix_storage(&matrix);
+    #pragma omp parallel for schedule(static)
+    for(size_t r = 0; r < n; r++)
+    {
+        size_t k = matrix.row_ptr[r];
+        for_each_entry(r, [&](size_t col, double value)
+        {
+            matrix.col_idx[k] = static_cast<uint32_t>(col);
+            matrix.data[k] = value;
+            k++;
+        });
+    }
+
+    return matrix;
+}
+
+
+
+matrix_storage graph_laplacian_matrix(size_t n, size_t degree, double shift, int seed)
+{
+    // L + shift * I for the Laplacian L of a random graph: every vertex draws degree / 2 random partners
+    // and is connected to them, so the average degree is degree; an edge drawn twice gets weight 2
+    // the partners are counter-based random numbers and the rows are sorted, so the matrix only
+    // depends on the seed, while the rows are filled in parallel
+
+    size_t half = (n > 1) ? std::max<size_t>(degree / 2, 1) : 0;
+    auto partner = [&](size_t i, size_t k)
+    {
+        return (i + 1 + counter_random_bits(static_cast<uint32_t>(seed), RANDOM_STREAM_GRAPH, i, k) % (n - 1)) % n;
+    };
+
+    // every row holds the partners it drew, followed by the vertices that drew it
+    size_t * edge_ptr = new size_t[n + 1];
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i <= n; i++)
+    {
+        edge_ptr[i] = (i > 0) ? half : 0;
+    }
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < n; i++)
+    {
+        for(size_t k = 0; k < half; k++)
+        {
+            size_t j = partner(i, k);
+            #pragma omp atomic
+            edge_ptr[j + 1]++;
+        }
+    }
+    prefix_sum_row_ptr(edge_ptr, n);
 
-    fwrite(&num_rows, sizeof(size_t), 1, file);
-    fwrite(&num_cols, sizeof(size_t), 1, file);
-    fwrite(matrix, sizeof(double), num_rows * num_cols, file);
+    uint32_t * edges = new uint32_t[edge_ptr[n]];
+    size_t * edge_end = new size_t[n];
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < n; i++)
+    {
+        for(size_t k = 0; k < half; k++)
+        {
+            edges[edge_ptr[i] + k] = static_cast<uint32_t>(partner(i, k));
+        }
+        edge_end[i] = edge_ptr[i] + half;
+    }
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < n; i++)
+    {
+        for(size_t k = 0; k < half; k++)
+        {
+            size_t j = partner(i, k);
+            size_t position;
+            #pragma omp atomic capture
+            position = edge_end[j]++;
+            edges[position] = static_cast<uint32_t>(i);
+        }
+    }
 
-    fclose(file);
+    // sort every row and merge repeated edges; a row keeps its distinct neighbours and the diagonal
+    matrix_storage matrix;
+    matrix.format = MATRIX_FORMAT_CSR;
+    matrix.num_rows = n;
+    matrix.num_cols = n;
+    matrix.row_ptr = new size_t[n + 1];
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < n; i++)
+    {
+        uint32_t * row = edges + edge_ptr[i];
+        size_t length = edge_ptr[i + 1] - edge_ptr[i];
+        std::sort(row, row + length);
+        size_t distinct = 0;
+        for(size_t k = 0; k < length; k++)
+        {
+            if(k == 0 || row[k] != row[k - 1]) distinct++;
+        }
+        matrix.row_ptr[i + 1] = distinct + 1;
+    }
+    prefix_sum_row_ptr(matrix.row_ptr, n);
+    matrix.num_nonzeros = matrix.row_ptr[n];
 
+    allocate_matrix_storage(&matrix);
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < n; i++)
+    {
+        const uint32_t * row = edges + edge_ptr[i];
+        size_t length = edge_ptr[i + 1] - edge_ptr[i];
+        size_t k = matrix.row_ptr[i];
+        bool diagonal_done = false;
+        for(size_t e = 0; e < length; e++)
+        {
+            if(!diagonal_done && row[e] > i)
+            {
+                matrix.col_idx[k] = static_cast<uint32_t>(i);
+                matrix.data[k] = static_cast<double>(length) + shift;
+                k++;
+                diagonal_done = true;
+            }
+            if(e > 0 && row[e] == row[e - 1])
+            {
+                matrix.data[k - 1] -= 1.0;
+                continue;
+            }
+            matrix.col_idx[k] = row[e];
+            matrix.data[k] = -1.0;
+            k++;
+        }
+        if(!diagonal_done)
+        {
+            matrix.col_idx[k] = static_cast<uint32_t>(i);
+            matrix.data[k] = static_cast<double>(length) + shift;
+        }
+    }
+
+    delete[] edge_ptr;
+    delete[] edges;
+    delete[] edge_end;
+
+    return matrix;
+}
+
+
+
+bool parse_grid(const char * text, size_t * nx_out, size_t * ny_out, size_t * nz_out)
+{
+    // NXxNY or NXxNYxNZ, nz is 0 for NXxNY; the whole text has to be consumed
+
+    unsigned long long nx;
+    unsigned long long ny;
+    unsigned long long nz = 0;
+    int length = 0;
+    if(strspn(text, "0123456789x") != strlen(text)) return false;
+    if(sscanf(text, "%llux%llu%n", &nx, &ny, &length) != 2) return false;
+    if(text[length] != '\0')
+    {
+        length = 0;
+        if(sscanf(text, "%llux%llux%llu%n", &nx, &ny, &nz, &length) != 3 || text[length] != '\0' || nz == 0) return false;
+    }
+    if(nx == 0 || ny == 0) return false;
+    *nx_out = static_cast<size_t>(nx);
+    *ny_out = static_cast<size_t>(ny);
+    *nz_out = static_cast<size_t>(nz);
     return true;
 }
 
@@ -126,28 +500,161 @@ bool write_matrix_to_file(const char * filename, const double * matrix, size_t n
 
 int main(int argc, char ** argv)
 {
-    printf("Usage: ./random_spd_system matrix_size output_file_matrix.bin output_file_rhs.bin random_seed\n");
+    printf("Usage: ./random_spd_system matrix_size output_file_matrix.bin output_file_rhs.bin random_seed matrix_format [options]\n");
     printf("All parameters are optional and have default values\n");
+    printf("matrix_format is dense (full row-major matrix) or packed (upper triangle only)\n");
+    printf("Options:\n");
+    printf("  --method full|low-rank|poisson2d|poisson3d|graph\n");
+    printf("                full: Q*D*Q^T with a random orthogonal Q, O(n^3) time and n^2 memory (default)\n");
+    printf("                low-rank: a rank-k Q*D*Q^T plus a random diagonal, O(n^2*k) time and O(n*k) memory\n");
+    printf("                poisson2d, poisson3d: 5-point and 7-point finite differences on a grid, written as CSR\n");
+    printf("                graph: shifted Laplacian of a random graph, written as CSR\n");
+    printf("  --rank K      rank of the low-rank part (default: 32)\n");
+    printf("  --condition C upper bound on the condition number of the low-rank method (default: 1000)\n");
+    printf("  --grid NXxNY or NXxNYxNZ\n");
+    printf("                grid of poisson2d and poisson3d (default: a square or cube grid of about matrix_size points)\n");
+    printf("  --anisotropy E\n");
+    printf("                weight of the couplings in the y direction (2D) or z direction (3D) of the Poisson methods (default: 1)\n");
+    printf("  --degree D    average number of neighbours of a vertex of the graph method (default: 8)\n");
+    printf("  --shift S     added to the diagonal of the graph Laplacian to make it positive definite (default: 0.1)\n");
+    printf("  --batch N     write N independent systems of matrix_size with their right-hand sides to output_file_matrix\n");
+    printf("                as a batch file of batched_conjugate_gradients instead of a single system\n");
+    printf("  --panel-rows N\n");
+    printf("                rows of the panels the matrix is written in (default: about 64 MB)\n");
     printf("\n");
 
     const char * output_file_matrix = "io/matrix.bin";
     const char * output_file_rhs = "io/rhs.bin";
     size_t size = 10;
     int seed = time(nullptr);
-
-    if(argc > 1) size = static_cast<size_t>(atoll(argv[1]));
-    if(argc > 2) output_file_matrix = argv[2];
-    if(argc > 3) output_file_rhs = argv[3];
-    if(argc > 4) seed = atoi(argv[4]);
+    matrix_format format = MATRIX_FORMAT_DENSE;
+    generator_method method = METHOD_FULL;
+    size_t rank = 32;
+    double condition = 1000.0;
+    size_t grid_nx = 0;
+    size_t grid_ny = 0;
+    size_t grid_nz = 0;
+    double anisotropy = 1.0;
+    size_t degree = 8;
+    double shift = 0.1;
+    size_t panel_rows = 0;
+    size_t num_systems = 0;
+
+    int num_positional = 0;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--method") == 0 && i + 1 < argc)
+        {
+            if(!parse_generator_method(argv[++i], &method))
+            {
+                fprintf(stderr, "Unknown method %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if(strcmp(argv[i], "--grid") == 0 && i + 1 < argc)
+        {
+            if(!parse_grid(argv[++i], &grid_nx, &grid_ny, &grid_nz))
+            {
+                fprintf(stderr, "Wrong grid %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if(strcmp(argv[i], "--anisotropy") == 0 && i + 1 < argc) { anisotropy = atof(argv[++i]); continue; }
+        if(strcmp(argv[i], "--degree") == 0 && i + 1 < argc) { degree = static_cast<size_t>(atoll(argv[++i])); continue; }
+        if(strcmp(argv[i], "--shift") == 0 && i + 1 < argc) { shift = atof(argv[++i]); continue; }
+        if(strcmp(argv[i], "--rank") == 0 && i + 1 < argc) { rank = static_cast<size_t>(atoll(argv[++i])); continue; }
+        if(strcmp(argv[i], "--condition") == 0 && i + 1 < argc) { condition = atof(argv[++i]); continue; }
+        if(strcmp(argv[i], "--panel-rows") == 0 && i + 1 < argc) { panel_rows = static_cast<size_t>(atoll(argv[++i])); continue; }
+        if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc) { num_systems = static_cast<size_t>(atoll(argv[++i])); continue; }
+
+        num_positional++;
+        if(num_positional == 1) size = static_cast<size_t>(atoll(argv[i]));
+        if(num_positional == 2) output_file_matrix = argv[i];
+        if(num_positional == 3) output_file_rhs = argv[i];
+        if(num_positional == 4) seed = atoi(argv[i]);
+        if(num_positional == 5 && !parse_matrix_format(argv[i], &format))
+        {
+            fprintf(stderr, "Unknown matrix format %s\n", argv[i]);
+            return 1;
+        }
+    }
+    bool sparse = (method == METHOD_POISSON_2D || method == METHOD_POISSON_3D || method == METHOD_GRAPH);
+    if(num_systems > 0 && method != METHOD_FULL)
+    {
+        fprintf(stderr, "--batch generates its own systems and cannot be combined with --method\n");
+        return 1;
+    }
+    if(method == METHOD_POISSON_2D && grid_nx == 0)
+    {
+        grid_nx = std::max<size_t>(static_cast<size_t>(std::sqrt(static_cast<double>(size)) + 0.5), 1);
+        grid_ny = grid_nx;
+    }
+    if(method == METHOD_POISSON_3D && grid_nx == 0)
+    {
+        grid_nx = std::max<size_t>(static_cast<size_t>(std::cbrt(static_cast<double>(size)) + 0.5), 1);
+        grid_ny = grid_nx;
+        grid_nz = grid_nx;
+    }
+    if(method == METHOD_POISSON_2D && grid_nz != 0)
+    {
+        fprintf(stderr, "poisson2d needs a grid NXxNY\n");
+        return 1;
+    }
+    if(method == METHOD_POISSON_3D && grid_nz == 0)
+    {
+        fprintf(stderr, "poisson3d needs a grid NXxNYxNZ\n");
+        return 1;
+    }
+    if(method == METHOD_POISSON_2D) grid_nz = 1;
+    if(method == METHOD_POISSON_2D || method == METHOD_POISSON_3D) size = grid_nx * grid_ny * grid_nz;
+    if(sparse && format != MATRIX_FORMAT_CSR)
+    {
+        printf("The %s method writes a CSR matrix\n", generator_method_name(method));
+        format = MATRIX_FORMAT_CSR;
+    }
+    if(panel_rows == 0) panel_rows = default_panel_rows(size);
+    rank = std::min(rank, size);
 
     printf("Command line arguments:\n");
     printf("  matrix_size:        %zu\n", size);
     printf("  output_file_matrix: %s\n", output_file_matrix);
     printf("  output_file_rhs:    %s\n", output_file_rhs);
     printf("  seed:               %d\n", seed);
+    printf("  matrix_format:      %s\n", matrix_format_name(format));
+    printf("  method:             %s\n", (num_systems > 0) ? "batch" : generator_method_name(method));
+    if(num_systems > 0) printf("  num_systems:        %zu\n", num_systems);
+    if(method == METHOD_LOW_RANK)
+    {
+        printf("  rank:               %zu\n", rank);
+        printf("  condition:          %e\n", condition);
+    }
+    if(method == METHOD_POISSON_2D || method == METHOD_POISSON_3D)
+    {
+        printf("  grid:               %zu x %zu x %zu\n", grid_nx, grid_ny, grid_nz);
+        printf("  anisotropy:         %e\n", anisotropy);
+    }
+    if(method == METHOD_GRAPH)
+    {
+        printf("  degree:             %zu\n", degree);
+        printf("  shift:              %e\n", shift);
+    }
+    if(!sparse)
+    {
+        printf("  panel_rows:         %zu\n", panel_rows);
+        printf("  blas:               %s\n", dense_blas_backend_name());
+        printf("  simd:               %s\n", simd_isa_name(active_simd_isa()));
+    }
     printf("\n");
 
-    if((ssize_t)size <= 0)
+    bool valid = (ssize_t)size > 0;
+    if(sparse) valid = valid && size <= UINT32_MAX;
+    else valid = valid && (format == MATRIX_FORMAT_DENSE || format == MATRIX_FORMAT_PACKED_SYMMETRIC);
+    if(method == METHOD_LOW_RANK) valid = valid && rank > 0 && condition >= 1.0;
+    if(method == METHOD_POISSON_2D || method == METHOD_POISSON_3D) valid = valid && anisotropy > 0.0;
+    if(method == METHOD_GRAPH) valid = valid && shift > 0.0;
+    if(!valid)
     {
         fprintf(stderr, "Wrong argument value\n");
         return 1;
@@ -155,20 +662,41 @@ int main(int argc, char ** argv)
 
 
 
-    printf("Generating the matrix ...\n");
-    double * matrix = new double[size * size];
-    random_spd_matrix(matrix, size, seed);
-    printf("Done\n");
-    printf("\n");
+    if(num_systems > 0)
+    {
+        printf("Generating the batch and writing it to file ...\n");
+        if(!write_random_batch(output_file_matrix, num_systems, size, seed))
+        {
+            fprintf(stderr, "Failed to save batch\n");
+            return 2;
+        }
+        printf("Done\n");
+        printf("\n");
 
-    printf("Generating the right hand side ...\n");
-    double * rhs = new double[size];
-    random_matrix(rhs, size, 1, seed+10);
-    printf("Done\n");
-    printf("\n");
+        printf("Finished successfully\n");
+
+        return 0;
+    }
 
-    printf("Writing matrix to file ...\n");
-    bool success_write_matrix = write_matrix_to_file(output_file_matrix, matrix, size, size);
+    printf("Generating the matrix and writing it to file ...\n");
+    bool success_write_matrix;
+    if(sparse)
+    {
+        matrix_storage matrix;
+        if(method == METHOD_GRAPH) matrix = graph_laplacian_matrix(size, degree, shift, seed);
+        else matrix = poisson_matrix(grid_nx, grid_ny, grid_nz, anisotropy);
+        printf("Number of nonzeros: %zu (%.2f per row)\n", matrix.num_nonzeros, static_cast<double>(matrix.num_nonzeros) / size);
+        success_write_matrix = write_matrix_to_file(output_file_matrix, matrix);
+        free_matrix_storage(&matrix);
+    }
+    else if(method == METHOD_LOW_RANK)
+    {
+        success_write_matrix = write_low_rank_spd_matrix(output_file_matrix, format, size, rank, condition, seed, panel_rows);
+    }
+    else
+    {
+        success_write_matrix = write_random_spd_matrix(output_file_matrix, format, size, seed, panel_rows);
+    }
     if(!success_write_matrix)
     {
         fprintf(stderr, "Failed to save matrix\n");
@@ -177,6 +705,12 @@ int main(int argc, char ** argv)
     printf("Done\n");
     printf("\n");
 
+    printf("Generating the right hand side ...\n");
+    double * rhs = new double[size];
+    random_matrix(rhs, size, 1, seed, RANDOM_STREAM_RHS);
+    printf("Done\n");
+    printf("\n");
+
     printf("Writing right hand side to file ...\n");
     bool success_write_rhs = write_matrix_to_file(output_file_rhs, rhs, size, 1);
     if(!success_write_rhs)
@@ -187,7 +721,6 @@ int main(int argc, char ** argv)
     printf("Done\n");
     printf("\n");
 
-    delete[] matrix;
     delete[] rhs;
 
     printf("Finished successfully\n");
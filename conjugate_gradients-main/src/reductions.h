@@ -0,0 +1,216 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+
+// Parallel reductions
+//
+// plain:        every thread sums its contiguous part of the data and OpenMP adds up the results
+//               of the threads; the order of the sums changes with the number of threads
+// pairwise:     the data is split into chunks of a fixed size, independent of the number of threads;
+//               the sum of every chunk is computed by the same code whichever thread runs it, and the
+//               chunk sums are added up by a pairwise tree whose shape only depends on the number of
+//               chunks, so the result is bit for bit the same for any number of threads
+// compensated:  the chunks of pairwise, with the chunk sums added up by Neumaier's compensated
+//               summation; dot products also use it within the chunks (the compensated_dot
+//               kernels of simd_kernels.h)
+//
+// The kernels pass the work of a range of their index space (elements, rows, blocks) to
+// reduce_ranges, together with a chunk size in the same units. The results of pairwise and
+// compensated still depend on the instruction set of the SIMD kernels. The mode is chosen once
+// per process: the environment variable CG_REDUCTION=plain|pairwise|compensated, or
+// active_reduction_mode() set by the programs.
+
+enum reduction_mode
+{
+    REDUCTION_PLAIN,
+    REDUCTION_PAIRWISE,
+    REDUCTION_COMPENSATED,
+};
+
+// elements of a vector per chunk of the deterministic reductions, 32 KB of double precision data
+const size_t REDUCTION_CHUNK_SIZE = 4096;
+
+
+
+inline const char * reduction_mode_name(reduction_mode mode)
+{
+    switch(mode)
+    {
+        case REDUCTION_PLAIN: return "plain";
+        case REDUCTION_PAIRWISE: return "pairwise";
+        case REDUCTION_COMPENSATED: return "compensated";
+    }
+    return "unknown";
+}
+
+
+
+inline bool parse_reduction_mode(const char * name, reduction_mode * mode_out)
+{
+    if(strcmp(name, "plain") == 0) { *mode_out = REDUCTION_PLAIN; return true; }
+    if(strcmp(name, "pairwise") == 0) { *mode_out = REDUCTION_PAIRWISE; return true; }
+    if(strcmp(name, "compensated") == 0) { *mode_out = REDUCTION_COMPENSATED; return true; }
+    return false;
+}
+
+
+
+inline reduction_mode default_reduction_mode()
+{
+    const char * name = getenv("CG_REDUCTION");
+    reduction_mode mode = REDUCTION_PLAIN;
+    if(name != nullptr && !parse_reduction_mode(name, &mode))
+    {
+        fprintf(stderr, "Unknown reduction mode %s in CG_REDUCTION, using plain reductions\n", name);
+    }
+    return mode;
+}
+
+
+
+inline reduction_mode & active_reduction_mode()
+{
+    static reduction_mode mode = default_reduction_mode();
+    return mode;
+}
+
+
+
+inline void static_thread_range(size_t size, size_t * begin, size_t * end)
+{
+    // the contiguous part of [0, size) that schedule(static) assigns to the calling thread, so that
+    // the SIMD kernels touch the same pages as the loops that initialized the data
+
+    size_t thread = 0;
+    size_t num_threads = 1;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+    num_threads = omp_get_num_threads();
+#endif
+    size_t chunk = size / num_threads;
+    size_t remainder = size % num_threads;
+    *begin = thread * chunk + std::min(thread, remainder);
+    *end = *begin + chunk + ((thread < remainder) ? 1 : 0);
+}
+
+
+
+inline double pairwise_sum(const double * values, size_t count, size_t stride)
+{
+    // sum of values[i * stride] for i < count by a tree that only depends on count
+
+    if(count == 0) return 0.0;
+    if(count == 1) return values[0];
+    size_t half = count / 2;
+    return pairwise_sum(values, half, stride) + pairwise_sum(values + half * stride, count - half, stride);
+}
+
+
+
+inline void neumaier_add(double value, double * sum, double * compensation)
+{
+    // adds value to sum and the rounding error of the addition to compensation
+
+    double t = *sum + value;
+    if(std::fabs(*sum) >= std::fabs(value)) *compensation += (*sum - t) + value;
+    else *compensation += (value - t) + *sum;
+    *sum = t;
+}
+
+
+
+inline double compensated_sum(const double * values, size_t count, size_t stride)
+{
+    // sum of values[i * stride] for i < count by Neumaier's compensated summation
+
+    double sum = 0.0;
+    double compensation = 0.0;
+    for(size_t i = 0; i < count; i++)
+    {
+        neumaier_add(values[i * stride], &sum, &compensation);
+    }
+    return sum + compensation;
+}
+
+
+
+inline double * reduction_buffer(size_t size)
+{
+    // scratch space for the chunk sums, kept and reused by the calling thread, so that the
+    // deterministic reductions do not allocate memory in every call
+
+    thread_local std::vector<double> buffer;
+    if(buffer.size() < size) buffer.resize(size);
+    return buffer.data();
+}
+
+
+
+template<typename range_sums>
+inline void reduce_ranges(size_t size, size_t chunk_size, size_t num_sums, range_sums sums_of_range, double * result)
+{
+    // result[k] = sum over [0, size) of the k-th sum of sums_of_range(begin, end, partial), which adds
+    // num_sums values for the range [begin, end) to partial; the ranges are the parts of the threads
+    // or chunks of chunk_size, depending on the active reduction mode
+
+    for(size_t k = 0; k < num_sums; k++)
+    {
+        result[k] = 0.0;
+    }
+
+    reduction_mode mode = active_reduction_mode();
+    if(mode == REDUCTION_PLAIN)
+    {
+        #pragma omp parallel reduction(+:result[:num_sums])
+        {
+            size_t begin, end;
+            static_thread_range(size, &begin, &end);
+            sums_of_range(begin, end, result);
+        }
+        return;
+    }
+
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    size_t num_chunks = (size + chunk_size - 1) / chunk_size;
+    double * partials = reduction_buffer(num_chunks * num_sums);
+    #pragma omp parallel for schedule(static)
+    for(size_t c = 0; c < num_chunks; c++)
+    {
+        double * partial = partials + c * num_sums;
+        for(size_t k = 0; k < num_sums; k++)
+        {
+            partial[k] = 0.0;
+        }
+        sums_of_range(c * chunk_size, std::min(size, (c + 1) * chunk_size), partial);
+    }
+
+    for(size_t k = 0; k < num_sums; k++)
+    {
+        if(mode == REDUCTION_COMPENSATED) result[k] = compensated_sum(partials + k, num_chunks, num_sums);
+        else result[k] = pairwise_sum(partials + k, num_chunks, num_sums);
+    }
+}
+
+
+
+template<typename range_sum>
+inline double reduce_range(size_t size, size_t chunk_size, range_sum sum_of_range)
+{
+    // reduce_ranges for a single sum, sum_of_range(begin, end) returns the sum of a range
+
+    double result;
+    reduce_ranges(size, chunk_size, 1, [&](size_t begin, size_t end, double * partial) { partial[0] += sum_of_range(begin, end); }, &result);
+    return result;
+}
@@ -0,0 +1,453 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+
+
+// Explicit SIMD kernels with runtime dispatch
+//
+// The kernels are written once as templates over the number W of double precision lanes, using
+// the vector extensions of GCC and Clang, and are instantiated in functions compiled for AVX-512
+// (W = 8), AVX2 (W = 4) and for the baseline instruction set (W = 1, the scalar fallback). The
+// instruction set is chosen once at run time from the features of the CPU, so a single binary
+// uses the widest vectors the node supports. The environment variable CG_SIMD=scalar|avx2|avx512
+// selects a narrower instruction set, e.g. for comparisons.
+//
+// Single precision data is converted to double on load, so that products and sums are computed
+// in double precision like in the scalar kernels. Every kernel keeps several independent
+// accumulators, which reorders the sums: the results agree with the scalar loops up to rounding.
+// The kernels work on a range of the data; the threads are distributed by the callers in cg_kernels.h.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+#define SIMD_INLINE inline __attribute__((always_inline))
+
+enum simd_isa
+{
+    SIMD_SCALAR,
+    SIMD_AVX2,
+    SIMD_AVX512,
+};
+
+template<typename real, size_t W>
+struct simd_vector
+{
+    typedef real type __attribute__((vector_size(sizeof(real) * W)));
+};
+
+template<typename real>
+struct simd_kernel_table
+{
+    double (*dot)(const real * x, const real * y, size_t size);
+    double (*compensated_dot)(const real * x, const real * y, size_t size);
+    void (*axpby)(double alpha, const real * x, double beta, real * y, size_t size);
+    void (*gemv)(double alpha, const real * A, const real * x, double beta, real * y, size_t num_rows, size_t num_cols);
+    double (*gemv_dot)(const real * A, const real * x, const real * x_rows, real * y, size_t num_rows, size_t num_cols);
+};
+
+
+
+inline const char * simd_isa_name(simd_isa isa)
+{
+    switch(isa)
+    {
+        case SIMD_SCALAR: return "scalar";
+        case SIMD_AVX2: return "avx2";
+        case SIMD_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+
+
+inline bool parse_simd_isa(const char * name, simd_isa * isa)
+{
+    if(strcmp(name, "scalar") == 0) { *isa = SIMD_SCALAR; return true; }
+    if(strcmp(name, "avx2") == 0) { *isa = SIMD_AVX2; return true; }
+    if(strcmp(name, "avx512") == 0) { *isa = SIMD_AVX512; return true; }
+    return false;
+}
+
+
+
+inline bool simd_isa_supported(simd_isa isa)
+{
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if(isa == SIMD_AVX512) return __builtin_cpu_supports("avx512f");
+    if(isa == SIMD_AVX2) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    return isa == SIMD_SCALAR;
+}
+
+
+
+inline simd_isa default_simd_isa()
+{
+    // the widest supported instruction set, unless CG_SIMD asks for another supported one
+
+    simd_isa isa = SIMD_SCALAR;
+    if(simd_isa_supported(SIMD_AVX2)) isa = SIMD_AVX2;
+    if(simd_isa_supported(SIMD_AVX512)) isa = SIMD_AVX512;
+
+    const char * requested_name = getenv("CG_SIMD");
+    simd_isa requested;
+    if(requested_name != nullptr && parse_simd_isa(requested_name, &requested) && simd_isa_supported(requested))
+    {
+        isa = requested;
+    }
+    return isa;
+}
+
+
+
+inline simd_isa & active_simd_isa()
+{
+    static simd_isa isa = default_simd_isa();
+    return isa;
+}
+
+
+
+template<size_t W>
+SIMD_INLINE void simd_load(typename simd_vector<double, W>::type & v, const double * p)
+{
+    memcpy(&v, p, sizeof(v));
+}
+
+
+
+template<size_t W>
+SIMD_INLINE void simd_load(typename simd_vector<double, W>::type & v, const float * p)
+{
+    typename simd_vector<float, W>::type v_float;
+    memcpy(&v_float, p, sizeof(v_float));
+    v = __builtin_convertvector(v_float, typename simd_vector<double, W>::type);
+}
+
+
+
+template<size_t W>
+SIMD_INLINE void simd_store(double * p, const typename simd_vector<double, W>::type & v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+
+
+template<size_t W>
+SIMD_INLINE void simd_store(float * p, const typename simd_vector<double, W>::type & v)
+{
+    typename simd_vector<float, W>::type v_float = __builtin_convertvector(v, typename simd_vector<float, W>::type);
+    memcpy(p, &v_float, sizeof(v_float));
+}
+
+
+
+template<size_t W>
+SIMD_INLINE double simd_sum(const typename simd_vector<double, W>::type & v)
+{
+    double result = 0.0;
+    for(size_t k = 0; k < W; k++)
+    {
+        result += v[k];
+    }
+    return result;
+}
+
+
+
+template<size_t W, typename real>
+SIMD_INLINE double simd_dot(const real * x, const real * y, size_t size)
+{
+    // four accumulators hide the latency of the multiply-adds
+
+    typedef typename simd_vector<double, W>::type vector;
+    vector acc[4] = {};
+    size_t i = 0;
+    for(; i + 4 * W <= size; i += 4 * W)
+    {
+        for(size_t k = 0; k < 4; k++)
+        {
+            vector x_vec, y_vec;
+            simd_load<W>(x_vec, x + i + k * W);
+            simd_load<W>(y_vec, y + i + k * W);
+            acc[k] += x_vec * y_vec;
+        }
+    }
+    for(; i + W <= size; i += W)
+    {
+        vector x_vec, y_vec;
+        simd_load<W>(x_vec, x + i);
+        simd_load<W>(y_vec, y + i);
+        acc[0] += x_vec * y_vec;
+    }
+
+    double result = simd_sum<W>((acc[0] + acc[1]) + (acc[2] + acc[3]));
+    for(; i < size; i++)
+    {
+        result += static_cast<double>(x[i]) * y[i];
+    }
+    return result;
+}
+
+
+
+template<size_t W>
+SIMD_INLINE void simd_neumaier_add(const typename simd_vector<double, W>::type & value, typename simd_vector<double, W>::type & sum, typename simd_vector<double, W>::type & compensation)
+{
+    // adds value to sum and the rounding error of the addition to compensation, lane by lane
+
+    typedef typename simd_vector<double, W>::type vector;
+    vector t = sum + value;
+    vector abs_sum = (sum < 0.0) ? -sum : sum;
+    vector abs_value = (value < 0.0) ? -value : value;
+    compensation += (abs_sum >= abs_value) ? (sum - t) + value : (value - t) + sum;
+    sum = t;
+}
+
+
+
+template<size_t W, typename real>
+SIMD_INLINE double simd_compensated_dot(const real * x, const real * y, size_t size)
+{
+    // dot(x, y) with Neumaier's compensated summation of the products; two pairs of accumulators
+    // hide the latency of the additions
+
+    typedef typename simd_vector<double, W>::type vector;
+    vector sum[2] = {};
+    vector compensation[2] = {};
+    size_t i = 0;
+    for(; i + 2 * W <= size; i += 2 * W)
+    {
+        for(size_t k = 0; k < 2; k++)
+        {
+            vector x_vec, y_vec;
+            simd_load<W>(x_vec, x + i + k * W);
+            simd_load<W>(y_vec, y + i + k * W);
+            simd_neumaier_add<W>(x_vec * y_vec, sum[k], compensation[k]);
+        }
+    }
+
+    typedef typename simd_vector<double, 1>::type scalar;
+    scalar total = {};
+    scalar total_compensation = {};
+    for(size_t k = 0; k < 2; k++)
+    {
+        for(size_t j = 0; j < W; j++)
+        {
+            scalar value = { sum[k][j] };
+            simd_neumaier_add<1>(value, total, total_compensation);
+            total_compensation[0] += compensation[k][j];
+        }
+    }
+    for(; i < size; i++)
+    {
+        scalar value = { static_cast<double>(x[i]) * y[i] };
+        simd_neumaier_add<1>(value, total, total_compensation);
+    }
+    return total[0] + total_compensation[0];
+}
+
+
+
+template<size_t W, typename real>
+SIMD_INLINE void simd_axpby(double alpha, const real * x, double beta, real * y, size_t size)
+{
+    // y = alpha * x + beta * y
+
+    typedef typename simd_vector<double, W>::type vector;
+    size_t i = 0;
+    for(; i + W <= size; i += W)
+    {
+        vector x_vec, y_vec;
+        simd_load<W>(x_vec, x + i);
+        simd_load<W>(y_vec, y + i);
+        simd_store<W>(y + i, alpha * x_vec + beta * y_vec);
+    }
+    for(; i < size; i++)
+    {
+        y[i] = alpha * x[i] + beta * y[i];
+    }
+}
+
+
+
+// register and cache blocking of gemv: SIMD_GEMV_ROWS rows are multiplied at once, so that every
+// loaded block of x serves all of them, and the columns are split into tiles of SIMD_GEMV_TILE_COLS,
+// so that the tile of x (8 KB in double precision) stays in the L1 cache while the SIMD_GEMV_TILE_ROWS
+// rows of a block use it; the rows are still streamed from memory only once
+const size_t SIMD_GEMV_ROWS = 4;
+const size_t SIMD_GEMV_TILE_COLS = 1024;
+const size_t SIMD_GEMV_TILE_ROWS = 64;
+
+template<size_t W, size_t R, typename real>
+SIMD_INLINE void simd_row_dots(const real * A, const real * x, size_t num_cols, size_t ld, double * sums)
+{
+    // sums[k] += dot(A[k][0 : num_cols], x) for R consecutive rows with leading dimension ld; every
+    // loaded block of x serves all R rows, and two accumulators per row give 2 * R independent multiply-adds
+
+    typedef typename simd_vector<double, W>::type vector;
+    vector acc[2 * R] = {};
+    size_t c = 0;
+    for(; c + 2 * W <= num_cols; c += 2 * W)
+    {
+        vector x_0, x_1;
+        simd_load<W>(x_0, x + c);
+        simd_load<W>(x_1, x + c + W);
+        for(size_t k = 0; k < R; k++)
+        {
+            vector a_0, a_1;
+            simd_load<W>(a_0, A + k * ld + c);
+            simd_load<W>(a_1, A + k * ld + c + W);
+            acc[2 * k] += a_0 * x_0;
+            acc[2 * k + 1] += a_1 * x_1;
+        }
+    }
+
+    for(size_t k = 0; k < R; k++)
+    {
+        double sum = simd_sum<W>(acc[2 * k] + acc[2 * k + 1]);
+        for(size_t j = c; j < num_cols; j++)
+        {
+            sum += static_cast<double>(A[k * ld + j]) * x[j];
+        }
+        sums[k] += sum;
+    }
+}
+
+
+
+template<size_t W, typename real>
+SIMD_INLINE void simd_row_block_dots(const real * A, const real * x, size_t num_rows, size_t num_cols, double * sums)
+{
+    // sums[k] = dot(A[k][:], x) for num_rows <= SIMD_GEMV_TILE_ROWS rows, one tile of columns at a time
+
+    const size_t R = SIMD_GEMV_ROWS;
+    for(size_t k = 0; k < num_rows; k++)
+    {
+        sums[k] = 0.0;
+    }
+    for(size_t c = 0; c < num_cols; c += SIMD_GEMV_TILE_COLS)
+    {
+        size_t tile_cols = std::min(SIMD_GEMV_TILE_COLS, num_cols - c);
+        size_t k = 0;
+        for(; k + R <= num_rows; k += R)
+        {
+            simd_row_dots<W, R>(A + k * num_cols + c, x + c, tile_cols, num_cols, sums + k);
+        }
+        for(; k < num_rows; k++)
+        {
+            simd_row_dots<W, 1>(A + k * num_cols + c, x + c, tile_cols, num_cols, sums + k);
+        }
+    }
+}
+
+
+
+template<size_t W, typename real>
+SIMD_INLINE void simd_gemv(double alpha, const real * A, const real * x, double beta, real * y, size_t num_rows, size_t num_cols)
+{
+    // y = alpha * A * x + beta * y; alpha is applied once per row instead of once per entry
+
+    double sums[SIMD_GEMV_TILE_ROWS];
+    for(size_t r = 0; r < num_rows; r += SIMD_GEMV_TILE_ROWS)
+    {
+        size_t block_rows = std::min(SIMD_GEMV_TILE_ROWS, num_rows - r);
+        simd_row_block_dots<W>(A + r * num_cols, x, block_rows, num_cols, sums);
+        for(size_t k = 0; k < block_rows; k++)
+        {
+            y[r + k] = beta * y[r + k] + alpha * sums[k];
+        }
+    }
+}
+
+
+
+template<size_t W, typename real>
+SIMD_INLINE double simd_gemv_dot(const real * A, const real * x, const real * x_rows, real * y, size_t num_rows, size_t num_cols)
+{
+    // y = A * x; returns dot(x_rows, y), where x_rows are the entries of x that belong to the rows of y
+
+    double sums[SIMD_GEMV_TILE_ROWS];
+    double result = 0.0;
+    for(size_t r = 0; r < num_rows; r += SIMD_GEMV_TILE_ROWS)
+    {
+        size_t block_rows = std::min(SIMD_GEMV_TILE_ROWS, num_rows - r);
+        simd_row_block_dots<W>(A + r * num_cols, x, block_rows, num_cols, sums);
+        for(size_t k = 0; k < block_rows; k++)
+        {
+            y[r + k] = sums[k];
+            result += x_rows[r + k] * sums[k];
+        }
+    }
+    return result;
+}
+
+
+
+// instantiations of the kernels for every instruction set; the inlined templates are compiled with the target of the caller
+
+template<typename real>
+struct simd_scalar_kernels
+{
+    static double dot(const real * x, const real * y, size_t size) { return simd_dot<1>(x, y, size); }
+    static double compensated_dot(const real * x, const real * y, size_t size) { return simd_compensated_dot<1>(x, y, size); }
+    static void axpby(double alpha, const real * x, double beta, real * y, size_t size) { simd_axpby<1>(alpha, x, beta, y, size); }
+    static void gemv(double alpha, const real * A, const real * x, double beta, real * y, size_t num_rows, size_t num_cols) { simd_gemv<1>(alpha, A, x, beta, y, num_rows, num_cols); }
+    static double gemv_dot(const real * A, const real * x, const real * x_rows, real * y, size_t num_rows, size_t num_cols) { return simd_gemv_dot<1>(A, x, x_rows, y, num_rows, num_cols); }
+};
+
+#ifdef SIMD_X86
+
+template<typename real>
+struct simd_avx2_kernels
+{
+    SIMD_TARGET_AVX2 static double dot(const real * x, const real * y, size_t size) { return simd_dot<4>(x, y, size); }
+    SIMD_TARGET_AVX2 static double compensated_dot(const real * x, const real * y, size_t size) { return simd_compensated_dot<4>(x, y, size); }
+    SIMD_TARGET_AVX2 static void axpby(double alpha, const real * x, double beta, real * y, size_t size) { simd_axpby<4>(alpha, x, beta, y, size); }
+    SIMD_TARGET_AVX2 static void gemv(double alpha, const real * A, const real * x, double beta, real * y, size_t num_rows, size_t num_cols) { simd_gemv<4>(alpha, A, x, beta, y, num_rows, num_cols); }
+    SIMD_TARGET_AVX2 static double gemv_dot(const real * A, const real * x, const real * x_rows, real * y, size_t num_rows, size_t num_cols) { return simd_gemv_dot<4>(A, x, x_rows, y, num_rows, num_cols); }
+};
+
+template<typename real>
+struct simd_avx512_kernels
+{
+    SIMD_TARGET_AVX512 static double dot(const real * x, const real * y, size_t size) { return simd_dot<8>(x, y, size); }
+    SIMD_TARGET_AVX512 static double compensated_dot(const real * x, const real * y, size_t size) { return simd_compensated_dot<8>(x, y, size); }
+    SIMD_TARGET_AVX512 static void axpby(double alpha, const real * x, double beta, real * y, size_t size) { simd_axpby<8>(alpha, x, beta, y, size); }
+    SIMD_TARGET_AVX512 static void gemv(double alpha, const real * A, const real * x, double beta, real * y, size_t num_rows, size_t num_cols) { simd_gemv<8>(alpha, A, x, beta, y, num_rows, num_cols); }
+    SIMD_TARGET_AVX512 static double gemv_dot(const real * A, const real * x, const real * x_rows, real * y, size_t num_rows, size_t num_cols) { return simd_gemv_dot<8>(A, x, x_rows, y, num_rows, num_cols); }
+};
+
+#endif
+
+
+
+template<typename real>
+inline const simd_kernel_table<real> & simd_kernels(simd_isa isa)
+{
+    static const simd_kernel_table<real> scalar = { &simd_scalar_kernels<real>::dot, &simd_scalar_kernels<real>::compensated_dot, &simd_scalar_kernels<real>::axpby, &simd_scalar_kernels<real>::gemv, &simd_scalar_kernels<real>::gemv_dot };
+#ifdef SIMD_X86
+    static const simd_kernel_table<real> avx2 = { &simd_avx2_kernels<real>::dot, &simd_avx2_kernels<real>::compensated_dot, &simd_avx2_kernels<real>::axpby, &simd_avx2_kernels<real>::gemv, &simd_avx2_kernels<real>::gemv_dot };
+    static const simd_kernel_table<real> avx512 = { &simd_avx512_kernels<real>::dot, &simd_avx512_kernels<real>::compensated_dot, &simd_avx512_kernels<real>::axpby, &simd_avx512_kernels<real>::gemv, &simd_avx512_kernels<real>::gemv_dot };
+    if(isa == SIMD_AVX2) return avx2;
+    if(isa == SIMD_AVX512) return avx512;
+#endif
+    return scalar;
+}
+
+
+
+template<typename real>
+inline const simd_kernel_table<real> & simd_kernels()
+{
+    return simd_kernels<real>(active_simd_isa());
+}